@@ -6,9 +6,148 @@
 #include <fcntl.h> /*For file control options (e.g., O_RDONLY, O_WRONLY)*/     
 #include <unistd.h> /*For POSIX operating system API (e.g., read, write, close)*/
 #include <sys/ioctl.h> /*For I/O control device operations*/
+#include <string.h>
+#include <signal.h> /*For stopping a stream on SIGINT, SIGTERM or SIGPIPE*/
+#include <time.h> /*For clock_gettime, to report the rate of a stream*/
+#include <poll.h> /*For checking whether the next read would sleep*/
 
+/*
+Streaming mode: with -f after the channel, the channel is tailed on one open file until SIGINT or SIGTERM,
+or until the standard output is closed. A blocking read returns only the messages that are new to the file
+descriptor (or consumes the queue in queue mode), so every message is written once. The messages are
+collected in an output buffer, which is written to the standard output whenever the channel has nothing
+more to read, so a burst of messages costs one write. The format of the output is one of:
+lines- every message followed by a newline.
+length- every message after a struct msg_slot_ring_entry header with its channel, the input format of message_sender.
+*/
+#define STREAM_BUFFER_SIZE (1 << 20) /*The output buffer of a stream, holds many messages of the largest size*/
 
-/*A user space program to send a message*/
+static volatile sig_atomic_t stream_stopped; /*Set by the signals that end a stream*/
+
+/*Ends the stream, the blocking read is interrupted with EINTR*/
+static void stop_stream(int signal_number)
+{
+    (void)signal_number;
+    stream_stopped = 1;
+}
+
+/*Writes the whole output buffer to the standard output. Returns 0, or -1 when the output was closed*/
+static int write_stream_output(const char *output_buffer, size_t output_length)
+{
+    ssize_t written_ret;
+
+    while (output_length != 0)
+    {
+        written_ret = write(STDOUT_FILENO, output_buffer, output_length);
+        if (written_ret == -1)
+        {
+            if (errno == EINTR && !stream_stopped)
+            {
+                continue;
+            }
+            if (errno == EPIPE || errno == EINTR)
+            {
+                /*The reader of the output is gone, or the stream was stopped*/
+                return -1;
+            }
+            perror("Error");
+            exit(1);
+        }
+        output_buffer += written_ret;
+        output_length -= written_ret;
+    }
+    return 0;
+}
+
+/*Tails the channel of the device file to the standard output until the stream is stopped, and reports the rate*/
+static void stream_messages(int file, unsigned int message_channel_ID, int length_format)
+{
+    struct sigaction stop_action;
+    struct msg_slot_ring_entry header;
+    struct pollfd poll_file;
+    struct timespec start;
+    struct timespec end;
+    unsigned long message_count;
+    unsigned long byte_count;
+    char *output_buffer;
+    size_t output_length;
+    size_t header_length;
+    ssize_t read_ret;
+    double elapsed;
+
+    /*no SA_RESTART, so the signals interrupt the blocking read*/
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = stop_stream;
+    sigemptyset(&stop_action.sa_mask);
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
+    sigaction(SIGPIPE, &stop_action, NULL);
+    output_buffer = malloc(STREAM_BUFFER_SIZE);
+    if (output_buffer == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the stream buffer\n");
+        exit(1);
+    }
+    header_length = length_format ? sizeof(header) : 0;
+    output_length = 0;
+    message_count = 0;
+    byte_count = 0;
+    poll_file.fd = file;
+    poll_file.events = POLLIN;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!stream_stopped)
+    {
+        /*write the output before a read that would sleep, or when the largest message may not fit*/
+        if (output_length != 0 && (poll(&poll_file, 1, 0) == 0 ||
+                                   STREAM_BUFFER_SIZE - output_length < header_length + MAX_MESSAGE_SIZE_LIMIT + 1))
+        {
+            if (write_stream_output(output_buffer, output_length) != 0)
+            {
+                output_length = 0;
+                break;
+            }
+            output_length = 0;
+        }
+        /*the message is read straight into the output buffer, after the room of its header*/
+        read_ret = read(file, output_buffer + output_length + header_length, MAX_MESSAGE_SIZE_LIMIT);
+        if (read_ret == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            /*An error occured while reading the file*/
+            perror("Error");
+            exit(1);
+        }
+        if (read_ret == 0)
+        {
+            /*Messages are never empty, so the file has ended*/
+            break;
+        }
+        if (length_format)
+        {
+            header.channel_id = message_channel_ID;
+            header.message_length = (__u32)read_ret;
+            memcpy(output_buffer + output_length, &header, sizeof(header));
+        }
+        else
+        {
+            output_buffer[output_length + read_ret] = '\n';
+        }
+        output_length += header_length + read_ret + (length_format ? 0 : 1);
+        message_count++;
+        byte_count += read_ret;
+    }
+    write_stream_output(output_buffer, output_length);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(output_buffer);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Read %lu messages, %lu bytes in %.3f s (%.0f messages/s, %.2f MB/s)\n", message_count, byte_count,
+            elapsed, elapsed > 0 ? message_count / elapsed : 0, elapsed > 0 ? byte_count / elapsed / 1e6 : 0);
+}
+
+/*A user space program to read a message, or to tail a channel*/
 int main(int argc, char const *argv[])
 {
     int file;
@@ -16,14 +155,18 @@ int main(int argc, char const *argv[])
     unsigned int message_channel_ID;
     int dev_ioctl_ret;
     ssize_t read_ret;
-    char* read_buffer[MAX_ZISE_BUFFER];
+    static char read_buffer[MAX_MESSAGE_SIZE_LIMIT];
     ssize_t written_ret;
+    int streaming;
+    int length_format;
 
-    /*Recive 2 command line arguments*/
-    if (argc != 3)
+    /*Recive 2 command line arguments, or -f and an optional stream format after them*/
+    streaming = (argc == 4 || argc == 5) && strcmp(argv[3], "-f") == 0;
+    length_format = (argc == 5 && strcmp(argv[4], "length") == 0);
+    if ((argc != 3 && !streaming) || (argc == 5 && !length_format && strcmp(argv[4], "lines") != 0))
     {
         /*Recived number of line arguments that diffrent from 2- an error*/
-        fprintf(stderr, "Program gets 2 command line arguments\n");
+        fprintf(stderr, "Program gets 2 command line arguments: <device file> <channel> [-f [lines|length]]\n");
         exit(1);
     }
 
@@ -31,8 +174,9 @@ int main(int argc, char const *argv[])
     message_slot_file_path = argv[1]; /*The path to the message slot device file*/
     message_channel_ID = strtol(argv[2], NULL, 10); /*The target message channel ID. Assume a non - negative int*/
 
-    /*Open the specified slot device file*/
-    file = open(message_slot_file_path, O_RDONLY);
+    /*Open the specified slot device file, non-blocking so an empty channel is reported instead of waited for,
+    except in streaming mode, which waits for every new message*/
+    file = open(message_slot_file_path, streaming ? O_RDONLY : O_RDONLY | O_NONBLOCK);
     if (file < 0)
     {
         /*Couldn't open the file*/
@@ -50,18 +194,26 @@ int main(int argc, char const *argv[])
         exit(1);
     }
 
+    if (streaming)
+    {
+        /*Streaming mode- tail the channel*/
+        stream_messages(file, message_channel_ID, length_format);
+        close(file);
+        exit(0);
+    }
+
     /*Main part- read to the specified message to the message slot file,
      without the terminal null char of the C string as part of the message*/
     read_ret = -1;
-    /*read data from a file up to 128 bytes*/
-    read_ret = read(file, read_buffer, MAX_ZISE_BUFFER);
+    /*read data from a file up to the largest message size that a slot can be configured with*/
+    read_ret = read(file, read_buffer, MAX_MESSAGE_SIZE_LIMIT);
     if (read_ret == -1)
     {
         /*An error occured while writing to the file*/
         perror("Error");
         exit(1);
     }
-    if (read_ret > MAX_ZISE_BUFFER){
+    if (read_ret > MAX_MESSAGE_SIZE_LIMIT){
         /*The number of bytes read is greater than the buffer size*/
         fprintf(stderr, "The number of bytes read is greater than the buffer size\n");
         exit(1);
@@ -7,9 +7,330 @@
 #include <fcntl.h> /*For file control options (e.g., O_RDONLY, O_WRONLY)*/     
 #include <unistd.h> /*For POSIX operating system API (e.g., read, write, close)*/
 #include <sys/ioctl.h> /*For I/O control device operations*/
+#include <stdint.h>
+#include <time.h> /*For clock_gettime and nanosleep, to report the rate of a stream and wait for full queues*/
 
+/*
+Streaming mode: with -f in place of the message, the messages are read from the standard input until its end
+and written with MSG_SLOT_WRITE_BATCH, so a whole pipeline shares one open file and one ioctl per batch.
+The format of the input is one of:
+lines- every line is a message to the channel of the command line, empty lines are skipped.
+channel-lines- every line is "channel:message", the channel of the message.
+length- every message is a struct msg_slot_ring_entry header followed by the message, a channel_id of 0 is the channel of the command line.
+A batch holds at most one message of a channel in last message mode, since the later one would replace it before any reader could see it.
+The messages of such a channel are still replaced when the reader is slower than the stream, only queue mode keeps every one of them.
+*/
+#define STREAM_BUFFER_SIZE (1 << 20) /*The input buffer of a stream, holds many messages of the largest size*/
+#define STREAM_BATCH_ENTRIES 256 /*The messages written per MSG_SLOT_WRITE_BATCH*/
+#define STREAM_RETRY_MS 1 /*How long a batch with full queues waits before it is retried*/
+#define STREAM_MODE_CACHE_ENTRIES 256 /*The channels whose mode a stream remembers*/
 
-/*A user space program to send a message*/
+typedef enum stream_format {
+    STREAM_LINES,
+    STREAM_CHANNEL_LINES,
+    STREAM_LENGTH
+} stream_format;
+
+/*The state of a stream*/
+typedef struct message_stream {
+    int file; /*The message slot device file*/
+    unsigned int message_channel_ID; /*The channel of the command line*/
+    stream_format format; /*The format of the input*/
+    char *buffer; /*The input buffer, the entries point into it*/
+    struct msg_slot_batch_entry entries[STREAM_BATCH_ENTRIES]; /*The messages of the next batch*/
+    unsigned int entry_count; /*The number of messages of the next batch*/
+    unsigned long message_count; /*The number of messages written*/
+    unsigned long byte_count; /*The number of bytes written*/
+    struct {
+        unsigned int channel_id; /*The channel, 0 for an empty entry*/
+        unsigned int queue_depth; /*Its queue depth when the stream first wrote to it, 0 in last message mode*/
+    } channel_modes[STREAM_MODE_CACHE_ENTRIES]; /*The modes of the channels, indexed by channel ID modulo the size*/
+} message_stream;
+
+/*Returns the format of a stream by its name, exits on an unknown one*/
+static stream_format parse_stream_format(const char *format_name)
+{
+    if (strcmp(format_name, "lines") == 0)
+    {
+        return STREAM_LINES;
+    }
+    if (strcmp(format_name, "channel-lines") == 0)
+    {
+        return STREAM_CHANNEL_LINES;
+    }
+    if (strcmp(format_name, "length") == 0)
+    {
+        return STREAM_LENGTH;
+    }
+    fprintf(stderr, "The stream format must be lines, channel-lines or length\n");
+    exit(1);
+}
+
+/*
+Writes the messages of the next batch. Messages of a channel whose queue is full get EAGAIN, and the device fails
+the later messages of that channel in the batch too- they are retried in order,
+every STREAM_RETRY_MS until a reader made room. Exits on any other error.
+*/
+static void flush_message_batch(message_stream *stream)
+{
+    struct msg_slot_batch batch;
+    unsigned int retry_count;
+    unsigned int i;
+    struct timespec retry_interval;
+    long written_ret;
+
+    while (stream->entry_count != 0)
+    {
+        batch.entries = (uint64_t)(uintptr_t)stream->entries;
+        batch.count = stream->entry_count;
+        batch.reserved = 0;
+        written_ret = ioctl(stream->file, MSG_SLOT_WRITE_BATCH, &batch);
+        if (written_ret < 0)
+        {
+            /*The batch itself is not valid*/
+            perror("Error");
+            exit(1);
+        }
+        retry_count = 0;
+        for (i = 0; i < stream->entry_count; i++)
+        {
+            if (stream->entries[i].status == 0)
+            {
+                stream->message_count++;
+                stream->byte_count += stream->entries[i].length;
+                continue;
+            }
+            if (stream->entries[i].status != -EAGAIN)
+            {
+                /*The message was not written*/
+                fprintf(stderr, "Error: message to channel %u: %s\n", stream->entries[i].channel_id, strerror(-stream->entries[i].status));
+                exit(1);
+            }
+            stream->entries[retry_count++] = stream->entries[i];
+        }
+        stream->entry_count = retry_count;
+        if (retry_count != 0)
+        {
+            /*the full queues may be of any channel, so the batch waits out the interval rather than polling the file descriptor's own channel*/
+            retry_interval.tv_sec = 0;
+            retry_interval.tv_nsec = STREAM_RETRY_MS * 1000000L;
+            nanosleep(&retry_interval, NULL);
+        }
+    }
+}
+
+/*
+Returns whether a channel is in queue mode, asked with MSG_SLOT_CHANNEL_STATS the first time and remembered after.
+A channel that does not exist yet starts in last message mode.
+*/
+static int stream_channel_queues(message_stream *stream, unsigned int message_channel_ID)
+{
+    struct msg_slot_channel_stats channel_stats;
+    unsigned int cache_index;
+
+    cache_index = message_channel_ID % STREAM_MODE_CACHE_ENTRIES;
+    if (stream->channel_modes[cache_index].channel_id != message_channel_ID)
+    {
+        memset(&channel_stats, 0, sizeof(channel_stats));
+        channel_stats.channel_id = message_channel_ID;
+        if (ioctl(stream->file, MSG_SLOT_CHANNEL_STATS, &channel_stats) != 0)
+        {
+            channel_stats.queue_depth = 0;
+        }
+        stream->channel_modes[cache_index].channel_id = message_channel_ID;
+        stream->channel_modes[cache_index].queue_depth = channel_stats.queue_depth;
+    }
+    return stream->channel_modes[cache_index].queue_depth != 0;
+}
+
+/*Returns whether the next batch already has a message of a channel*/
+static int batch_has_channel(message_stream *stream, unsigned int message_channel_ID)
+{
+    unsigned int i;
+
+    for (i = 0; i < stream->entry_count; i++)
+    {
+        if (stream->entries[i].channel_id == message_channel_ID)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+Adds a message to the next batch, and writes the batch when it is full.
+A second message of a channel in last message mode writes the batch first, so the first message is published on its own.
+*/
+static void add_stream_message(message_stream *stream, unsigned int message_channel_ID, const char *message, size_t message_length)
+{
+    struct msg_slot_batch_entry *entry;
+
+    if (batch_has_channel(stream, message_channel_ID) && !stream_channel_queues(stream, message_channel_ID))
+    {
+        flush_message_batch(stream);
+    }
+    entry = &stream->entries[stream->entry_count++];
+    entry->channel_id = message_channel_ID;
+    entry->length = (uint32_t)message_length;
+    entry->buffer = (uint64_t)(uintptr_t)message;
+    entry->status = 0;
+    entry->reserved = 0;
+    if (stream->entry_count == STREAM_BATCH_ENTRIES)
+    {
+        flush_message_batch(stream);
+    }
+}
+
+/*
+Adds a line of the input to the next batch, the line has no newline. In channel-lines format
+the line starts with its channel and a colon. Exits on a line that is not valid.
+*/
+static void add_stream_line(message_stream *stream, char *line, size_t line_length)
+{
+    unsigned int message_channel_ID;
+    char *message;
+    char *line_end;
+
+    message_channel_ID = stream->message_channel_ID;
+    message = line;
+    if (stream->format == STREAM_CHANNEL_LINES)
+    {
+        line_end = line + line_length;
+        message = memchr(line, ':', line_length);
+        if (message == NULL || message == line)
+        {
+            fprintf(stderr, "A line of the stream has no channel\n");
+            exit(1);
+        }
+        *message = '\0'; /*the colon ends the channel for strtoul*/
+        message_channel_ID = strtoul(line, NULL, 10);
+        message++;
+        line_length = line_end - message;
+    }
+    if (line_length == 0)
+    {
+        /*Nothing to send, the device does not take empty messages*/
+        return;
+    }
+    add_stream_message(stream, message_channel_ID, message, line_length);
+}
+
+/*
+Adds the complete messages of the input buffer to the batch, writing every full batch.
+At the end of the input a last line without a newline is a message too.
+Returns the number of bytes that were consumed, the rest is the start of a message that was not read yet.
+*/
+static size_t parse_stream_buffer(message_stream *stream, size_t buffer_length, int input_ended)
+{
+    struct msg_slot_ring_entry header;
+    size_t position;
+    char *line_end;
+
+    position = 0;
+    while (position < buffer_length)
+    {
+        if (stream->format == STREAM_LENGTH)
+        {
+            if (buffer_length - position < sizeof(header))
+            {
+                break;
+            }
+            memcpy(&header, stream->buffer + position, sizeof(header));
+            if (header.message_length == 0 || header.message_length > STREAM_BUFFER_SIZE - sizeof(header))
+            {
+                fprintf(stderr, "A message of the stream has a length that is not valid\n");
+                exit(1);
+            }
+            if (buffer_length - position - sizeof(header) < header.message_length)
+            {
+                break;
+            }
+            add_stream_message(stream, header.channel_id != 0 ? header.channel_id : stream->message_channel_ID,
+                               stream->buffer + position + sizeof(header), header.message_length);
+            position += sizeof(header) + header.message_length;
+            continue;
+        }
+        line_end = memchr(stream->buffer + position, '\n', buffer_length - position);
+        if (line_end == NULL)
+        {
+            if (!input_ended)
+            {
+                break;
+            }
+            line_end = stream->buffer + buffer_length;
+        }
+        add_stream_line(stream, stream->buffer + position, line_end - (stream->buffer + position));
+        position = line_end - stream->buffer + 1;
+    }
+    return position < buffer_length ? position : buffer_length;
+}
+
+/*Writes the messages of the standard input to the device file until the input ends, and reports the rate*/
+static void stream_messages(int file, unsigned int message_channel_ID, stream_format format)
+{
+    static message_stream stream;
+    struct timespec start;
+    struct timespec end;
+    size_t buffer_length;
+    size_t consumed;
+    ssize_t read_ret;
+    double elapsed;
+    int input_ended;
+
+    stream.file = file;
+    stream.message_channel_ID = message_channel_ID;
+    stream.format = format;
+    stream.buffer = malloc(STREAM_BUFFER_SIZE);
+    if (stream.buffer == NULL)
+    {
+        fprintf(stderr, "Failed to allocate the stream buffer\n");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    buffer_length = 0;
+    input_ended = 0;
+    while (!input_ended)
+    {
+        read_ret = read(STDIN_FILENO, stream.buffer + buffer_length, STREAM_BUFFER_SIZE - buffer_length);
+        if (read_ret == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            /*An error occured while reading the input*/
+            perror("Error");
+            exit(1);
+        }
+        input_ended = (read_ret == 0);
+        buffer_length += read_ret;
+        consumed = parse_stream_buffer(&stream, buffer_length, input_ended);
+        /*the batch points into the buffer, so it is written before the buffer is reused*/
+        flush_message_batch(&stream);
+        if (consumed == 0 && buffer_length == STREAM_BUFFER_SIZE)
+        {
+            /*A message does not fit in the buffer*/
+            fprintf(stderr, "A message of the stream is longer than %d bytes\n", STREAM_BUFFER_SIZE);
+            exit(1);
+        }
+        if (input_ended && consumed != buffer_length)
+        {
+            /*The input ended in the middle of a length- delimited message*/
+            fprintf(stderr, "The stream ended in the middle of a message\n");
+            exit(1);
+        }
+        memmove(stream.buffer, stream.buffer + consumed, buffer_length - consumed);
+        buffer_length -= consumed;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(stream.buffer);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Sent %lu messages, %lu bytes in %.3f s (%.0f messages/s, %.2f MB/s)\n", stream.message_count, stream.byte_count,
+            elapsed, elapsed > 0 ? stream.message_count / elapsed : 0, elapsed > 0 ? stream.byte_count / elapsed / 1e6 : 0);
+}
+
+/*A user space program to send a message, or a stream of messages from the standard input*/
 int main(int argc, char const *argv[])
 {
     int file;
@@ -19,11 +340,14 @@ int main(int argc, char const *argv[])
     int dev_ioctl_ret;
     ssize_t message_length;
     ssize_t written_ret;
-    /*Recive 3 command line arguments*/
-    if (argc != 4)
+    stream_format format;
+    int streaming;
+    /*Recive 3 command line arguments, or 4 when the message is -f and the optional 4th is the stream format*/
+    streaming = (argc == 4 || argc == 5) && strcmp(argv[3], "-f") == 0;
+    if (argc != 4 && !(argc == 5 && streaming))
     {
         /*Recived number of line arguments that diffrent from 3- an error*/
-        fprintf(stderr, "Program gets 3 command line arguments\n");
+        fprintf(stderr, "Program gets 3 command line arguments: <device file> <channel> <message | -f [lines|channel-lines|length]>\n");
         exit(1);
     }
 
@@ -31,6 +355,7 @@ int main(int argc, char const *argv[])
     message_slot_file_path = argv[1]; /*The path to the message slot device file*/
     message_channel_ID = strtol(argv[2], NULL, 10); /*The target message channel ID. Assume a non - negative int*/
     message = argv[3]; /*The messade to pass*/
+    format = parse_stream_format(argc == 5 ? argv[4] : "lines"); /*Only used when streaming*/
 
     /*Open the specified slot device file*/
     file = open(message_slot_file_path, O_WRONLY);
@@ -52,6 +377,14 @@ int main(int argc, char const *argv[])
         exit(1);
     }
 
+    if (streaming)
+    {
+        /*Streaming mode- the messages come from the standard input*/
+        stream_messages(file, message_channel_ID, format);
+        close(file);
+        exit(0);
+    }
+
     /*Main part- write to the specified message to the message slot file,
      without the terminal null char of the C string as part of the message*/
     written_ret = -1;
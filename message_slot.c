@@ -2,7 +2,9 @@
 #undef __KERNEL__
 #define __KERNEL__
 #undef MODULE
-#define MODULE
+#if !IS_BUILTIN(CONFIG_MESSAGE_SLOT)
+#define MODULE /*built into the kernel, as KUnit runs it under UML, the module is initialized by a device initcall*/
+#endif
 
 /*
 This code includes necessary libraries for the message_slot module:
@@ -10,348 +12,2603 @@ This code includes necessary libraries for the message_slot module:
 #include <linux/kernel.h> /*kernel.h for basic types and macros*/
 #include <linux/module.h> /*module.h for module operations*/
 #include <linux/fs.h> /*fs.h for file system operations*/
+#include <linux/cdev.h> /*cdev.h for registering the range of minors of the device*/
+#include <linux/device.h> /*device.h for the device class that creates the device files*/
 #include <linux/uaccess.h> /*uaccess.h for user-kernel space data transfer*/
 #include <linux/string.h> /*string.h for string operations*/
 #include <linux/errno.h> /*errno.h for system error numbers*/
 #include <linux/slab.h> /*slab.h for memory allocation*/
+#include <linux/xarray.h> /*xarray.h for the channel index of every message slot*/
+#include <linux/kref.h> /*kref.h for the reference count of every message channel*/
+#include <linux/mutex.h> /*mutex.h for serializing the allocation of message slots*/
+#include <linux/spinlock.h> /*spinlock.h for serializing the writers of a message slot*/
+#include <linux/rcupdate.h> /*rcupdate.h for lock-free lookup and freeing of message channels*/
+#include <linux/wait.h> /*wait.h for readers blocking until a new message is written*/
+#include <linux/poll.h> /*poll.h for poll/epoll readiness of a channel*/
+#include <linux/mm.h> /*mm.h for kvmalloc of the message queues and of large messages*/
+#include <linux/refcount.h> /*refcount.h for the reference count of every message payload*/
+#include <linux/overflow.h> /*overflow.h for sizing the message payloads*/
+#include <linux/topology.h> /*topology.h for allocating on the NUMA node of the writer*/
+#include <linux/vmalloc.h> /*vmalloc.h for mapping the pages of the shared rings in the kernel*/
+#include <linux/uio.h> /*uio.h for the iov_iter of read_iter and write_iter*/
+#include <linux/percpu.h> /*percpu.h for the statistics counters of the slots and channels*/
+#include <linux/debugfs.h> /*debugfs.h for exposing the statistics of the message slots*/
+#include <linux/seq_file.h> /*seq_file.h for printing the statistics file*/
+#include <linux/jump_label.h> /*jump_label.h for the static key that turns the latency histograms on*/
+#include <linux/ktime.h> /*ktime.h for timing the phases of the latency histograms*/
+#include <linux/log2.h> /*log2.h for the buckets of the latency histograms*/
+#include <linux/sched/signal.h> /*sched/signal.h for stopping a long restore on a fatal signal*/
+#include <linux/capability.h> /*capability.h for letting only administrators restore a snapshot*/
 #include "message_slot.h" /*message_slot.h for specific functionality of the message_slot module*/
+#include "message_slot_core.h" /*message_slot_core.h for the payloads, channels and channel index of the slots*/
+#define CREATE_TRACE_POINTS
+#include "message_slot_trace.h" /*message_slot_trace.h for the tracepoints of the module*/
 
 MODULE_LICENSE("GPL"); /*GNU General Public License*/
 /*A kernel implementing the messege slot IPC(inter process communication) mechanism*/
 
-/*single message channel struct*/
-typedef struct single_message_channel {
-    unsigned int message_channel_ID; /*The message channel ID*/
-    char message[MAX_ZISE_BUFFER]; /*The message that the user wants to send*/
-    unsigned int message_length; /*The length of the message*/
-    struct single_message_channel *next; /*Pointer to the next message channel*/
-} single_message_channel;
+struct message_slot;
 
-/*message_slot struct, a character device file that contains multiple message channels active concurrently*/
-typedef struct message_slot {
-    single_message_channel *head; /*Pointer to the first message channel*/
-} message_slot;
+/*
+A ring shared with user space through mmap, producers and consumers exchange messages
+through it without system calls. The header and the entries live in user writable memory,
+so the kernel keeps its own copy of the geometry and validates every entry it consumes.
+*/
+typedef struct message_slot_ring {
+    void *memory; /*The vmap of the pages that are mapped, header page followed by the entries*/
+    size_t size; /*The size of the area*/
+    struct page **pages; /*The pages of the area, allocated one by one so they are charged to the memory cgroup*/
+    unsigned int page_count; /*The number of pages*/
+    struct msg_slot_ring_header *header; /*The header at the start of the area*/
+    char *entries; /*The first entry, MSG_SLOT_RING_ENTRIES_OFFSET bytes into the area*/
+    unsigned int entry_count; /*The number of entries, a power of two*/
+    unsigned int entry_size; /*The size of an entry*/
+    unsigned int max_message_size; /*The longest message that an entry holds*/
+} message_slot_ring;
 
 /*data_file struct that contains the  minor and the channel id*/
 typedef struct data_file {
     unsigned int minor; /*The minor number of the device file*/
     unsigned int channel_id; /*The channel ID of the message slot*/
+    single_message_channel __rcu *channel; /*The channel resolved by device_ioctl, holds a reference on it*/
+    u64 last_read_sequence; /*The message_sequence of the last message read through this file descriptor*/
 } data_file;
 
 
-/*save the number of messages that the device drive has already created*/
-static int count_individual_message_slot = 0;
+/*The message slots by minor, sparse so that minors that were never used cost nothing*/
+/*A message slot is allocated only when the first channel of its minor is selected, and lives until the module is unloaded*/
+static DEFINE_XARRAY(message_slot_xarray);
+
+/*The number of minors of the device, every minor can have a message slot*/
+static unsigned int minor_count = MAX_NUMBER_OF_MINOR_DEVICES;
+module_param(minor_count, uint, 0444);
+MODULE_PARM_DESC(minor_count, "Number of message slot minors, up to 1048576");
+
+/*
+The number of minors that get a device file when the module is loaded, the first ones.
+A device file costs a struct device and its sysfs entries, so the other minors cost nothing until
+someone creates their device file with mknod, using the major of the module.
+*/
+static unsigned int device_file_count = MAX_NUMBER_OF_MINOR_DEVICES;
+module_param(device_file_count, uint, 0444);
+MODULE_PARM_DESC(device_file_count, "Number of minors that get a /dev/message_slot<minor> file, at most minor_count");
+
+/*The first device number of the minors, its major is allocated dynamically*/
+static dev_t message_slot_first_device;
+
+/*The character device of all the minors*/
+static struct cdev message_slot_cdev;
+
+/*The device class, creates /dev/message_slot<minor> for every minor*/
+static struct class *message_slot_class;
+
+/*The max message size of new message slots, a slot can change its own with MSG_SLOT_MAX_MESSAGE_SIZE*/
+static unsigned int max_message_size = MAX_ZISE_BUFFER;
+module_param(max_message_size, uint, 0444);
+MODULE_PARM_DESC(max_message_size, "Default max message size of a message slot in bytes, up to 65536");
+
+/*The memory budgets of message_slot_core.h, idle channels are evicted to stay within them*/
+module_param_named(memory_limit, message_slot_memory_limit, ulong, 0644);
+MODULE_PARM_DESC(memory_limit, "Memory budget of all the message slots together in bytes, 0 for no budget");
+module_param(slot_memory_limit, ulong, 0644);
+MODULE_PARM_DESC(slot_memory_limit, "Memory budget of every message slot in bytes, 0 for no budget");
+
+/*Slab cache of the per file descriptor data_file structs, the store's caches are in message_slot_core.h*/
+static struct kmem_cache *data_file_cache;
+
+/*The debugfs directory of the module, message_slot/stats prints the statistics of every message slot*/
+static struct dentry *message_slot_debugfs_dir;
+
+/*
+MESSAGE SLOT FUNCTIONS
+*/
+/*
+Returns the message slot of a minor, allocating it on first use.
+Returns the slot on success, or ERR_PTR(-ENOMEM) on memory allocation failure.
+*/
+static message_slot* find_or_create_message_slot(unsigned int minor)
+{
+    message_slot *current_message_slot;
+    message_slot *existing_message_slot;
+
+    /*fast path- the slot was already allocated*/
+    current_message_slot = xa_load(&message_slot_xarray, minor);
+    if (current_message_slot != NULL)
+    {
+        return current_message_slot;
+    }
+    /*first channel of this minor, allocate its message slot*/
+    current_message_slot = alloc_message_slot(minor, max_message_size);
+    if (current_message_slot == NULL)
+    {
+        printk(KERN_ERR "message_slot: Failed to allocate memory for the message_slot\n");
+        return ERR_PTR(-ENOMEM);
+    }
+    /*publish the slot, unless another file descriptor of this minor published one first*/
+    existing_message_slot = xa_cmpxchg(&message_slot_xarray, minor, NULL, current_message_slot, GFP_KERNEL);
+    if (xa_is_err(existing_message_slot))
+    {
+        /*The index could not allocate its internal nodes*/
+        free_message_slot(current_message_slot);
+        printk(KERN_ERR "message_slot: Failed to allocate memory for the message_slot index\n");
+        return ERR_PTR(xa_err(existing_message_slot));
+    }
+    if (existing_message_slot != NULL)
+    {
+        /*lost the race, nobody saw our slot so it is freed right away*/
+        free_message_slot(current_message_slot);
+        return existing_message_slot;
+    }
+    return current_message_slot;
+}
+
+/*
+Sets the max message size of the file descriptor's message slot.
+Messages that are already stored are kept even if they are longer.
+Returns SUCCESS, or an error code on failure.
+*/
+static long set_slot_max_message_size(data_file *current_data_file, unsigned long new_max_message_size)
+{
+    message_slot *current_message_slot;
+
+    if (new_max_message_size == 0 || new_max_message_size > MAX_MESSAGE_SIZE_LIMIT)
+    {
+        /*The max message size is not valid*/
+        return -EINVAL;
+    }
+    current_message_slot = find_or_create_message_slot(current_data_file->minor);
+    if (IS_ERR(current_message_slot))
+    {
+        /*If allocate memory fialed, exit*/
+        return PTR_ERR(current_message_slot);
+    }
+    WRITE_ONCE(current_message_slot->max_message_size, new_max_message_size);
+    return SUCCESS;
+}
+
+/*
+Deletes a channel of the file descriptor's message slot with its messages, see delete_single_message_channel.
+A channel that a file descriptor has selected, including this one, is in use and is not deleted.
+Returns SUCCESS, -EINVAL if the channel does not exist, or -EBUSY if it is in use.
+*/
+static long delete_slot_channel(data_file *current_data_file, unsigned long channel_id)
+{
+    message_slot *current_message_slot;
+
+    if (channel_id == 0 || channel_id > UINT_MAX)
+    {
+        /*The channel id is not valid*/
+        return -EINVAL;
+    }
+    current_message_slot = xa_load(&message_slot_xarray, current_data_file->minor);
+    if (current_message_slot == NULL)
+    {
+        /*No channel of this minor was ever selected*/
+        return -EINVAL;
+    }
+    return delete_single_message_channel(current_message_slot, (unsigned int)channel_id);
+}
+
+/*
+LATENCY HISTOGRAM FUNCTIONS
+*/
+/*
+The phases that the latency histograms time. They are off by default and turned on by writing 1 to
+debugfs message_slot/latency_enable, until then every phase costs a single not taken static branch.
+*/
+enum message_slot_latency_phase {
+    LATENCY_CHANNEL_LOOKUP, /*A lookup of a channel in the index of its slot*/
+    LATENCY_READ_COPY, /*The copy of a message to the reader*/
+    LATENCY_WRITE_COPY, /*The copy of a message from the writer*/
+    MESSAGE_SLOT_LATENCY_PHASES
+};
+
+static const char *message_slot_latency_phase_names[MESSAGE_SLOT_LATENCY_PHASES] = {
+    "channel_lookup",
+    "read_copy",
+    "write_copy",
+};
+
+/*Bucket i counts the phases that took [2^i, 2^(i+1)) nanoseconds, the last one also counts all the longer ones*/
+#define MESSAGE_SLOT_LATENCY_BUCKETS 32
+typedef struct message_slot_latency_histogram {
+    u64 buckets[MESSAGE_SLOT_LATENCY_BUCKETS];
+} message_slot_latency_histogram;
+
+static DEFINE_STATIC_KEY_FALSE(message_slot_latency_enabled);
+static DEFINE_PER_CPU(message_slot_latency_histogram [MESSAGE_SLOT_LATENCY_PHASES], message_slot_latency_histograms);
+
+/*Returns the start time of a timed phase, or 0 while the latency histograms are off*/
+static inline u64 latency_phase_start(void)
+{
+    if (static_branch_unlikely(&message_slot_latency_enabled))
+    {
+        return ktime_get_ns();
+    }
+    return 0;
+}
+
+/*Counts the time since latency_phase_start in the histogram of a phase*/
+static inline void latency_phase_end(enum message_slot_latency_phase phase, u64 start)
+{
+    u64 elapsed;
+    unsigned int bucket;
+
+    if (!static_branch_unlikely(&message_slot_latency_enabled) || start == 0)
+    {
+        /*The histograms are off, or were turned on during the phase*/
+        return;
+    }
+    elapsed = ktime_get_ns() - start;
+    bucket = elapsed == 0 ? 0 : min_t(unsigned int, ilog2(elapsed), MESSAGE_SLOT_LATENCY_BUCKETS - 1);
+    this_cpu_inc(message_slot_latency_histograms[phase].buckets[bucket]);
+}
+
+/*Prints the non-empty buckets of every phase, read from debugfs message_slot/latency*/
+static int message_slot_latency_show(struct seq_file *latency_file, void *unused)
+{
+    u64 bucket_count;
+    int phase;
+    int bucket;
+    int cpu;
+
+    for (phase = 0; phase < MESSAGE_SLOT_LATENCY_PHASES; phase++)
+    {
+        seq_printf(latency_file, "%s\n", message_slot_latency_phase_names[phase]);
+        for (bucket = 0; bucket < MESSAGE_SLOT_LATENCY_BUCKETS; bucket++)
+        {
+            bucket_count = 0;
+            for_each_possible_cpu(cpu)
+            {
+                bucket_count += READ_ONCE(per_cpu(message_slot_latency_histograms, cpu)[phase].buckets[bucket]);
+            }
+            if (bucket_count != 0)
+            {
+                seq_printf(latency_file, "    %llu ns: %llu\n", 1ULL << bucket, bucket_count);
+            }
+        }
+    }
+    return SUCCESS;
+}
+DEFINE_SHOW_ATTRIBUTE(message_slot_latency);
+
+/*Reports whether the latency histograms are on, read from debugfs message_slot/latency_enable*/
+static int message_slot_latency_enable_get(void *data, u64 *enabled)
+{
+    *enabled = static_key_enabled(&message_slot_latency_enabled);
+    return SUCCESS;
+}
+
+/*Turns the latency histograms on or off, written to debugfs message_slot/latency_enable*/
+static int message_slot_latency_enable_set(void *data, u64 enabled)
+{
+    if (enabled)
+    {
+        static_branch_enable(&message_slot_latency_enabled);
+    }
+    else
+    {
+        static_branch_disable(&message_slot_latency_enabled);
+    }
+    return SUCCESS;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(message_slot_latency_enable_fops, message_slot_latency_enable_get, message_slot_latency_enable_set, "%llu\n");
+
+/*
+Copies a payload that was found under RCU to the reader's iov_iter, which must have room for the whole message.
+Must be called inside an RCU read-side section, which it leaves.
+The copy is first tried with page faults disabled so that the reader writes nothing shared,
+only if the user buffer is not resident the iterator is rewound and the payload is pinned and copied with faults allowed.
+Returns 0 on success, -EAGAIN if the payload was replaced before it could be pinned, or -EFAULT.
+*/
+static int copy_message_payload_to_iter(message_payload *payload, struct iov_iter *to) __releases(RCU)
+{
+    size_t copied;
+    size_t message_length = payload->message_length;
+    u64 copy_start;
+
+    copy_start = latency_phase_start();
+    pagefault_disable();
+    copied = copy_to_iter(payload->message, message_length, to);
+    pagefault_enable();
+    if (copied == message_length)
+    {
+        rcu_read_unlock();
+        latency_phase_end(LATENCY_READ_COPY, copy_start);
+        return 0;
+    }
+    iov_iter_revert(to, copied);
+    if (!refcount_inc_not_zero(&payload->refcount))
+    {
+        /*A writer replaced the payload meanwhile*/
+        rcu_read_unlock();
+        return -EAGAIN;
+    }
+    rcu_read_unlock();
+    copied = copy_to_iter(payload->message, message_length, to);
+    latency_phase_end(LATENCY_READ_COPY, copy_start);
+    /*The payload may be freed once the reference is dropped*/
+    put_message_payload(payload);
+    return copied == message_length ? 0 : -EFAULT;
+}
+
+/*
+CHANNEL LOOKUP FUNCTIONS
+*/
+/*
+Finds a channel of a message slot with find_single_message_channel, or with find_or_create_single_message_channel
+when create is set. Every lookup of the module goes through here, so it is timed and traced in one place.
+Returns the channel with a reference held, NULL if it does not exist and was not created, or an ERR_PTR.
+*/
+static single_message_channel* lookup_slot_channel(message_slot *current_message_slot, unsigned int channel_id, bool create)
+{
+    single_message_channel *current_single_message_channel;
+    u64 lookup_start;
+
+    lookup_start = latency_phase_start();
+    if (create)
+    {
+        current_single_message_channel = find_or_create_single_message_channel(current_message_slot, channel_id);
+    }
+    else
+    {
+        current_single_message_channel = find_single_message_channel(current_message_slot, channel_id);
+    }
+    latency_phase_end(LATENCY_CHANNEL_LOOKUP, lookup_start);
+    trace_message_slot_channel_lookup(current_message_slot->minor, channel_id, atomic_read(&current_message_slot->channel_count),
+                                      !IS_ERR_OR_NULL(current_single_message_channel));
+    return current_single_message_channel;
+}
+
+/*
+Takes a reference on the channel that device_ioctl resolved for a file descriptor.
+Used by the paths that sleep and therefore cannot stay in an RCU read-side section.
+Returns the channel, or NULL if no channel was selected yet.
+*/
+static single_message_channel* get_data_file_channel(data_file *current_data_file)
+{
+    single_message_channel *current_single_message_channel;
+
+    rcu_read_lock();
+    current_single_message_channel = rcu_dereference(current_data_file->channel);
+    if (current_single_message_channel != NULL && !kref_get_unless_zero(&current_single_message_channel->refcount))
+    {
+        /*device_ioctl switched the file descriptor to another channel meanwhile*/
+        current_single_message_channel = NULL;
+    }
+    rcu_read_unlock();
+    return current_single_message_channel;
+}
+
+/*
+STATISTICS FUNCTIONS
+*/
+/*Adds up the per CPU counters of a slot, the sum is not a snapshot of concurrent operations*/
+static void sum_message_slot_stats(message_slot_stats __percpu *stats, message_slot_stats *total)
+{
+    message_slot_stats *cpu_stats;
+    int cpu;
+
+    memset(total, 0, sizeof(*total));
+    for_each_possible_cpu(cpu)
+    {
+        cpu_stats = per_cpu_ptr(stats, cpu);
+        total->reads += READ_ONCE(cpu_stats->reads);
+        total->read_bytes += READ_ONCE(cpu_stats->read_bytes);
+        total->read_misses += READ_ONCE(cpu_stats->read_misses);
+        total->writes += READ_ONCE(cpu_stats->writes);
+        total->write_bytes += READ_ONCE(cpu_stats->write_bytes);
+        total->no_space_errors += READ_ONCE(cpu_stats->no_space_errors);
+        total->message_size_errors += READ_ONCE(cpu_stats->message_size_errors);
+        total->evictions += READ_ONCE(cpu_stats->evictions);
+    }
+}
+
+/*
+Copies the statistics of a channel of the file descriptor's message slot to user space.
+The channel is the one in channel_id, or the file descriptor's own channel when channel_id is 0.
+Returns SUCCESS, or -EINVAL if the channel does not exist, or -EFAULT.
+*/
+static long get_channel_stats(data_file *current_data_file, unsigned long ioctl_param)
+{
+    struct msg_slot_channel_stats channel_stats;
+    message_slot *current_message_slot;
+    single_message_channel *current_single_message_channel;
+
+    if (copy_from_user(&channel_stats, (void __user*)ioctl_param, sizeof(channel_stats)) != 0)
+    {
+        /*The argument is not valid*/
+        return -EFAULT;
+    }
+    if (channel_stats.channel_id == 0)
+    {
+        current_single_message_channel = get_data_file_channel(current_data_file);
+    }
+    else
+    {
+        current_single_message_channel = NULL;
+        current_message_slot = xa_load(&message_slot_xarray, current_data_file->minor);
+        if (current_message_slot != NULL)
+        {
+            current_single_message_channel = lookup_slot_channel(current_message_slot, channel_stats.channel_id, false);
+        }
+    }
+    if (current_single_message_channel == NULL)
+    {
+        /*The channel does not exist*/
+        return -EINVAL;
+    }
+    memset(&channel_stats, 0, sizeof(channel_stats));
+    channel_stats.channel_id = current_single_message_channel->message_channel_ID;
+    channel_stats.queue_depth = READ_ONCE(current_single_message_channel->queue_depth);
+    channel_stats.queue_count = READ_ONCE(current_single_message_channel->queue_count);
+    channel_stats.message_sequence = READ_ONCE(current_single_message_channel->message_sequence);
+    channel_stats.reads = atomic64_read(&current_single_message_channel->stats.reads);
+    channel_stats.read_bytes = atomic64_read(&current_single_message_channel->stats.read_bytes);
+    channel_stats.read_misses = atomic64_read(&current_single_message_channel->stats.read_misses);
+    channel_stats.writes = atomic64_read(&current_single_message_channel->stats.writes);
+    channel_stats.write_bytes = atomic64_read(&current_single_message_channel->stats.write_bytes);
+    channel_stats.no_space_errors = atomic64_read(&current_single_message_channel->stats.no_space_errors);
+    channel_stats.message_size_errors = atomic64_read(&current_single_message_channel->stats.message_size_errors);
+    put_single_message_channel(current_single_message_channel);
+    if (copy_to_user((void __user*)ioctl_param, &channel_stats, sizeof(channel_stats)) != 0)
+    {
+        return -EFAULT;
+    }
+    return SUCCESS;
+}
+
+/*Prints a line of statistics for every message slot that was allocated, read from debugfs message_slot/stats*/
+static int message_slot_stats_show(struct seq_file *stats_file, void *unused)
+{
+    message_slot *current_message_slot;
+    message_slot_stats total;
+    unsigned long minor;
+
+    seq_puts(stats_file, "minor channels reads read_bytes read_misses writes write_bytes enospc emsgsize memory evictions\n");
+    /*only the minors that have a message slot are visited*/
+    xa_for_each(&message_slot_xarray, minor, current_message_slot)
+    {
+        sum_message_slot_stats(current_message_slot->stats, &total);
+        seq_printf(stats_file, "%lu %d %llu %llu %llu %llu %llu %llu %llu %ld %llu\n", minor, atomic_read(&current_message_slot->channel_count),
+                   total.reads, total.read_bytes, total.read_misses, total.writes, total.write_bytes,
+                   total.no_space_errors, total.message_size_errors,
+                   atomic_long_read(&current_message_slot->memory_bytes), total.evictions);
+    }
+    return SUCCESS;
+}
+DEFINE_SHOW_ATTRIBUTE(message_slot_stats);
+
+/*
+MESSAGE FUNCTIONS
+*/
+/*Wakes the blocking readers and pollers of a channel, and of its subscribers, after a message was written*/
+static void wake_channel_readers(single_message_channel *current_single_message_channel)
+{
+    message_subscribers *subscribers;
+    unsigned int i;
+
+    if (wq_has_sleeper(&current_single_message_channel->readers_wait))
+    {
+        wake_up_interruptible_poll(&current_single_message_channel->readers_wait, EPOLLIN | EPOLLRDNORM);
+    }
+    if (rcu_access_pointer(current_single_message_channel->subscribers) == NULL)
+    {
+        return;
+    }
+    /*the list may have been replaced since the message was published, a new subscriber gets a spurious wakeup at worst*/
+    rcu_read_lock();
+    subscribers = rcu_dereference(current_single_message_channel->subscribers);
+    for (i = 0; subscribers != NULL && i < subscribers->count; i++)
+    {
+        if (wq_has_sleeper(&subscribers->channels[i]->readers_wait))
+        {
+            wake_up_interruptible_poll(&subscribers->channels[i]->readers_wait, EPOLLIN | EPOLLRDNORM);
+        }
+    }
+    rcu_read_unlock();
+}
+
+/*Wakes the writers and pollers waiting for room in a channel's queue after a message was consumed*/
+static void wake_channel_writers(single_message_channel *current_single_message_channel)
+{
+    if (wq_has_sleeper(&current_single_message_channel->writers_wait))
+    {
+        wake_up_interruptible_poll(&current_single_message_channel->writers_wait, EPOLLOUT | EPOLLWRNORM);
+    }
+}
+
+/*
+Delivers a message to a channel without sleeping- it replaces the last message,
+or is appended to the queue in queue mode. Takes over the caller's payload reference on success.
+Returns SUCCESS, or -EAGAIN if the channel's queue is full.
+*/
+static int deliver_message_payload(single_message_channel *current_single_message_channel, message_payload *payload)
+{
+    spin_lock(&current_single_message_channel->slot->write_lock);
+    if (current_single_message_channel->queue_depth != 0)
+    {
+        if (current_single_message_channel->queue_count == current_single_message_channel->queue_depth)
+        {
+            /*The queue is full*/
+            spin_unlock(&current_single_message_channel->slot->write_lock);
+            return -EAGAIN;
+        }
+        push_queued_message(current_single_message_channel, payload);
+    }
+    else
+    {
+        publish_message_payload(current_single_message_channel, payload);
+    }
+    spin_unlock(&current_single_message_channel->slot->write_lock);
+    wake_channel_readers(current_single_message_channel);
+    return SUCCESS;
+}
+
+/*
+Sets the queue depth of a channel, which must not be larger than MAX_QUEUE_DEPTH.
+A depth of 0 selects last message mode, a positive depth selects queue mode with a ring of that many messages.
+Messages that were queued before the change are dropped.
+Returns SUCCESS, or -ENOMEM.
+*/
+static int change_channel_queue_depth(single_message_channel *current_single_message_channel, unsigned int queue_depth)
+{
+    message_payload **new_queue;
+    message_payload **old_queue;
+    unsigned int old_queue_depth;
+    unsigned int old_queue_head;
+    unsigned int old_queue_count;
+
+    new_queue = NULL;
+    if (queue_depth != 0)
+    {
+        new_queue = (message_payload**)kvmalloc_array(queue_depth, sizeof(message_payload*), GFP_KERNEL_ACCOUNT);
+        if (new_queue == NULL)
+        {
+            /*If allocate memory fialed, exit*/
+            return -ENOMEM;
+        }
+    }
+    charge_message_slot_memory(current_single_message_channel->slot, queue_depth * sizeof(message_payload*));
+    spin_lock(&current_single_message_channel->slot->write_lock);
+    old_queue = current_single_message_channel->queue;
+    old_queue_depth = current_single_message_channel->queue_depth;
+    old_queue_head = current_single_message_channel->queue_head;
+    old_queue_count = current_single_message_channel->queue_count;
+    current_single_message_channel->queue = new_queue;
+    current_single_message_channel->queue_head = 0;
+    WRITE_ONCE(current_single_message_channel->queue_count, 0);
+    WRITE_ONCE(current_single_message_channel->queue_depth, queue_depth);
+    spin_unlock(&current_single_message_channel->slot->write_lock);
+    if (old_queue != NULL)
+    {
+        free_message_queue(current_single_message_channel->slot, old_queue, old_queue_depth, old_queue_head, old_queue_count);
+    }
+
+    /*blocked readers and writers re-check the mode of the channel*/
+    wake_up_interruptible_all(&current_single_message_channel->readers_wait);
+    wake_up_interruptible_all(&current_single_message_channel->writers_wait);
+    return SUCCESS;
+}
+
+/*
+Sets the queue depth of the file descriptor's channel, see change_channel_queue_depth.
+Returns SUCCESS, or an error code on failure.
+*/
+static long set_channel_queue_depth(data_file *current_data_file, unsigned long queue_depth)
+{
+    single_message_channel *current_single_message_channel;
+    long queue_depth_ret;
+
+    if (queue_depth > MAX_QUEUE_DEPTH)
+    {
+        /*The queue depth is not valid*/
+        return -EINVAL;
+    }
+    current_single_message_channel = get_data_file_channel(current_data_file);
+    if (current_single_message_channel == NULL)
+    {
+        /*No channel was selected yet*/
+        return -EINVAL;
+    }
+    queue_depth_ret = change_channel_queue_depth(current_single_message_channel, (unsigned int)queue_depth);
+    put_single_message_channel(current_single_message_channel);
+    return queue_depth_ret;
+}
+
+/*
+Copies the oldest message of a channel in queue mode into an iov_iter and removes it from the queue, the queue must not be empty.
+Must be called with the slot's write_lock held, which it releases.
+The message is copied with page faults disabled before it is removed, so a user buffer that is not valid leaves it queued.
+Returns the payload of the message, its reference now belongs to the caller, ERR_PTR(-EAGAIN) if the user buffer
+was not resident and was faulted in, so the caller takes the lock and tries again, or ERR_PTR(-EFAULT).
+*/
+static message_payload* copy_queued_message_to_iter(single_message_channel *current_single_message_channel, struct iov_iter *to)
+{
+    message_payload *payload;
+    size_t message_length;
+    size_t copied;
+    u64 copy_start;
+
+    payload = current_single_message_channel->queue[current_single_message_channel->queue_head];
+    message_length = payload->message_length;
+    copy_start = latency_phase_start();
+    pagefault_disable();
+    copied = copy_to_iter(payload->message, message_length, to);
+    pagefault_enable();
+    if (copied == message_length)
+    {
+        payload = pop_queued_message(current_single_message_channel);
+        spin_unlock(&current_single_message_channel->slot->write_lock);
+        latency_phase_end(LATENCY_READ_COPY, copy_start);
+        wake_channel_writers(current_single_message_channel);
+        return payload;
+    }
+    spin_unlock(&current_single_message_channel->slot->write_lock);
+    iov_iter_revert(to, copied);
+    if (fault_in_iov_iter_writeable(to, message_length) != 0)
+    {
+        /*The user buffer is not valid*/
+        return ERR_PTR(-EFAULT);
+    }
+    return ERR_PTR(-EAGAIN);
+}
+
+/*
+Reads a message of a channel into an iov_iter without sleeping, like an O_NONBLOCK read-
+the last message is copied, or in queue mode the oldest queued message is consumed.
+When versioned_read is not NULL, the last message is read only if its sequence is larger than
+versioned_read->min_sequence, and the sequence and write time of the message are set in it.
+Returns the length of the message, or -EWOULDBLOCK, -ENOSPC or -EFAULT.
+*/
+static long read_channel_message(single_message_channel *current_single_message_channel, struct iov_iter *to,
+                                 struct msg_slot_versioned_read *versioned_read)
+{
+    message_payload *payload;
+    unsigned int message_length;
+    size_t length;
+    long read_ret;
 
-/*create message_slot array that can keep up to MAX_NUMBER_OF_MINOR_DEVICES as was writen in the assignment*/
-static struct message_slot* message_slot_array[MAX_NUMBER_OF_MINOR_DEVICES];
+    length = iov_iter_count(to);
+    while (READ_ONCE(current_single_message_channel->queue_depth) != 0)
+    {
+        spin_lock(&current_single_message_channel->slot->write_lock);
+        if (current_single_message_channel->queue_depth == 0)
+        {
+            /*The channel went back to last message mode*/
+            spin_unlock(&current_single_message_channel->slot->write_lock);
+            break;
+        }
+        if (current_single_message_channel->queue_count == 0)
+        {
+            /*The queue is empty*/
+            spin_unlock(&current_single_message_channel->slot->write_lock);
+            return -EWOULDBLOCK;
+        }
+        if (length < current_single_message_channel->queue[current_single_message_channel->queue_head]->message_length)
+        {
+            /*The buffer is too short, the message stays queued*/
+            spin_unlock(&current_single_message_channel->slot->write_lock);
+            return -ENOSPC;
+        }
+        payload = copy_queued_message_to_iter(current_single_message_channel, to);
+        if (payload == ERR_PTR(-EAGAIN))
+        {
+            /*The user buffer was faulted in, copy again*/
+            continue;
+        }
+        if (IS_ERR(payload))
+        {
+            return PTR_ERR(payload);
+        }
+        if (versioned_read != NULL)
+        {
+            versioned_read->sequence = payload->message_sequence;
+            versioned_read->timestamp_ns = payload->timestamp_ns;
+        }
+        read_ret = payload->message_length;
+        put_message_payload(payload);
+        return read_ret;
+    }
+    for (;;)
+    {
+        rcu_read_lock();
+        payload = rcu_dereference(current_single_message_channel->payload);
+        if (payload == NULL)
+        {
+            /*The channel has no message*/
+            rcu_read_unlock();
+            return -EWOULDBLOCK;
+        }
+        if (versioned_read != NULL)
+        {
+            versioned_read->sequence = payload->message_sequence;
+            versioned_read->timestamp_ns = payload->timestamp_ns;
+            if (payload->message_sequence <= versioned_read->min_sequence)
+            {
+                /*The reader already has this message, skip the copy*/
+                rcu_read_unlock();
+                return -EWOULDBLOCK;
+            }
+        }
+        if (length < payload->message_length)
+        {
+            /*The buffer is too short*/
+            rcu_read_unlock();
+            return -ENOSPC;
+        }
+        message_length = payload->message_length;
+        read_ret = copy_message_payload_to_iter(payload, to);
+        if (read_ret != -EAGAIN)
+        {
+            return read_ret == 0 ? message_length : read_ret;
+        }
+        /*A writer replaced the message meanwhile, read the new one*/
+    }
+}
+
+/*
+Reads a message with its sequence and write time, see struct msg_slot_versioned_read.
+The channel is the one in channel_id, or the file descriptor's own channel when channel_id is 0.
+The argument is copied back also on -EWOULDBLOCK, so the reader learns the sequence of the message it already has.
+Returns the length of the message, or -EINVAL, -EWOULDBLOCK, -ENOSPC or -EFAULT.
+*/
+static long read_versioned_message(data_file *current_data_file, unsigned long ioctl_param)
+{
+    struct msg_slot_versioned_read versioned_read;
+    message_slot *current_message_slot;
+    single_message_channel *current_single_message_channel;
+    char __user *buffer;
+    struct iov_iter to;
+    long read_ret;
+
+    if (copy_from_user(&versioned_read, (void __user*)ioctl_param, sizeof(versioned_read)) != 0)
+    {
+        /*The argument is not valid*/
+        return -EFAULT;
+    }
+    buffer = (char __user*)u64_to_user_ptr(versioned_read.buffer);
+    if (buffer == NULL)
+    {
+        return -EINVAL;
+    }
+    read_ret = import_ubuf(ITER_DEST, buffer, versioned_read.length, &to);
+    if (read_ret != 0)
+    {
+        return read_ret;
+    }
+    if (versioned_read.channel_id == 0)
+    {
+        current_single_message_channel = get_data_file_channel(current_data_file);
+        if (current_single_message_channel == NULL)
+        {
+            /*No channel was selected yet*/
+            return -EINVAL;
+        }
+    }
+    else
+    {
+        current_single_message_channel = NULL;
+        current_message_slot = xa_load(&message_slot_xarray, current_data_file->minor);
+        if (current_message_slot != NULL)
+        {
+            current_single_message_channel = lookup_slot_channel(current_message_slot, versioned_read.channel_id, false);
+        }
+    }
+    versioned_read.sequence = 0; /*Stays 0 if the channel has no message*/
+    versioned_read.timestamp_ns = 0;
+    if (current_single_message_channel == NULL)
+    {
+        /*No message was ever written to the channel*/
+        read_ret = -EWOULDBLOCK;
+    }
+    else
+    {
+        read_ret = read_channel_message(current_single_message_channel, &to, &versioned_read);
+        account_message_read(current_single_message_channel, read_ret);
+        put_single_message_channel(current_single_message_channel);
+    }
+    if (read_ret >= 0)
+    {
+        versioned_read.length = read_ret;
+    }
+    if (copy_to_user((void __user*)ioctl_param, &versioned_read, sizeof(versioned_read)) != 0)
+    {
+        return -EFAULT;
+    }
+    return read_ret;
+}
+
+/*
+Subscribes a channel to a topic channel of the file descriptor's message slot, or unsubscribes it,
+see subscribe_single_message_channel. Subscribing creates the channels that don't exist yet.
+Returns SUCCESS, or -EINVAL, -EFAULT, -EEXIST, -ENOSPC or -ENOMEM.
+*/
+static long change_channel_subscription(data_file *current_data_file, unsigned long ioctl_param, bool subscribe)
+{
+    struct msg_slot_subscription subscription;
+    message_slot *current_message_slot;
+    single_message_channel *topic;
+    single_message_channel *subscriber;
+    long subscription_ret;
+
+    if (copy_from_user(&subscription, (void __user*)ioctl_param, sizeof(subscription)) != 0)
+    {
+        /*The argument is not valid*/
+        return -EFAULT;
+    }
+    if (subscription.topic_channel_id == 0 || subscription.channel_id == 0 || subscription.topic_channel_id == subscription.channel_id)
+    {
+        /*The channel ids are not valid*/
+        return -EINVAL;
+    }
+    if (subscribe)
+    {
+        current_message_slot = find_or_create_message_slot(current_data_file->minor);
+        if (IS_ERR(current_message_slot))
+        {
+            return PTR_ERR(current_message_slot);
+        }
+    }
+    else
+    {
+        current_message_slot = xa_load(&message_slot_xarray, current_data_file->minor);
+        if (current_message_slot == NULL)
+        {
+            /*No channel of this minor was ever selected*/
+            return -EINVAL;
+        }
+    }
+    topic = lookup_slot_channel(current_message_slot, subscription.topic_channel_id, subscribe);
+    if (IS_ERR_OR_NULL(topic))
+    {
+        return topic == NULL ? -EINVAL : PTR_ERR(topic);
+    }
+    subscriber = lookup_slot_channel(current_message_slot, subscription.channel_id, subscribe);
+    if (IS_ERR_OR_NULL(subscriber))
+    {
+        put_single_message_channel(topic);
+        return subscriber == NULL ? -EINVAL : PTR_ERR(subscriber);
+    }
+    mutex_lock(&current_message_slot->subscribers_lock);
+    if (subscribe)
+    {
+        subscription_ret = subscribe_single_message_channel(topic, subscriber);
+    }
+    else
+    {
+        subscription_ret = unsubscribe_single_message_channel(topic, subscriber);
+    }
+    mutex_unlock(&current_message_slot->subscribers_lock);
+    put_single_message_channel(subscriber);
+    put_single_message_channel(topic);
+    return subscription_ret;
+}
+
+/*
+SNAPSHOT FUNCTIONS
+*/
+/*
+The position of a read of debugfs message_slot/snapshot, kept in the seq_file between the reads.
+The records are visited in the order of the minors and of the channel IDs, so a read resumes with a lookup
+of the next record instead of walking the snapshot from the start.
+*/
+typedef struct snapshot_cursor {
+    loff_t pos; /*The seq_file position of the record at the cursor*/
+    unsigned long minor; /*The minor of the record*/
+    unsigned long channel_id; /*The channel of the record, 0 for the record of the message slot*/
+    unsigned int queue_index; /*The position of the message in the channel's queue, 0 in last message mode*/
+    message_slot *slot; /*The message slot of the record, set by settle_snapshot_cursor*/
+    single_message_channel *channel; /*The channel of the record, set by settle_snapshot_cursor and valid under RCU*/
+} snapshot_cursor;
+
+/*
+Moves a snapshot cursor to the first record at or after it: the record of a message slot, a message of one of
+its channels, or an empty queue. Channels in last message mode without a message have no record.
+Must be called inside an RCU read-side section.
+Returns whether there is such a record, false at the end of the snapshot.
+*/
+static bool settle_snapshot_cursor(snapshot_cursor *cursor)
+{
+    single_message_channel *current_single_message_channel;
+    unsigned long minor;
+    unsigned int record_count;
+
+    for (;;)
+    {
+        minor = cursor->minor;
+        cursor->slot = xa_find(&message_slot_xarray, &minor, ULONG_MAX, XA_PRESENT);
+        if (cursor->slot == NULL)
+        {
+            return false;
+        }
+        if (minor != cursor->minor)
+        {
+            /*The minor of the cursor has no message slot, start with the record of the next one*/
+            cursor->minor = minor;
+            cursor->channel_id = 0;
+            cursor->queue_index = 0;
+        }
+        if (cursor->channel_id == 0)
+        {
+            return true;
+        }
+        current_single_message_channel = xa_find(&cursor->slot->channels, &cursor->channel_id, UINT_MAX, XA_PRESENT);
+        if (current_single_message_channel == NULL)
+        {
+            /*The last channel of the slot was passed*/
+            cursor->minor++;
+            cursor->channel_id = 0;
+            cursor->queue_index = 0;
+            continue;
+        }
+        if (READ_ONCE(current_single_message_channel->queue_depth) != 0)
+        {
+            record_count = max(READ_ONCE(current_single_message_channel->queue_count), 1U);
+        }
+        else
+        {
+            record_count = rcu_access_pointer(current_single_message_channel->payload) != NULL ? 1 : 0;
+        }
+        if (cursor->queue_index < record_count)
+        {
+            cursor->channel = current_single_message_channel;
+            return true;
+        }
+        cursor->channel_id++;
+        cursor->queue_index = 0;
+    }
+}
+
+/*Starts or resumes a read of the snapshot, the header is at position 0 and the records follow*/
+static void *message_slot_snapshot_start(struct seq_file *snapshot_file, loff_t *pos) __acquires(RCU)
+{
+    snapshot_cursor *cursor;
+
+    cursor = (snapshot_cursor*)snapshot_file->private;
+    /*the records are read under RCU, the channels and payloads they point to are freed only after a grace period*/
+    rcu_read_lock();
+    if (*pos == 0)
+    {
+        memset(cursor, 0, sizeof(*cursor));
+        return SEQ_START_TOKEN;
+    }
+    if (*pos != cursor->pos)
+    {
+        /*seq_file resumes at the record after the last one it was given, or seeks by reading from the start*/
+        return ERR_PTR(-EINVAL);
+    }
+    return settle_snapshot_cursor(cursor) ? cursor : NULL;
+}
+
+/*Moves to the next record of the snapshot*/
+static void *message_slot_snapshot_next(struct seq_file *snapshot_file, void *record, loff_t *pos)
+{
+    snapshot_cursor *cursor;
+
+    cursor = (snapshot_cursor*)snapshot_file->private;
+    if (record != SEQ_START_TOKEN)
+    {
+        if (cursor->channel_id == 0)
+        {
+            /*After the record of the message slot come its channels*/
+            cursor->channel_id = 1;
+        }
+        else
+        {
+            cursor->queue_index++;
+        }
+    }
+    cursor->pos = ++*pos;
+    return settle_snapshot_cursor(cursor) ? cursor : NULL;
+}
+
+static void message_slot_snapshot_stop(struct seq_file *snapshot_file, void *record) __releases(RCU)
+{
+    rcu_read_unlock();
+}
+
+/*Writes the record at the cursor and its message, see struct msg_slot_snapshot_record*/
+static int message_slot_snapshot_show(struct seq_file *snapshot_file, void *record)
+{
+    static const char padding[8];
+    struct msg_slot_snapshot_header snapshot_header;
+    struct msg_slot_snapshot_record snapshot_record;
+    snapshot_cursor *cursor;
+    single_message_channel *current_single_message_channel;
+    message_payload *payload;
+
+    if (record == SEQ_START_TOKEN)
+    {
+        snapshot_header.magic = MSG_SLOT_SNAPSHOT_MAGIC;
+        snapshot_header.version = MSG_SLOT_SNAPSHOT_VERSION;
+        seq_write(snapshot_file, &snapshot_header, sizeof(snapshot_header));
+        return SUCCESS;
+    }
+    cursor = (snapshot_cursor*)record;
+    memset(&snapshot_record, 0, sizeof(snapshot_record));
+    snapshot_record.minor = cursor->minor;
+    snapshot_record.channel_id = cursor->channel_id;
+    if (cursor->channel_id == 0)
+    {
+        snapshot_record.sequence = READ_ONCE(cursor->slot->message_sequence);
+        snapshot_record.setting = READ_ONCE(cursor->slot->max_message_size);
+        seq_write(snapshot_file, &snapshot_record, sizeof(snapshot_record));
+        return SUCCESS;
+    }
+    current_single_message_channel = cursor->channel;
+    payload = NULL;
+    if (READ_ONCE(current_single_message_channel->queue_depth) == 0)
+    {
+        payload = rcu_dereference(current_single_message_channel->payload);
+    }
+    else
+    {
+        /*the queue ring is replaced and detached from a dying channel under write_lock, its payloads are freed after a grace period*/
+        spin_lock(&cursor->slot->write_lock);
+        snapshot_record.setting = current_single_message_channel->queue_depth;
+        if (current_single_message_channel->queue_depth != 0 && cursor->queue_index < current_single_message_channel->queue_count)
+        {
+            payload = current_single_message_channel->queue[(current_single_message_channel->queue_head + cursor->queue_index) %
+                                                             current_single_message_channel->queue_depth];
+        }
+        spin_unlock(&cursor->slot->write_lock);
+    }
+    if (payload != NULL)
+    {
+        snapshot_record.sequence = payload->message_sequence;
+        snapshot_record.timestamp_ns = payload->timestamp_ns;
+        snapshot_record.length = payload->message_length;
+    }
+    seq_write(snapshot_file, &snapshot_record, sizeof(snapshot_record));
+    if (payload != NULL)
+    {
+        seq_write(snapshot_file, payload->message, payload->message_length);
+        seq_write(snapshot_file, padding, MSG_SLOT_SNAPSHOT_RECORD_SIZE(payload->message_length) - sizeof(snapshot_record) - payload->message_length);
+    }
+    return SUCCESS;
+}
+
+static const struct seq_operations message_slot_snapshot_seq_ops = {
+    .start = message_slot_snapshot_start,
+    .next = message_slot_snapshot_next,
+    .stop = message_slot_snapshot_stop,
+    .show = message_slot_snapshot_show,
+};
+
+static int message_slot_snapshot_open(struct inode *inode, struct file *file)
+{
+    return seq_open_private(file, &message_slot_snapshot_seq_ops, sizeof(snapshot_cursor));
+}
+
+/*debugfs message_slot/snapshot, a binary snapshot of every message slot*/
+static const struct file_operations message_slot_snapshot_fops = {
+    .owner = THIS_MODULE,
+    .open = message_slot_snapshot_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = seq_release_private,
+};
+
+/*
+Restores the record of a message slot: allocates the slot, sets its max message size,
+and moves its sequence past the snapshot's so that later messages are newer.
+Returns the message slot, or an ERR_PTR.
+*/
+static message_slot* restore_message_slot_record(struct msg_slot_snapshot_record *snapshot_record)
+{
+    message_slot *current_message_slot;
+
+    if (snapshot_record->minor >= minor_count || snapshot_record->setting == 0 || snapshot_record->setting > MAX_MESSAGE_SIZE_LIMIT)
+    {
+        /*The record is not valid*/
+        return ERR_PTR(-EINVAL);
+    }
+    current_message_slot = find_or_create_message_slot(snapshot_record->minor);
+    if (IS_ERR(current_message_slot))
+    {
+        return current_message_slot;
+    }
+    WRITE_ONCE(current_message_slot->max_message_size, snapshot_record->setting);
+    spin_lock(&current_message_slot->write_lock);
+    if (current_message_slot->message_sequence < snapshot_record->sequence)
+    {
+        current_message_slot->message_sequence = snapshot_record->sequence;
+    }
+    spin_unlock(&current_message_slot->write_lock);
+    return current_message_slot;
+}
+
+/*
+Restores a message record of a snapshot to its channel, creating the channel and setting its queue depth as in the snapshot.
+The message is copied from user space only if it is newer than the last message of the channel.
+Returns 1 if the message was restored, 0 if there was nothing to restore, or an error code.
+*/
+static int restore_channel_record(message_slot *current_message_slot, struct msg_slot_snapshot_record *snapshot_record, const char __user *message)
+{
+    single_message_channel *current_single_message_channel;
+    message_payload *payload;
+    int restore_ret;
+
+    if (snapshot_record->setting > MAX_QUEUE_DEPTH)
+    {
+        /*The queue depth is not valid*/
+        return -EINVAL;
+    }
+    current_single_message_channel = lookup_slot_channel(current_message_slot, snapshot_record->channel_id, true);
+    if (IS_ERR(current_single_message_channel))
+    {
+        return PTR_ERR(current_single_message_channel);
+    }
+    restore_ret = SUCCESS;
+    if (READ_ONCE(current_single_message_channel->queue_depth) != snapshot_record->setting)
+    {
+        restore_ret = change_channel_queue_depth(current_single_message_channel, snapshot_record->setting);
+        if (restore_ret != SUCCESS)
+        {
+            goto out;
+        }
+    }
+    if (snapshot_record->length == 0 || snapshot_record->sequence <= READ_ONCE(current_single_message_channel->message_sequence))
+    {
+        /*No message, or the channel already has it*/
+        goto out;
+    }
+    restore_ret = reserve_message_slot_memory(current_message_slot);
+    if (restore_ret != SUCCESS)
+    {
+        goto out;
+    }
+    payload = alloc_message_payload(snapshot_record->length);
+    if (payload == NULL)
+    {
+        restore_ret = -ENOMEM;
+        goto out;
+    }
+    if (copy_from_user(payload->message, message, snapshot_record->length) != 0)
+    {
+        put_message_payload(payload);
+        restore_ret = -EFAULT;
+        goto out;
+    }
+    payload->message_sequence = snapshot_record->sequence;
+    payload->timestamp_ns = snapshot_record->timestamp_ns;
+    spin_lock(&current_message_slot->write_lock);
+    restore_ret = restore_message_payload(current_single_message_channel, payload);
+    spin_unlock(&current_message_slot->write_lock);
+    if (restore_ret != SUCCESS)
+    {
+        put_message_payload(payload);
+        restore_ret = (restore_ret == -EEXIST) ? SUCCESS : restore_ret;
+        goto out;
+    }
+    wake_channel_readers(current_single_message_channel);
+    restore_ret = 1;
+out:
+    put_single_message_channel(current_single_message_channel);
+    return restore_ret;
+}
+
+/*
+Loads a snapshot into the message slots, see struct msg_slot_restore. The records are read straight from
+the user buffer, so a snapshot of any size is restored without a kernel buffer for it.
+Only an administrator may restore, since a snapshot writes to every minor.
+Returns the number of messages restored, or -EPERM, -EFAULT, -EINVAL if the snapshot is not valid, -ENOMEM, -EAGAIN
+if a queue is full, or -EINTR. The records before a failing one stay restored.
+*/
+static long restore_message_slots(unsigned long ioctl_param)
+{
+    struct msg_slot_restore restore;
+    struct msg_slot_snapshot_header snapshot_header;
+    struct msg_slot_snapshot_record snapshot_record;
+    message_slot *current_message_slot;
+    const char __user *buffer;
+    u64 offset;
+    long restored;
+    int restore_ret;
+
+    if (!capable(CAP_SYS_ADMIN))
+    {
+        return -EPERM;
+    }
+    if (copy_from_user(&restore, (void __user*)ioctl_param, sizeof(restore)) != 0)
+    {
+        /*The argument is not valid*/
+        return -EFAULT;
+    }
+    buffer = (const char __user*)u64_to_user_ptr(restore.buffer);
+    if (restore.length < sizeof(snapshot_header))
+    {
+        return -EINVAL;
+    }
+    if (copy_from_user(&snapshot_header, buffer, sizeof(snapshot_header)) != 0)
+    {
+        return -EFAULT;
+    }
+    if (snapshot_header.magic != MSG_SLOT_SNAPSHOT_MAGIC || snapshot_header.version != MSG_SLOT_SNAPSHOT_VERSION)
+    {
+        /*Not a snapshot, or of another format*/
+        return -EINVAL;
+    }
+    current_message_slot = NULL;
+    restored = 0;
+    for (offset = sizeof(snapshot_header); offset < restore.length; offset += MSG_SLOT_SNAPSHOT_RECORD_SIZE(snapshot_record.length))
+    {
+        if (restore.length - offset < sizeof(snapshot_record))
+        {
+            /*The snapshot ends in the middle of a record*/
+            return -EINVAL;
+        }
+        if (copy_from_user(&snapshot_record, buffer + offset, sizeof(snapshot_record)) != 0)
+        {
+            return -EFAULT;
+        }
+        if (snapshot_record.length > MAX_MESSAGE_SIZE_LIMIT || restore.length - offset < MSG_SLOT_SNAPSHOT_RECORD_SIZE(snapshot_record.length))
+        {
+            /*The message of the record is not valid*/
+            return -EINVAL;
+        }
+        if (snapshot_record.channel_id == 0)
+        {
+            current_message_slot = restore_message_slot_record(&snapshot_record);
+            if (IS_ERR(current_message_slot))
+            {
+                return PTR_ERR(current_message_slot);
+            }
+            continue;
+        }
+        if (current_message_slot == NULL || snapshot_record.minor != current_message_slot->minor)
+        {
+            /*A message record must follow the record of its message slot*/
+            return -EINVAL;
+        }
+        restore_ret = restore_channel_record(current_message_slot, &snapshot_record, buffer + offset + sizeof(snapshot_record));
+        if (restore_ret < 0)
+        {
+            return restore_ret;
+        }
+        restored += restore_ret;
+        if (fatal_signal_pending(current))
+        {
+            return -EINTR;
+        }
+        cond_resched();
+    }
+    return restored;
+}
+
+/*
+BATCH FUNCTIONS
+*/
+/*A message of a write batch, prepared before the slot's write_lock is taken*/
+typedef struct batch_message {
+    single_message_channel *channel; /*The target channel, holds a reference on it*/
+    message_payload *payload; /*The message, NULL once delivered*/
+} batch_message;
+
+/*
+The deliveries, of a message to its channel or to one of the channel's subscribers, that a write batch makes
+per hold of the slot's write_lock. A batch can fan out to millions of channels, so it lets the readers and
+writers of the slot in between.
+*/
+#define BATCH_LOCK_DELIVERIES 256
+
+/*
+Returns whether an entry of a write batch from first_blocked up to entry i, to the channel of entry i, found the channel's queue full.
+The later messages of that channel then fail too, even if a reader made room while the lock was dropped,
+so a writer that retries the failed entries keeps their order.
+*/
+static bool batch_channel_blocked(struct msg_slot_batch_entry *entries, batch_message *messages, unsigned int first_blocked, unsigned int i)
+{
+    unsigned int j;
+
+    for (j = first_blocked; j < i; j++)
+    {
+        if (entries[j].status == -EAGAIN && messages[j].channel == messages[i].channel)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+Copies the header and the entries of a batch from user space.
+Returns the entries, which the caller frees with kvfree, or an ERR_PTR on failure.
+*/
+static struct msg_slot_batch_entry* copy_batch_from_user(unsigned long ioctl_param, struct msg_slot_batch *batch)
+{
+    struct msg_slot_batch_entry *entries;
+
+    if (copy_from_user(batch, (void __user*)ioctl_param, sizeof(*batch)) != 0)
+    {
+        /*The argument is not valid*/
+        return ERR_PTR(-EFAULT);
+    }
+    if (batch->count == 0 || batch->count > MSG_SLOT_BATCH_MAX_ENTRIES)
+    {
+        /*The number of entries is not valid*/
+        return ERR_PTR(-EINVAL);
+    }
+    entries = (struct msg_slot_batch_entry*)kvmalloc_array(batch->count, sizeof(struct msg_slot_batch_entry), GFP_KERNEL);
+    if (entries == NULL)
+    {
+        return ERR_PTR(-ENOMEM);
+    }
+    if (copy_from_user(entries, u64_to_user_ptr(batch->entries), batch->count * sizeof(struct msg_slot_batch_entry)) != 0)
+    {
+        kvfree(entries);
+        return ERR_PTR(-EFAULT);
+    }
+    return entries;
+}
+
+/*
+Writes a batch of messages, each to its own channel of the file descriptor's message slot, in one call.
+Every message is copied from user space and its channel resolved first, then they are published in order
+under the slot's write_lock, which is dropped every BATCH_LOCK_DELIVERIES deliveries so other writers may interleave.
+The status of every entry is set to 0 or to a negative error code (-EINVAL, -EMSGSIZE, -EFAULT, -ENOMEM,
+or -EAGAIN when the channel's queue is full) and copied back.
+Returns the number of messages written, or an error code if the batch itself is not valid.
+*/
+static long write_message_batch(data_file *current_data_file, unsigned long ioctl_param)
+{
+    struct msg_slot_batch batch;
+    struct msg_slot_batch_entry *entries;
+    batch_message *messages;
+    message_slot *current_message_slot;
+    single_message_channel *current_single_message_channel;
+    message_subscribers *subscribers;
+    unsigned int slot_max_message_size;
+    unsigned int i;
+    unsigned int deliveries; /*the deliveries of the current hold of the write_lock*/
+    unsigned int first_blocked; /*the first entry whose channel's queue was full*/
+    long written;
+    long pending_bytes; /*the memory of the payloads allocated for the batch, charged until it is published*/
+    unsigned long not_copied;
+    u64 copy_start;
+
+    entries = copy_batch_from_user(ioctl_param, &batch);
+    if (IS_ERR(entries))
+    {
+        return PTR_ERR(entries);
+    }
+    messages = (batch_message*)kvcalloc(batch.count, sizeof(struct batch_message), GFP_KERNEL);
+    if (messages == NULL)
+    {
+        kvfree(entries);
+        return -ENOMEM;
+    }
+    current_message_slot = find_or_create_message_slot(current_data_file->minor);
+    if (IS_ERR(current_message_slot))
+    {
+        kvfree(messages);
+        kvfree(entries);
+        return PTR_ERR(current_message_slot);
+    }
+    slot_max_message_size = READ_ONCE(current_message_slot->max_message_size);
+
+    /*copy every message and resolve its channel, nothing is published yet*/
+    pending_bytes = 0;
+    for (i = 0; i < batch.count; i++)
+    {
+        entries[i].status = SUCCESS;
+        if (entries[i].channel_id == 0)
+        {
+            entries[i].status = -EINVAL;
+            continue;
+        }
+        if (entries[i].length == 0 || entries[i].length > slot_max_message_size)
+        {
+            entries[i].status = -EMSGSIZE;
+            count_message_write(current_message_slot->stats, -EMSGSIZE);
+            continue;
+        }
+        /*
+        every payload is charged as soon as it is allocated, so the budget checked before the next message
+        includes the messages of the batch that are still waiting to be published
+        */
+        if (reserve_message_slot_memory(current_message_slot) != SUCCESS)
+        {
+            entries[i].status = -ENOMEM;
+            continue;
+        }
+        messages[i].payload = alloc_message_payload(entries[i].length);
+        if (messages[i].payload == NULL)
+        {
+            entries[i].status = -ENOMEM;
+            continue;
+        }
+        pending_bytes += message_payload_memory(messages[i].payload);
+        charge_message_slot_memory(current_message_slot, message_payload_memory(messages[i].payload));
+        copy_start = latency_phase_start();
+        not_copied = copy_from_user(messages[i].payload->message, u64_to_user_ptr(entries[i].buffer), entries[i].length);
+        latency_phase_end(LATENCY_WRITE_COPY, copy_start);
+        if (not_copied != 0)
+        {
+            entries[i].status = -EFAULT;
+            continue;
+        }
+        current_single_message_channel = lookup_slot_channel(current_message_slot, entries[i].channel_id, true);
+        if (IS_ERR(current_single_message_channel))
+        {
+            entries[i].status = PTR_ERR(current_single_message_channel);
+            continue;
+        }
+        messages[i].channel = current_single_message_channel;
+    }
+
+    /*publish the batch in order, a bounded number of deliveries per hold of the slot's write_lock*/
+    written = 0;
+    deliveries = 0;
+    first_blocked = batch.count;
+    spin_lock(&current_message_slot->write_lock);
+    for (i = 0; i < batch.count; i++)
+    {
+        current_single_message_channel = messages[i].channel;
+        if (entries[i].status != SUCCESS)
+        {
+            continue;
+        }
+        if (deliveries >= BATCH_LOCK_DELIVERIES)
+        {
+            spin_unlock(&current_message_slot->write_lock);
+            cond_resched();
+            spin_lock(&current_message_slot->write_lock);
+            deliveries = 0;
+        }
+        subscribers = rcu_dereference_protected(current_single_message_channel->subscribers,
+                                                lockdep_is_held(&current_message_slot->write_lock));
+        deliveries += 1 + (subscribers != NULL ? subscribers->count : 0);
+        if (current_single_message_channel->queue_depth != 0)
+        {
+            if (current_single_message_channel->queue_count == current_single_message_channel->queue_depth ||
+                batch_channel_blocked(entries, messages, first_blocked, i))
+            {
+                /*The queue is full, or was full for an earlier message of the batch*/
+                entries[i].status = -EAGAIN;
+                first_blocked = min(first_blocked, i);
+                continue;
+            }
+            push_queued_message(current_single_message_channel, messages[i].payload);
+        }
+        else
+        {
+            publish_message_payload(current_single_message_channel, messages[i].payload);
+        }
+        messages[i].payload = NULL; /*the channel owns the payload now*/
+        written++;
+    }
+    spin_unlock(&current_message_slot->write_lock);
+    /*the delivered payloads were charged again by their channels, the others are dropped below*/
+    charge_message_slot_memory(current_message_slot, -pending_bytes);
+
+    for (i = 0; i < batch.count; i++)
+    {
+        if (messages[i].channel != NULL)
+        {
+            if (entries[i].status == SUCCESS)
+            {
+                wake_channel_readers(messages[i].channel);
+                account_message_write(messages[i].channel, entries[i].length);
+            }
+            put_single_message_channel(messages[i].channel);
+        }
+        put_message_payload(messages[i].payload); /*the messages that were not delivered*/
+    }
+    kvfree(messages);
+    if (copy_to_user(u64_to_user_ptr(batch.entries), entries, batch.count * sizeof(struct msg_slot_batch_entry)) != 0)
+    {
+        written = -EFAULT;
+    }
+    kvfree(entries);
+    return written;
+}
+
+/*
+Reads a batch of messages, each from its own channel of the file descriptor's message slot, in one call.
+Every entry is read like an O_NONBLOCK read of its channel, its length is set to the length of the message
+and its status to 0 or to a negative error code (-EINVAL, -EWOULDBLOCK, -ENOSPC or -EFAULT).
+Returns the number of messages read, or an error code if the batch itself is not valid.
+*/
+static long read_message_batch(data_file *current_data_file, unsigned long ioctl_param)
+{
+    struct msg_slot_batch batch;
+    struct msg_slot_batch_entry *entries;
+    message_slot *current_message_slot;
+    single_message_channel *current_single_message_channel;
+    char __user *buffer;
+    struct iov_iter to;
+    unsigned int i;
+    long read_ret;
+    long read_count;
+
+    entries = copy_batch_from_user(ioctl_param, &batch);
+    if (IS_ERR(entries))
+    {
+        return PTR_ERR(entries);
+    }
+    current_message_slot = xa_load(&message_slot_xarray, current_data_file->minor);
+    read_count = 0;
+    for (i = 0; i < batch.count; i++)
+    {
+        buffer = (char __user*)u64_to_user_ptr(entries[i].buffer);
+        if (entries[i].channel_id == 0 || buffer == NULL)
+        {
+            entries[i].status = -EINVAL;
+            continue;
+        }
+        read_ret = import_ubuf(ITER_DEST, buffer, entries[i].length, &to);
+        if (read_ret != 0)
+        {
+            entries[i].status = read_ret;
+            continue;
+        }
+        current_single_message_channel = NULL;
+        if (current_message_slot != NULL)
+        {
+            current_single_message_channel = lookup_slot_channel(current_message_slot, entries[i].channel_id, false);
+        }
+        if (current_single_message_channel == NULL)
+        {
+            /*No message was ever written to the channel*/
+            entries[i].status = -EWOULDBLOCK;
+            continue;
+        }
+        read_ret = read_channel_message(current_single_message_channel, &to, NULL);
+        account_message_read(current_single_message_channel, read_ret);
+        put_single_message_channel(current_single_message_channel);
+        if (read_ret < 0)
+        {
+            entries[i].status = read_ret;
+            continue;
+        }
+        entries[i].length = read_ret;
+        entries[i].status = SUCCESS;
+        read_count++;
+    }
+    if (copy_to_user(u64_to_user_ptr(batch.entries), entries, batch.count * sizeof(struct msg_slot_batch_entry)) != 0)
+    {
+        read_count = -EFAULT;
+    }
+    kvfree(entries);
+    return read_count;
+}
+
+/*
+SHARED RING FUNCTIONS
+*/
+/*
+Allocates the zeroed pages of a shared ring of ring->size bytes and maps them in the kernel.
+The pages come from alloc_page with __GFP_ACCOUNT, so unlike vmalloc_user the ring is charged to the memory cgroup of the task that sets it up.
+Returns SUCCESS, or -ENOMEM on memory allocation failure.
+*/
+static int alloc_slot_ring_pages(message_slot_ring *ring)
+{
+    unsigned int i;
+
+    ring->page_count = ring->size >> PAGE_SHIFT;
+    ring->pages = (struct page**)kvcalloc(ring->page_count, sizeof(struct page*), GFP_KERNEL_ACCOUNT);
+    if (ring->pages == NULL)
+    {
+        return -ENOMEM;
+    }
+    for (i = 0; i < ring->page_count; i++)
+    {
+        ring->pages[i] = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO); /*zeroed, so head and tail start at 0*/
+        if (ring->pages[i] == NULL)
+        {
+            goto free_pages;
+        }
+    }
+    ring->memory = vmap(ring->pages, ring->page_count, VM_MAP, PAGE_KERNEL);
+    if (ring->memory == NULL)
+    {
+        goto free_pages;
+    }
+    return SUCCESS;
+
+free_pages:
+    while (i-- > 0)
+    {
+        __free_page(ring->pages[i]);
+    }
+    kvfree(ring->pages);
+    return -ENOMEM;
+}
+
+/*Unmaps and frees the pages of a shared ring, no user space mapping may be left*/
+static void free_slot_ring_pages(message_slot_ring *ring)
+{
+    unsigned int i;
+
+    vunmap(ring->memory);
+    for (i = 0; i < ring->page_count; i++)
+    {
+        __free_page(ring->pages[i]);
+    }
+    kvfree(ring->pages);
+}
+
+/*Returns the memory of a shared ring, charged to its slot while the slot has the ring*/
+static long slot_ring_memory(message_slot_ring *ring)
+{
+    return ring->size + ring->page_count * sizeof(struct page*) + sizeof(struct message_slot_ring);
+}
+
+/*
+Allocates the shared ring of the file descriptor's message slot, which can then be mapped with mmap.
+The argument points to a struct msg_slot_ring_setup, a slot has at most one ring for its whole lifetime.
+Returns SUCCESS, or an error code on failure.
+*/
+static long setup_slot_ring(data_file *current_data_file, unsigned long ioctl_param)
+{
+    struct msg_slot_ring_setup ring_setup;
+    message_slot *current_message_slot;
+    message_slot_ring *ring;
+    size_t ring_size;
+    unsigned int entry_size;
+
+    if (copy_from_user(&ring_setup, (void __user*)ioctl_param, sizeof(ring_setup)) != 0)
+    {
+        /*The argument is not valid*/
+        return -EFAULT;
+    }
+    if (ring_setup.entry_count == 0 || ring_setup.entry_count > MSG_SLOT_RING_MAX_ENTRIES || !is_power_of_2(ring_setup.entry_count))
+    {
+        /*The number of entries is not valid*/
+        return -EINVAL;
+    }
+    if (ring_setup.max_message_size == 0 || ring_setup.max_message_size > MAX_MESSAGE_SIZE_LIMIT)
+    {
+        /*The max message size is not valid*/
+        return -EINVAL;
+    }
+    entry_size = MSG_SLOT_RING_ENTRY_SIZE(ring_setup.max_message_size);
+    ring_size = PAGE_ALIGN(MSG_SLOT_RING_ENTRIES_OFFSET + (size_t)ring_setup.entry_count * entry_size);
+    if (ring_size > MSG_SLOT_RING_MAX_SIZE)
+    {
+        /*The ring is too big*/
+        return -E2BIG;
+    }
+    current_message_slot = find_or_create_message_slot(current_data_file->minor);
+    if (IS_ERR(current_message_slot))
+    {
+        /*If allocate memory fialed, exit*/
+        return PTR_ERR(current_message_slot);
+    }
+    /*the ring is charged to the slot like its messages, a ring that does not fit in the budgets is refused*/
+    if (reserve_message_slot_memory(current_message_slot) != SUCCESS)
+    {
+        return -ENOMEM;
+    }
+    ring = (message_slot_ring*)kmalloc(sizeof(struct message_slot_ring), GFP_KERNEL_ACCOUNT);
+    if (ring == NULL)
+    {
+        return -ENOMEM;
+    }
+    ring->size = ring_size;
+    if (alloc_slot_ring_pages(ring) != SUCCESS)
+    {
+        kfree(ring);
+        return -ENOMEM;
+    }
+    charge_message_slot_memory(current_message_slot, slot_ring_memory(ring));
+    ring->header = (struct msg_slot_ring_header*)ring->memory;
+    ring->entries = (char*)ring->memory + MSG_SLOT_RING_ENTRIES_OFFSET;
+    ring->entry_count = ring_setup.entry_count;
+    ring->entry_size = entry_size;
+    ring->max_message_size = ring_setup.max_message_size;
+    ring->header->entry_count = ring->entry_count;
+    ring->header->entry_size = ring->entry_size;
+
+    mutex_lock(&current_message_slot->ring_lock);
+    if (current_message_slot->ring != NULL)
+    {
+        /*The slot already has a ring*/
+        mutex_unlock(&current_message_slot->ring_lock);
+        charge_message_slot_memory(current_message_slot, -slot_ring_memory(ring));
+        free_slot_ring_pages(ring);
+        kfree(ring);
+        return -EBUSY;
+    }
+    current_message_slot->ring = ring;
+    mutex_unlock(&current_message_slot->ring_lock);
+    return SUCCESS;
+}
+
+/*
+Consumes the entries that producers published in the shared ring of the file descriptor's message slot
+and delivers each one to its channel, so that readers using read() see them.
+The kernel acts as the ring's consumer, it must not be used together with a user space consumer.
+Entries with a zero channel ID or a length outside 1..max_message_size are skipped.
+Flushing stops at an entry whose channel's queue is full, that entry stays in the ring.
+Returns the number of delivered messages, or an error code on failure.
+*/
+static long flush_slot_ring(data_file *current_data_file)
+{
+    message_slot *current_message_slot;
+    message_slot_ring *ring;
+    struct msg_slot_ring_entry *entry;
+    single_message_channel *current_single_message_channel;
+    message_payload *payload;
+    u64 head;
+    u64 tail;
+    unsigned int channel_id;
+    unsigned int message_length;
+    long delivered;
+    int deliver_ret;
+
+    current_message_slot = xa_load(&message_slot_xarray, current_data_file->minor);
+    if (current_message_slot == NULL)
+    {
+        /*The slot has no ring*/
+        return -EINVAL;
+    }
+    mutex_lock(&current_message_slot->ring_lock);
+    ring = current_message_slot->ring;
+    if (ring == NULL)
+    {
+        /*The slot has no ring*/
+        mutex_unlock(&current_message_slot->ring_lock);
+        return -EINVAL;
+    }
+    delivered = 0;
+    head = READ_ONCE(ring->header->head);
+    tail = smp_load_acquire(&ring->header->tail); /*pairs with the producer's release of the entries*/
+    if (tail - head > ring->entry_count)
+    {
+        /*The indexes were corrupted by user space*/
+        mutex_unlock(&current_message_slot->ring_lock);
+        return -EINVAL;
+    }
+    while (head != tail)
+    {
+        entry = (struct msg_slot_ring_entry*)(ring->entries + (size_t)(head & (ring->entry_count - 1)) * ring->entry_size);
+        /*user space can change the entry at any time, read each field once*/
+        channel_id = READ_ONCE(entry->channel_id);
+        message_length = READ_ONCE(entry->message_length);
+        if (channel_id == 0 || message_length == 0 || message_length > ring->max_message_size)
+        {
+            /*The entry is not valid, skip it*/
+            head++;
+            continue;
+        }
+        if (reserve_message_slot_memory(current_message_slot) != SUCCESS)
+        {
+            /*Over the memory budget, keep the entry for the next flush*/
+            break;
+        }
+        payload = alloc_message_payload(message_length);
+        if (payload == NULL)
+        {
+            break;
+        }
+        memcpy(payload->message, entry->message, message_length);
+        current_single_message_channel = lookup_slot_channel(current_message_slot, channel_id, true);
+        if (IS_ERR(current_single_message_channel))
+        {
+            put_message_payload(payload);
+            break;
+        }
+        deliver_ret = deliver_message_payload(current_single_message_channel, payload);
+        put_single_message_channel(current_single_message_channel);
+        if (deliver_ret != SUCCESS)
+        {
+            /*The channel's queue is full, keep the entry for the next flush*/
+            put_message_payload(payload);
+            break;
+        }
+        delivered++;
+        head++;
+    }
+    smp_store_release(&ring->header->head, head); /*the consumed entries can be reused by the producers*/
+    mutex_unlock(&current_message_slot->ring_lock);
+    if (delivered == 0 && head != tail)
+    {
+        /*Nothing could be delivered*/
+        return -EAGAIN;
+    }
+    return delivered;
+}
+
+/*Frees the shared ring of a message slot, no mapping of it can be left*/
+static void free_slot_ring(message_slot *current_message_slot)
+{
+    if (current_message_slot->ring != NULL)
+    {
+        charge_message_slot_memory(current_message_slot, -slot_ring_memory(current_message_slot->ring));
+        free_slot_ring_pages(current_message_slot->ring);
+        kfree(current_message_slot->ring);
+        current_message_slot->ring = NULL;
+    }
+}
+
+/*
+DEVICE FUNCTIONS
+*/
+/*
+ Opens a device file. Only the per file descriptor data_file is allocated here,
+ the message slot and its channels are allocated by device_ioctl when a channel is selected.
+ Inputs: inode: The device file's inode, file: The open file's structure.
+ Output: Returns 0 on success, -ENOMEM on memory allocation failure.
+ */
+static int device_open(struct inode *inode, struct file *file)
+{
+    int current_minor;
+    data_file *current_data_file;
+    current_minor = iminor(inode);
+    if (current_minor >= minor_count)
+    {
+        /*The minor number is not valid*/
+        trace_message_slot_open(current_minor, -ENODEV);
+        return -ENODEV;
+    }
+
+    /*save the minor and the channel id in data_file struct*/
+    current_data_file = (data_file*)kmem_cache_alloc(data_file_cache, GFP_KERNEL);
+    if (current_data_file == NULL)
+    {
+        /*If allocate memory fialed, print an error and exit*/
+        printk(KERN_ERR "message_slot: Failed to allocate memory for the data_file\n");
+        trace_message_slot_open(current_minor, -ENOMEM);
+        return -ENOMEM;
+    }
+    current_data_file->minor = current_minor;
+    current_data_file->channel_id = 0; /*Will be updated in the device_ioctl function*/
+    RCU_INIT_POINTER(current_data_file->channel, NULL); /*Will be resolved in the device_ioctl function*/
+    current_data_file->last_read_sequence = 0; /*Nothing was read yet*/
+    file -> private_data = (void*)current_data_file; /*save the data_file struct in the file's private_data*/
+    file->f_mode |= FMODE_NOWAIT; /*read_iter and write_iter honor IOCB_NOWAIT, so io_uring may issue them inline*/
+
+    trace_message_slot_open(current_minor, SUCCESS);
+    return SUCCESS;
+}
+
+/*
+Releases the device and frees associated resources.
+Inputs: node: The device file's inode, file: The open file's structure.
+Output: Returns SUCCESS (0) after successful release.
+*/
+static int device_release(struct inode *inode, struct file *file)
+{
+    data_file *current_data_file;
+    single_message_channel *current_single_message_channel;
+    current_data_file = (data_file*)(file->private_data);
+    if (current_data_file == NULL)
+    {
+        return SUCCESS;
+    }
+    /*no other user of the file descriptor is left*/
+    current_single_message_channel = rcu_dereference_protected(current_data_file->channel, 1);
+    if (current_single_message_channel != NULL)
+    {
+        /*drop the reference that device_ioctl took on the channel*/
+        put_single_message_channel(current_single_message_channel);
+    }
+    kmem_cache_free(data_file_cache, current_data_file);
+    return SUCCESS;
+}
+
+/*Returns whether a read or write must not sleep- the file is O_NONBLOCK, or io_uring asked for IOCB_NOWAIT*/
+static bool device_iocb_nonblocking(struct kiocb *iocb)
+{
+    return (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+/*
+Finds the channel selected by the file position of a read or write on a file descriptor with no channel,
+so that pread/pwrite, preadv/pwritev and io_uring can address any channel of the slot through the offset.
+A write creates the channel, a read only looks it up.
+Returns the channel with a reference held, NULL if the read channel does not exist, or an ERR_PTR.
+*/
+static single_message_channel* find_offset_single_message_channel(data_file *current_data_file, loff_t position, bool create)
+{
+    message_slot *current_message_slot;
+
+    if (position <= 0 || position > UINT_MAX)
+    {
+        /*The offset is not a valid channel id*/
+        return ERR_PTR(-EINVAL);
+    }
+    if (create)
+    {
+        current_message_slot = find_or_create_message_slot(current_data_file->minor);
+        if (IS_ERR(current_message_slot))
+        {
+            return ERR_CAST(current_message_slot);
+        }
+        return lookup_slot_channel(current_message_slot, (unsigned int)position, true);
+    }
+    current_message_slot = xa_load(&message_slot_xarray, current_data_file->minor);
+    if (current_message_slot == NULL)
+    {
+        return NULL;
+    }
+    return lookup_slot_channel(current_message_slot, (unsigned int)position, false);
+}
+
+/*
+Allocates a payload for the message of a write to a message slot and copies it from the writer's iov_iter.
+Returns the payload, or an ERR_PTR of -EMSGSIZE, -ENOMEM (also when over the memory budget) or -EFAULT.
+*/
+static message_payload* copy_message_payload_from_iter(struct iov_iter *from, message_slot *current_message_slot)
+{
+    message_payload *payload;
+    size_t length;
+    u64 copy_start;
+
+    length = iov_iter_count(from);
+    if (length > READ_ONCE(current_message_slot->max_message_size) || length == 0)
+    {
+        /*The message is too long or too short*/
+        return ERR_PTR(-EMSGSIZE);
+    }
+    if (reserve_message_slot_memory(current_message_slot) != SUCCESS)
+    {
+        return ERR_PTR(-ENOMEM);
+    }
+    payload = alloc_message_payload(length);
+    if (payload == NULL)
+    {
+        /*If allocate memory fialed, exit*/
+        return ERR_PTR(-ENOMEM);
+    }
+    copy_start = latency_phase_start();
+    if (!copy_from_iter_full(payload->message, length, from))
+    {
+        /*The user buffer is not valid*/
+        put_message_payload(payload);
+        return ERR_PTR(-EFAULT);
+    }
+    latency_phase_end(LATENCY_WRITE_COPY, copy_start);
+    return payload;
+}
 
 /*
-DEVICE FUNCTIONS
+Reads the oldest message of a channel in queue mode into the reader's iov_iter and removes it from the queue.
+A blocking read sleeps while the queue is empty, a non-blocking one gets -EWOULDBLOCK.
+Returns the number of bytes read, 0 if the channel left queue mode meanwhile, or an error code on failure.
 */
-/*
- Opens a device file, initializing a new message slot if necessary and message channel.
- Inputs: inode: The device file's inode, file: The open file's structure.
- Output: Returns 0 on success, -ENOMEM on memory allocation failure.
- */
-static int device_open(struct inode *inode, struct file *file)
+static ssize_t device_read_queue(struct kiocb *iocb, data_file *current_data_file, struct iov_iter *to)
 {
-    int found;
-    int  i;
-    int current_minor;
-    data_file *current_data_file;
-    single_message_channel *temp_single_message_channel;
-    single_message_channel *new_single_message_channel;
-    temp_single_message_channel  = NULL;
-    found = 0;
-    current_minor = iminor(inode);
-    /*Check if a message with this minor message hasn't already open*/
-    if (count_individual_message_slot == 0)
+    single_message_channel *current_single_message_channel;
+    message_payload *payload; /*the message removed from the queue*/
+    ssize_t read_ret;
+
+    current_single_message_channel = get_data_file_channel(current_data_file);
+    if (current_single_message_channel == NULL)
     {
-        /*first message that the device driver has created*/
-        for (i = 0; i < MAX_NUMBER_OF_MINOR_DEVICES; i++)
+        /*device_ioctl switched the channel meanwhile, read the new one*/
+        return 0;
+    }
+relock:
+    spin_lock(&current_single_message_channel->slot->write_lock);
+    while (current_single_message_channel->queue_depth != 0 && current_single_message_channel->queue_count == 0)
+    {
+        spin_unlock(&current_single_message_channel->slot->write_lock);
+        if (device_iocb_nonblocking(iocb))
         {
-            /*allocate place for the array*/
-            message_slot_array[i] = (message_slot*)kmalloc(sizeof(struct message_slot), GFP_KERNEL);
-            if (message_slot_array[i] == NULL)
-            {
-                printk(KERN_ERR "message_slot: Failed to allocate memory for the message_slot array\n");
-                return -ENOMEM;
-            }
-            /*initialize the message_slot array*/
-            message_slot_array[i]->head = NULL;
+            /*The queue is empty*/
+            read_ret = -EWOULDBLOCK;
+            goto out;
         }
+        read_ret = wait_event_interruptible(current_single_message_channel->readers_wait,
+                                            READ_ONCE(current_single_message_channel->queue_count) != 0 ||
+                                            READ_ONCE(current_single_message_channel->queue_depth) == 0);
+        if (read_ret != 0)
+        {
+            /*Interrupted by a signal*/
+            goto out;
+        }
+        spin_lock(&current_single_message_channel->slot->write_lock);
     }
-    /*Make new single message slot*/
-    new_single_message_channel = (single_message_channel*)kmalloc(sizeof(struct single_message_channel), GFP_KERNEL);
-    if (new_single_message_channel == NULL)
+    if (current_single_message_channel->queue_depth == 0)
     {
-        /*If allocate memory fialed, print an error and exit*/
-        printk(KERN_ERR "message_slot: Failed to allocate memory for the single_message_channel\n");
-        return -ENOMEM;
+        /*The channel went back to last message mode*/
+        spin_unlock(&current_single_message_channel->slot->write_lock);
+        read_ret = 0;
+        goto out;
     }
-    /*initialize the single message channel*/
-    new_single_message_channel->message_channel_ID = 0;
-    new_single_message_channel->message_length = 0;
-    new_single_message_channel->next = NULL;
-
-    /*Put the single message channel in it place according to the message slot minor*/
-    if (message_slot_array[current_minor]->head == NULL)
+    if (iov_iter_count(to) < current_single_message_channel->queue[current_single_message_channel->queue_head]->message_length)
     {
-        message_slot_array[current_minor]->head = new_single_message_channel;
+        /*The buffer is too short, the message stays queued*/
+        spin_unlock(&current_single_message_channel->slot->write_lock);
+        read_ret = -ENOSPC;
+        goto out;
     }
-    else
+
+    /*copy the message to the buffer from the kernel space to the user space before it leaves the queue*/
+    payload = copy_queued_message_to_iter(current_single_message_channel, to);
+    if (payload == ERR_PTR(-EAGAIN))
     {
-        temp_single_message_channel = message_slot_array[current_minor]->head;
-        /*put the new message last*/
-        while (temp_single_message_channel->next != NULL)
-        {
-            /*find place for the new message*/
-            temp_single_message_channel = temp_single_message_channel->next;
-        }
-        temp_single_message_channel->next = new_single_message_channel;
+        /*The user buffer was faulted in, copy again*/
+        goto relock;
     }
-    /*update the number of messages that the device drive has already created*/
-    count_individual_message_slot++;
-
-    /*save the minor and the channel id in data_file struct*/
-    current_data_file = (data_file*)kmalloc(sizeof(struct data_file), GFP_KERNEL);
-    if (current_data_file == NULL)
+    if (IS_ERR(payload))
     {
-        /*If allocate memory fialed, print an error and exit*/
-        printk(KERN_ERR "message_slot: Failed to allocate memory for the data_file\n");
-        return -ENOMEM;
+        read_ret = PTR_ERR(payload);
+        goto out;
     }
-    current_data_file->minor = current_minor;
-    current_data_file->channel_id = 0; /*Will be updated in the device_ioctl function*/
-    file -> private_data = (void*)current_data_file; /*save the data_file struct in the file's private_data*/
-
-    return SUCCESS;
+    read_ret = payload->message_length;
+    put_message_payload(payload);
+out:
+    put_single_message_channel(current_single_message_channel);
+    return read_ret;
 }
 
 /*
-Releases the device and frees associated resources.
-Inputs: node: The device file's inode, file: The open file's structure.
-Output: Returns SUCCESS (0) after successful release.
+Reads the message of the channel that the file position selects, on a file descriptor with no channel.
+There is no per channel read sequence for such reads, so they never sleep- the last message is returned,
+or in queue mode the oldest queued message is consumed, and an empty channel gives -EWOULDBLOCK.
+Returns the number of bytes read on success, or an error code on failure.
 */
-static int device_release(struct inode *inode, struct file *file)
+static ssize_t device_read_offset(struct kiocb *iocb, data_file *current_data_file, struct iov_iter *to)
 {
-    kfree(file->private_data);
-    return SUCCESS;
+    single_message_channel *current_single_message_channel;
+    ssize_t read_ret;
+
+    current_single_message_channel = find_offset_single_message_channel(current_data_file, iocb->ki_pos, false);
+    if (IS_ERR(current_single_message_channel))
+    {
+        return PTR_ERR(current_single_message_channel);
+    }
+    if (current_single_message_channel == NULL)
+    {
+        /*No message was ever written to the channel*/
+        return -EWOULDBLOCK;
+    }
+    read_ret = read_channel_message(current_single_message_channel, to, NULL);
+    account_message_read(current_single_message_channel, read_ret);
+    put_single_message_channel(current_single_message_channel);
+    return read_ret;
 }
 
 /*
-Reads the last message written on the channel into the user's buffer.
+Reads the last message written on the file descriptor's channel into the reader's iov_iter.
+In queue mode the oldest queued message is consumed instead, see device_read_queue.
+Readers never take a lock: the channel and its current payload are found under RCU,
+and a payload is never changed once published, a writer replaces it with a new one.
+A blocking read only returns messages that are new since the file descriptor's last read and
+sleeps until one is written, a non-blocking one (O_NONBLOCK or IOCB_NOWAIT) returns the last message or -EWOULDBLOCK,
+which lets io_uring wait on device_poll and retry.
 Returns the number of bytes read on success, or an error code on failure.
  */
-static ssize_t device_read(struct file *file, char __user *buffer, size_t length, loff_t *offset)
+static ssize_t device_read_channel(struct kiocb *iocb, data_file *current_data_file, struct iov_iter *to)
 { 
     /*message related structs*/  
-    struct message_slot *current_message_slot;
     struct single_message_channel *current_single_message_channel;
-    struct single_message_channel *temp_single_message_channel;
+    message_payload *payload;
+    unsigned int message_length;
+    u64 message_sequence;
+    u64 last_read_sequence;
+    int wait_ret;
+    ssize_t read_ret;
+
+    last_read_sequence = READ_ONCE(current_data_file->last_read_sequence);
+    for (;;)
+    {
+        rcu_read_lock();
+        /*the channel was already resolved by device_ioctl, no lookup is needed*/
+        current_single_message_channel = rcu_dereference(current_data_file->channel);
 
-    /*for the file->private_data related info*/
-    unsigned int file_channel_id;
-    unsigned int file_minor;
+        if (current_single_message_channel == NULL)
+        {
+            /*The channel id is not valid*/
+            rcu_read_unlock();
+            return -EINVAL;
+        }
+        if (READ_ONCE(current_single_message_channel->queue_depth) != 0)
+        {
+            /*Queue mode- consume the oldest queued message*/
+            rcu_read_unlock();
+            read_ret = device_read_queue(iocb, current_data_file, to);
+            if (read_ret != 0)
+            {
+                return read_ret;
+            }
+            /*The channel went back to last message mode meanwhile*/
+            continue;
+        }
+        payload = rcu_dereference(current_single_message_channel->payload);
+        /*
+        an O_NONBLOCK read returns the last message even if it was read already, as the read of a message slot always did.
+        IOCB_NOWAIT alone only asks not to sleep- io_uring retries the read from a worker on -EAGAIN, which must then
+        wait for a new message like the blocking read it stands for
+        */
+        if (payload != NULL && ((iocb->ki_filp->f_flags & O_NONBLOCK) || payload->message_sequence != last_read_sequence))
+        {
+            /*There is a message to return*/
+            message_length = payload->message_length;
+            message_sequence = payload->message_sequence;
+            if (iov_iter_count(to) < message_length)
+            {
+                /*The buffer is too short*/
+                rcu_read_unlock();
+                return -ENOSPC;
+            }
+            /*
+            Main part-copy the message to the buffer from the kernel space to the user space in one go
+            */
+            read_ret = copy_message_payload_to_iter(payload, to);
+            if (read_ret == -EAGAIN)
+            {
+                /*A writer replaced the message meanwhile, read the new one*/
+                continue;
+            }
+            if (read_ret != 0)
+            {
+                /*The user buffer is not valid*/
+                return read_ret;
+            }
+            WRITE_ONCE(current_data_file->last_read_sequence, message_sequence); /*the message is no longer new for this file descriptor*/
+            return message_length;
+        }
+        rcu_read_unlock();
+        if (device_iocb_nonblocking(iocb))
+        {
+            /*The message is empty*/
+            return -EWOULDBLOCK;
+        }
+        /*
+        sleep until a message that this file descriptor has not read yet is written, or the channel moves to queue mode,
+        whose messages are consumed by device_read_queue- the loop checks the mode again after the wakeup
+        */
+        current_single_message_channel = get_data_file_channel(current_data_file);
+        if (current_single_message_channel == NULL)
+        {
+            /*device_ioctl switched the channel meanwhile, read the new one*/
+            continue;
+        }
+        wait_ret = wait_event_interruptible(current_single_message_channel->readers_wait,
+                                            READ_ONCE(current_single_message_channel->message_sequence) != last_read_sequence ||
+                                            READ_ONCE(current_single_message_channel->queue_depth) != 0);
+        put_single_message_channel(current_single_message_channel);
+        if (wait_ret != 0)
+        {
+            /*Interrupted by a signal*/
+            return wait_ret;
+        }
+    }
+}
 
-    int  i;
+/*
+Reads a message of the device file into the reader's iov_iter, see device_read_channel.
+On a file descriptor with no channel the file position selects the channel, see device_read_offset.
+Returns the number of bytes read on success, or an error code on failure.
+*/
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    data_file *current_data_file;
+    single_message_channel *current_single_message_channel;
+    size_t length;
+    ssize_t read_ret;
 
     /*Check if the file's private_data is valid*/
-    if (file->private_data == NULL)
+    if (iocb->ki_filp->private_data == NULL)
     {
         /*The file's private_data is not valid*/
         return -EINVAL;
     }
-    /*save the file->private_data related info*/
-    file_channel_id = ((data_file*)(file->private_data))->channel_id;
-    file_minor = ((data_file*)(file->private_data))->minor;
-
-    if (file_channel_id == 0)
+    if (user_backed_iter(to) && iter_iov_addr(to) == NULL)
     {
-        /*The channel id is not valid*/
+        /*The buffer is not valid*/
         return -EINVAL;
     }
-    if (buffer == NULL)
+    current_data_file = (data_file*)(iocb->ki_filp->private_data);
+    length = iov_iter_count(to);
+    if (rcu_access_pointer(current_data_file->channel) == NULL)
     {
-        /*The buffer is not valid*/
-        return -EINVAL;
+        /*No channel was selected by device_ioctl, the offset selects it*/
+        read_ret = device_read_offset(iocb, current_data_file, to);
+        trace_message_slot_read(current_data_file->minor, (unsigned int)iocb->ki_pos, length, read_ret);
+        return read_ret;
     }
-    
-    /*save the current message slot by it minor*/
-    current_message_slot = (message_slot*)(message_slot_array[file_minor]);
+    read_ret = device_read_channel(iocb, current_data_file, to);
+    /*counted on the file descriptor's channel, a read racing with a channel switch may be counted on the new one*/
+    rcu_read_lock();
+    current_single_message_channel = rcu_dereference(current_data_file->channel);
+    account_message_read(current_single_message_channel, read_ret);
+    trace_message_slot_read(current_data_file->minor, current_single_message_channel->message_channel_ID, length, read_ret);
+    rcu_read_unlock();
+    return read_ret;
+}
+
+/*
+Reports the readiness of the file descriptor's channel for poll/epoll.
+The channel is readable when it holds a message that this file descriptor has not read yet,
+and is always writable. In queue mode it is readable while the queue is not empty and
+writable while the queue is not full.
+*/
+static __poll_t device_poll(struct file *file, poll_table *wait)
+{
+    data_file *current_data_file;
+    single_message_channel *current_single_message_channel;
+    unsigned int queue_depth;
+    unsigned int queue_count;
+    __poll_t mask;
 
-    if(current_message_slot == NULL)
+    current_data_file = (data_file*)(file->private_data);
+    if (current_data_file == NULL)
     {
-        /*The minor number is not valid*/
-        return -EINVAL;
+        return EPOLLERR;
     }
-    if (current_message_slot->head == NULL)
+    /*poll_wait may sleep, so pin the channel instead of staying in an RCU read-side section*/
+    current_single_message_channel = get_data_file_channel(current_data_file);
+    if (current_single_message_channel == NULL)
     {
-        /*The message slot is empty*/
-        return -EINVAL;
+        /*No channel was selected yet*/
+        return EPOLLERR;
     }
-    temp_single_message_channel = current_message_slot->head;
-    current_single_message_channel = NULL;
-    /*find the wanted message*/
-    while (temp_single_message_channel != NULL)
+    poll_wait(file, &current_single_message_channel->readers_wait, wait);
+    poll_wait(file, &current_single_message_channel->writers_wait, wait);
+    queue_depth = READ_ONCE(current_single_message_channel->queue_depth);
+    if (queue_depth == 0)
     {
-        if (temp_single_message_channel->message_channel_ID == file_channel_id)
+        mask = EPOLLOUT | EPOLLWRNORM;
+        if (READ_ONCE(current_single_message_channel->message_sequence) != READ_ONCE(current_data_file->last_read_sequence))
         {
-            current_single_message_channel = temp_single_message_channel;
-            break;
+            /*A message that this file descriptor has not read yet*/
+            mask |= EPOLLIN | EPOLLRDNORM;
         }
-        temp_single_message_channel = temp_single_message_channel->next;
     }
-    if (current_single_message_channel == NULL)
+    else
     {
-        /*The message channel was not found*/
-        return -EWOULDBLOCK;
+        /*Queue mode- readable while messages are queued, writable while there is room*/
+        queue_count = READ_ONCE(current_single_message_channel->queue_count);
+        mask = 0;
+        if (queue_count != 0)
+        {
+            mask |= EPOLLIN | EPOLLRDNORM;
+        }
+        if (queue_count < queue_depth)
+        {
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        }
     }
-    if (current_single_message_channel->message_length == 0 || current_single_message_channel->message == NULL)
+    put_single_message_channel(current_single_message_channel);
+    return mask;
+}
+
+/*
+Appends a message to the queue of a channel in queue mode, taking over the caller's payload reference.
+The caller holds a reference on the channel. When the queue is full a blocking write sleeps until a reader makes room,
+a non-blocking one gets -EAGAIN. If the channel leaves queue mode meanwhile the message
+becomes its last message.
+Returns the number of bytes written on success, or an error code on failure.
+*/
+static ssize_t device_write_queue(struct kiocb *iocb, single_message_channel *current_single_message_channel, message_payload *payload)
+{
+    ssize_t write_ret;
+
+    spin_lock(&current_single_message_channel->slot->write_lock);
+    while (current_single_message_channel->queue_depth != 0 &&
+           current_single_message_channel->queue_count == current_single_message_channel->queue_depth)
     {
-        /*The message is empty*/
-        return -EWOULDBLOCK;
+        spin_unlock(&current_single_message_channel->slot->write_lock);
+        if (device_iocb_nonblocking(iocb))
+        {
+            /*The queue is full*/
+            write_ret = -EAGAIN;
+            put_message_payload(payload);
+            return write_ret;
+        }
+        write_ret = wait_event_interruptible(current_single_message_channel->writers_wait,
+                                             READ_ONCE(current_single_message_channel->queue_count) < READ_ONCE(current_single_message_channel->queue_depth) ||
+                                             READ_ONCE(current_single_message_channel->queue_depth) == 0);
+        if (write_ret != 0)
+        {
+            /*Interrupted by a signal*/
+            put_message_payload(payload);
+            return write_ret;
+        }
+        spin_lock(&current_single_message_channel->slot->write_lock);
+    }
+    write_ret = payload->message_length;
+    if (current_single_message_channel->queue_depth == 0)
+    {
+        /*The channel went back to last message mode*/
+        publish_message_payload(current_single_message_channel, payload);
     }
-    if (length < current_single_message_channel->message_length)
+    else
     {
-        /*The buffer is too short*/
-        return -ENOSPC;
+        push_queued_message(current_single_message_channel, payload);
     }
+    spin_unlock(&current_single_message_channel->slot->write_lock);
+    wake_channel_readers(current_single_message_channel);
+    return write_ret;
+}
 
-    /*
-    Main part-copy the message to the buffer from the kernel space to the user space
-    */
-   for (i = 0; i < current_single_message_channel->message_length; i++)
-   {
-         if (put_user(current_single_message_channel->message[i], &buffer[i]) < 0)
-         {
-              /*If put user fialed, print an error and exit*/
-              return -ENOMEM;
-         }
-   }
-   return current_single_message_channel->message_length;
+/*
+Writes the message of a write on a file descriptor with no channel to the channel that the file position selects,
+creating it if needed. Such writes never sleep, a full queue gives -EAGAIN.
+Returns the number of bytes written on success, or an error code on failure.
+*/
+static ssize_t device_write_offset(struct kiocb *iocb, data_file *current_data_file, struct iov_iter *from)
+{
+    single_message_channel *current_single_message_channel;
+    message_payload *payload;
+    ssize_t write_ret;
+
+    current_single_message_channel = find_offset_single_message_channel(current_data_file, iocb->ki_pos, true);
+    if (IS_ERR(current_single_message_channel))
+    {
+        return PTR_ERR(current_single_message_channel);
+    }
+    payload = copy_message_payload_from_iter(from, current_single_message_channel->slot);
+    if (IS_ERR(payload))
+    {
+        write_ret = PTR_ERR(payload);
+    }
+    else
+    {
+        write_ret = payload->message_length;
+        if (deliver_message_payload(current_single_message_channel, payload) != SUCCESS)
+        {
+            /*The queue is full*/
+            put_message_payload(payload);
+            write_ret = -EAGAIN;
+        }
+    }
+    account_message_write(current_single_message_channel, write_ret);
+    put_single_message_channel(current_single_message_channel);
+    return write_ret;
 }
 
 /*
-writes an non-empty message up to 128 bytes from the user's buffer to the channel.
+writes an non-empty message up to the slot's max message size (128 bytes by default) from the writer's iov_iter to the file descriptor's channel.
 Returns the number of bytes written on success, or an error code on failure.
  */
 
-static ssize_t device_write(struct file *file, const char __user *buffer, size_t length, loff_t *offset)
+static ssize_t device_write_channel(struct kiocb *iocb, data_file *current_data_file, struct iov_iter *from)
 {
     /*message related structs*/  
     struct single_message_channel *current_single_message_channel;
-    struct single_message_channel *temp_single_message_channel;
-    char* backup_message; /*save the previous message in case of an error*/  
-
-    /*save the file->private_data related info*/
-    unsigned int file_channel_id;
-    unsigned int file_minor;
-    int i;
-    int is_head;
-    is_head = 0;
+    message_payload *payload; /*the new message, the channel is untouched if the user copy faults*/
+    ssize_t write_ret;
 
-    if (file->private_data == NULL || buffer == NULL)
+    /*the reference keeps the channel alive if another thread switches the file descriptor and the channel is evicted*/
+    current_single_message_channel = get_data_file_channel(current_data_file);
+    if (current_single_message_channel == NULL)
     {
         return -EINVAL;
     }
-    file_channel_id = ((data_file*)(file->private_data))->channel_id;
-    file_minor = ((data_file*)(file->private_data))->minor;
 
-    if (file_channel_id == 0)
+    /*
+    Main part- copy the message to the buffer from the user space to the kernel space in one go,
+    straight into a payload sized for it, which is published only once the whole copy succeeded
+    */
+    payload = copy_message_payload_from_iter(from, current_single_message_channel->slot);
+    if (IS_ERR(payload))
     {
-        return -EINVAL;
+        put_single_message_channel(current_single_message_channel);
+        return PTR_ERR(payload);
     }
-    /*Check if we can get to the minor place in message_slot_array*/
-    if(message_slot_array[file_minor] == NULL)
+
+    spin_lock(&current_single_message_channel->slot->write_lock);
+    if (current_single_message_channel->queue_depth != 0)
+    {
+        /*Queue mode- the message is appended to the queue, which may have to wait for room*/
+        spin_unlock(&current_single_message_channel->slot->write_lock);
+        write_ret = device_write_queue(iocb, current_single_message_channel, payload);
+        put_single_message_channel(current_single_message_channel);
+        return write_ret;
+    }
+    /*replace the message of the single message channel*/
+    write_ret = payload->message_length;
+    publish_message_payload(current_single_message_channel, payload);
+    spin_unlock(&current_single_message_channel->slot->write_lock);
+    wake_channel_readers(current_single_message_channel);
+    put_single_message_channel(current_single_message_channel);
+    return write_ret; /*return the length of the message*/
+}
+
+/*
+Writes a message to the device file, see device_write_channel.
+write, writev, io_uring and splice all land here, a whole call is always one message.
+On a file descriptor with no channel the file position selects the channel, see device_write_offset.
+Returns the number of bytes written on success, or an error code on failure.
+*/
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    data_file *current_data_file;
+    single_message_channel *current_single_message_channel;
+    size_t length;
+    ssize_t write_ret;
+
+    if (iocb->ki_filp->private_data == NULL || (user_backed_iter(from) && iter_iov_addr(from) == NULL))
     {
-        /*The minor number is not valid*/
         return -EINVAL;
     }
-    /*save the head of the message_slot_array in position minor*/
-    current_single_message_channel = message_slot_array[file_minor]->head;
-    while (current_single_message_channel->next != NULL)
+    current_data_file = (data_file*)(iocb->ki_filp->private_data);
+    length = iov_iter_count(from);
+    if (rcu_access_pointer(current_data_file->channel) == NULL)
     {
-        /*find the wanted message*/
-        if (current_single_message_channel->message_channel_ID == file_channel_id)
-        {
-            /*The message channel was found!*/
-            break;
-        }
-        current_single_message_channel = current_single_message_channel->next; /*move to the next single message channel*/
+        /*No channel was selected by device_ioctl, the offset selects it*/
+        write_ret = device_write_offset(iocb, current_data_file, from);
+        trace_message_slot_write(current_data_file->minor, (unsigned int)iocb->ki_pos, length, write_ret);
+        return write_ret;
     }
-    if (current_single_message_channel == NULL)
+    write_ret = device_write_channel(iocb, current_data_file, from);
+    /*counted on the file descriptor's channel, a write racing with a channel switch may be counted on the new one*/
+    rcu_read_lock();
+    current_single_message_channel = rcu_dereference(current_data_file->channel);
+    account_message_write(current_single_message_channel, write_ret);
+    trace_message_slot_write(current_data_file->minor, current_single_message_channel->message_channel_ID, length, write_ret);
+    rcu_read_unlock();
+    return write_ret;
+}
+
+/*
+Maps the shared ring of the file's message slot, which MSG_SLOT_RING_SETUP must have allocated.
+The whole ring is mapped from offset 0, its header page first.
+Returns 0 on success, or an error code on failure.
+*/
+static int device_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    data_file *current_data_file;
+    message_slot *current_message_slot;
+    int mmap_ret;
+
+    current_data_file = (data_file*)(file->private_data);
+    current_message_slot = xa_load(&message_slot_xarray, current_data_file->minor);
+    if (current_message_slot == NULL)
     {
-        /*The message channel was not found*/
+        /*The slot has no ring*/
         return -EINVAL;
     }
-    if (current_single_message_channel->message_channel_ID != file_channel_id) 
+    mutex_lock(&current_message_slot->ring_lock);
+    if (current_message_slot->ring == NULL || vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > current_message_slot->ring->size)
     {
+        /*No ring, or the mapping does not fit it*/
+        mutex_unlock(&current_message_slot->ring_lock);
+        return -EINVAL;
+    }
+    mmap_ret = vm_map_pages(vma, current_message_slot->ring->pages, current_message_slot->ring->page_count);
+    mutex_unlock(&current_message_slot->ring_lock);
+    return mmap_ret;
+}
 
-        /*The message channel was not found so we make a new one*/
-        temp_single_message_channel = (single_message_channel*)kmalloc(sizeof(struct single_message_channel), GFP_KERNEL);
-        if (temp_single_message_channel == NULL)
-        {
-            /*If allocate memory fialed, print an error and exit*/
-            return -ENOMEM;
-        }
-        /*initialize the single message channel*/
-        temp_single_message_channel->next = NULL; /*The next single message channel is NULL*/
-        temp_single_message_channel->message_length = 0; /*The message length is 0 for now, will be updated*/
-        temp_single_message_channel->message_channel_ID = file_channel_id; /*update the message channel ID*/
-        current_single_message_channel->next = temp_single_message_channel; /*put the new message last*/  
-        current_single_message_channel = temp_single_message_channel; 
+/*
+Takes a single unsighned int parameter that specifies non-zero channel id and sets the file descriptor's channel id to this value.
+The channel is resolved (or created) once here and pinned in the data_file, so device_read and device_write do no lookup.
+MSG_SLOT_QUEUE_DEPTH sets the queue depth of the selected channel, see set_channel_queue_depth.
+MSG_SLOT_MAX_MESSAGE_SIZE sets the max message size of the file's message slot, see set_slot_max_message_size.
+MSG_SLOT_RING_SETUP and MSG_SLOT_RING_FLUSH manage the slot's shared ring, see setup_slot_ring and flush_slot_ring.
+MSG_SLOT_WRITE_BATCH and MSG_SLOT_READ_BATCH access many channels in one call, see write_message_batch and read_message_batch.
+MSG_SLOT_CHANNEL_STATS reads the statistics of a channel, see get_channel_stats.
+MSG_SLOT_DELETE_CHANNEL deletes a channel that is not in use, see delete_slot_channel.
+MSG_SLOT_READ_VERSIONED reads a message with its sequence and write time, see read_versioned_message.
+MSG_SLOT_SUBSCRIBE and MSG_SLOT_UNSUBSCRIBE change the subscribers of a topic channel, see change_channel_subscription.
+MSG_SLOT_RESTORE loads a snapshot of debugfs message_slot/snapshot into the message slots, see restore_message_slots.
+*/
+static long device_ioctl_command(struct file *file, unsigned int ioctl_command_id, unsigned long ioctl_param)
+{
+    data_file *current_data_file;
+    message_slot *current_message_slot;
+    single_message_channel *current_single_message_channel;
+
+    if (ioctl_command_id == MSG_SLOT_QUEUE_DEPTH)
+    {
+        /*Switch the file descriptor's channel between last message mode and queue mode*/
+        return set_channel_queue_depth((data_file*)(file->private_data), ioctl_param);
     }
-    if (length > MAX_ZISE_BUFFER || length <= 0)
+    if (ioctl_command_id == MSG_SLOT_MAX_MESSAGE_SIZE)
     {
-        /*The message is too long or too short*/
-        return -EMSGSIZE;
+        /*Change the longest message accepted by the file descriptor's message slot*/
+        return set_slot_max_message_size((data_file*)(file->private_data), ioctl_param);
     }
-
-    /*
-    Main part- copy the message to the buffer from the user space to the kernel space
-    */
-   /*save the previous message in case of an error*/
-    backup_message = (char*)kmalloc(length, GFP_KERNEL);
-    if (backup_message == NULL)
+    if (ioctl_command_id == MSG_SLOT_RING_SETUP)
     {
-        /*If allocate memory fialed, print an error and exit*/
-        return -ENOMEM;
+        /*Allocate the shared ring of the file descriptor's message slot*/
+        return setup_slot_ring((data_file*)(file->private_data), ioctl_param);
     }
-    /*copy the message to the backup message*/
-    for(i = 0; i < length; ++i ) {
-        if(get_user(backup_message[i], &buffer[i]) < 0)
-        {
-            /*If get user fialed, print an error and exit*/
-            return -ENOMEM;
-        }
+    if (ioctl_command_id == MSG_SLOT_RING_FLUSH)
+    {
+        /*Deliver the messages of the shared ring to their channels*/
+        return flush_slot_ring((data_file*)(file->private_data));
+    }
+    if (ioctl_command_id == MSG_SLOT_WRITE_BATCH)
+    {
+        /*Write a message to each channel of the batch*/
+        return write_message_batch((data_file*)(file->private_data), ioctl_param);
+    }
+    if (ioctl_command_id == MSG_SLOT_READ_BATCH)
+    {
+        /*Read a message from each channel of the batch*/
+        return read_message_batch((data_file*)(file->private_data), ioctl_param);
+    }
+    if (ioctl_command_id == MSG_SLOT_CHANNEL_STATS)
+    {
+        /*Read the statistics of a channel*/
+        return get_channel_stats((data_file*)(file->private_data), ioctl_param);
+    }
+    if (ioctl_command_id == MSG_SLOT_DELETE_CHANNEL)
+    {
+        /*Delete a channel that no file descriptor uses*/
+        return delete_slot_channel((data_file*)(file->private_data), ioctl_param);
+    }
+    if (ioctl_command_id == MSG_SLOT_READ_VERSIONED)
+    {
+        /*Read a message with its sequence, only if it is newer than the reader's*/
+        return read_versioned_message((data_file*)(file->private_data), ioctl_param);
+    }
+    if (ioctl_command_id == MSG_SLOT_SUBSCRIBE || ioctl_command_id == MSG_SLOT_UNSUBSCRIBE)
+    {
+        /*Change the subscribers of a topic channel*/
+        return change_channel_subscription((data_file*)(file->private_data), ioctl_param, ioctl_command_id == MSG_SLOT_SUBSCRIBE);
+    }
+    if (ioctl_command_id == MSG_SLOT_RESTORE)
+    {
+        /*Load a snapshot into the message slots*/
+        return restore_message_slots(ioctl_param);
     }
-
-    /*copy the message to the single message channel*/
-    memcpy(current_single_message_channel->message, backup_message, length); /*update the message*/
-    kfree(backup_message); /*free the backup message*/
-    current_single_message_channel->message_length = length; /*update the message length*/
-    return length; /*return the length of the message*/
-}
-
-/*Takes a single unsighned int parameter that specifies non-zero channel id and sets the file descriptor's channel id to this value*/
-static long device_ioctl(struct file *file, unsigned int ioctl_command_id, unsigned long ioctl_param)
-{
     if(ioctl_command_id != MSG_SLOT_CHANNEL)
     {
         /*ioctl command is not valid*/
         return -EINVAL;
     }
-    if(ioctl_param == 0)
+    if(ioctl_param == 0 || ioctl_param > UINT_MAX)
     {
-        /*The channel id is not valid (supposed to be a non-zero number)*/
+        /*The channel id is not valid (supposed to be a non-zero 32 bit number)*/
         return -EINVAL;
     }
-    ((data_file*)(file->private_data))->channel_id = ioctl_param;
+    current_data_file = (data_file*)(file->private_data);
+    current_message_slot = find_or_create_message_slot(current_data_file->minor);
+    if (IS_ERR(current_message_slot))
+    {
+        /*If allocate memory fialed, exit*/
+        return PTR_ERR(current_message_slot);
+    }
+    current_single_message_channel = lookup_slot_channel(current_message_slot, ioctl_param, true);
+    if (IS_ERR(current_single_message_channel))
+    {
+        /*If allocate memory fialed, exit*/
+        return PTR_ERR(current_single_message_channel);
+    }
+    WRITE_ONCE(current_data_file->channel_id, ioctl_param);
+    WRITE_ONCE(current_data_file->last_read_sequence, 0); /*every message of the new channel is new for this file descriptor*/
+    /*publish the new channel, its reference now belongs to this file descriptor*/
+    current_single_message_channel = unrcu_pointer(xchg(&current_data_file->channel, RCU_INITIALIZER(current_single_message_channel)));
+    if (current_single_message_channel != NULL)
+    {
+        /*drop the reference on the previous channel, concurrent readers are protected by RCU*/
+        put_single_message_channel(current_single_message_channel);
+    }
     return SUCCESS;
 }
 
 
+/*Runs an ioctl of the device file, see device_ioctl_command, and traces its result*/
+static long device_ioctl(struct file *file, unsigned int ioctl_command_id, unsigned long ioctl_param)
+{
+    long ioctl_ret;
+
+    ioctl_ret = device_ioctl_command(file, ioctl_command_id, ioctl_param);
+    trace_message_slot_ioctl(iminor(file_inode(file)), ioctl_command_id, ioctl_param, ioctl_ret);
+    return ioctl_ret;
+}
+
 /*
 DEVICE SETUP
 */
@@ -363,53 +2620,156 @@ struct file_operations Fops = {
     .owner = THIS_MODULE, /*This sets the owner of the structure to the current module.*/
     .open = device_open, /*This function is called when the device file is opened.*/
     .release = device_release, /*This function is called when the device file is closed.*/
-    .read = device_read, /*This function is called when data is read from the device file.*/
-    .write = device_write, /*This function is called when data is written to the device file.*/
+    .read_iter = device_read_iter, /*This function is called when data is read from the device file, by read, readv or io_uring.*/
+    .write_iter = device_write_iter, /*This function is called when data is written to the device file, by write, writev or io_uring.*/
+    .splice_read = copy_splice_read, /*splice from the device file goes through read_iter.*/
+    .splice_write = iter_file_splice_write, /*splice to the device file goes through write_iter.*/
+    .poll = device_poll, /*This function is called when the device file is polled for readiness.*/
+    .mmap = device_mmap, /*This function is called when the shared ring of the message slot is mapped.*/
     .unlocked_ioctl = device_ioctl /*This function is called when the device file is open*/
 
 };
 
+/*
+DEVICE FILE FUNCTIONS
+*/
+/*Removes the device files of the first device_file_count minors*/
+static void destroy_message_slot_device_files(unsigned int device_file_count)
+{
+    unsigned int i;
+    for (i = 0; i < device_file_count; i++)
+    {
+        device_destroy(message_slot_class, message_slot_first_device + i);
+    }
+}
+
+/*
+Creates /dev/message_slot<minor> for the first device_file_count minors.
+Returns SUCCESS, or an error code after removing the device files that were created.
+*/
+static int create_message_slot_device_files(void)
+{
+    struct device *current_device;
+    unsigned int i;
+    for (i = 0; i < device_file_count; i++)
+    {
+        current_device = device_create(message_slot_class, NULL, message_slot_first_device + i, NULL, DEVICE_FILE_NAME "%u", i);
+        if (IS_ERR(current_device))
+        {
+            printk(KERN_ERR "message_slot: Failed to create the device file of minor %u\n", i);
+            destroy_message_slot_device_files(i);
+            return PTR_ERR(current_device);
+        }
+    }
+    return SUCCESS;
+}
+
 /*Initialize the moudle - Register the device driver*/
 static int __init message_slot_init(void)
 {
     int result;
     result = -1;
-    result = register_chrdev(MAJOR_NUMBER, DEVICE_FILE_NAME, &Fops);  /*Register the device driver*/
-
+    if (max_message_size == 0 || max_message_size > MAX_MESSAGE_SIZE_LIMIT)
+    {
+        /*The module parameter is not valid*/
+        printk(KERN_ERR "message_slot: max_message_size must be between 1 and %d\n", MAX_MESSAGE_SIZE_LIMIT);
+        return -EINVAL;
+    }
+    if (minor_count == 0 || minor_count > MINORMASK + 1)
+    {
+        /*The module parameter is not valid*/
+        printk(KERN_ERR "message_slot: minor_count must be between 1 and %d\n", MINORMASK + 1);
+        return -EINVAL;
+    }
+    if (device_file_count > minor_count)
+    {
+        /*Only minors of the device can have a device file*/
+        device_file_count = minor_count;
+    }
+    result = create_message_slot_caches();
+    data_file_cache = kmem_cache_create("message_slot_data_file", sizeof(struct data_file), 0, SLAB_ACCOUNT, NULL);
+    if (result < 0 || data_file_cache == NULL)
+    {
+        kmem_cache_destroy(data_file_cache);
+        destroy_message_slot_caches();
+        return -ENOMEM;
+    }
+    /*Register the device driver, with a major that no other driver uses*/
+    result = alloc_chrdev_region(&message_slot_first_device, 0, minor_count, DEVICE_FILE_NAME);
     if (result < 0)
     {
         /*Registration failed*/
         printk(KERN_ERR "message_slot: Failed to register the device driver\n");
-        return result;
+        goto free_caches;
+    }
+    cdev_init(&message_slot_cdev, &Fops);
+    message_slot_cdev.owner = THIS_MODULE;
+    result = cdev_add(&message_slot_cdev, message_slot_first_device, minor_count);
+    if (result < 0)
+    {
+        printk(KERN_ERR "message_slot: Failed to add the character device\n");
+        goto unregister_region;
+    }
+    message_slot_class = class_create(DEVICE_FILE_NAME);
+    if (IS_ERR(message_slot_class))
+    {
+        printk(KERN_ERR "message_slot: Failed to create the device class\n");
+        result = PTR_ERR(message_slot_class);
+        goto delete_cdev;
+    }
+    result = create_message_slot_device_files();
+    if (result < 0)
+    {
+        goto destroy_class;
     }
+    /*the statistics are optional, the module works without debugfs*/
+    message_slot_debugfs_dir = debugfs_create_dir(DEVICE_FILE_NAME, NULL);
+    debugfs_create_file("stats", 0444, message_slot_debugfs_dir, NULL, &message_slot_stats_fops);
+    debugfs_create_file("latency", 0444, message_slot_debugfs_dir, NULL, &message_slot_latency_fops);
+    debugfs_create_file("snapshot", 0400, message_slot_debugfs_dir, NULL, &message_slot_snapshot_fops);
+    debugfs_create_file_unsafe("latency_enable", 0644, message_slot_debugfs_dir, NULL, &message_slot_latency_enable_fops);
+    printk(KERN_INFO "message_slot: Registered major %d with %u minors, %u device files\n", MAJOR(message_slot_first_device), minor_count, device_file_count);
     return SUCCESS;
+
+destroy_class:
+    class_destroy(message_slot_class);
+delete_cdev:
+    cdev_del(&message_slot_cdev);
+unregister_region:
+    unregister_chrdev_region(message_slot_first_device, minor_count);
+free_caches:
+    kmem_cache_destroy(data_file_cache);
+    destroy_message_slot_caches();
+    return result;
 }
 
 /*Cleanup - unregister the device driver*/
 static void __exit message_slot_cleanup(void)
 {
-    int i;
-    single_message_channel *temp_single_message_channel;
-    single_message_channel *next_single_message_channel;
-    unregister_chrdev(MAJOR_NUMBER, DEVICE_FILE_NAME); /*Unregister the device driver*/
+    message_slot *current_message_slot;
+    unsigned long minor;
+    debugfs_remove_recursive(message_slot_debugfs_dir); /*Remove the statistics file*/
+    destroy_message_slot_device_files(device_file_count); /*Remove the device files*/
+    class_destroy(message_slot_class);
+    cdev_del(&message_slot_cdev);
+    unregister_chrdev_region(message_slot_first_device, minor_count); /*Unregister the device driver*/
 
-    /*free the message_slot_array*/
-    for (i = 0; i < MAX_NUMBER_OF_MINOR_DEVICES; i++)
+    /*free the message slots, only the minors that had a channel selected have one*/
+    xa_for_each(&message_slot_xarray, minor, current_message_slot)
     {
-        temp_single_message_channel = message_slot_array[i]->head;
-        while (temp_single_message_channel != NULL)
-        {
-            /*free the single message channel*/
-            next_single_message_channel = temp_single_message_channel->next; /*save the next single message channel*/
-            kfree(temp_single_message_channel); /*free the single message channel*/
-            temp_single_message_channel = next_single_message_channel; /*update the current single message channel*/
-        }
-        kfree(message_slot_array[i]); /*free the message_slot_array in place i*/ 
+        free_slot_ring(current_message_slot); /*free the shared ring of the message slot*/
+        free_message_slot(current_message_slot); /*no file descriptor can be open at this point*/
     }
-    count_individual_message_slot = 0; /*update the number of messages that the device drive has already created to 0*/
+    xa_destroy(&message_slot_xarray);
+    kmem_cache_destroy(data_file_cache);
+    destroy_message_slot_caches(); /*waits for the channels and payloads that are still freed under RCU*/
 }
 
 /*Declare the init and cleanup functions*/
 module_init(message_slot_init);
 module_exit(message_slot_cleanup);
+
+#if IS_ENABLED(CONFIG_MESSAGE_SLOT_KUNIT_TEST)
+#include "message_slot_kunit.c" /*the KUnit tests call the static file operations of the module*/
+#endif
 /*End of the module*/
@@ -2,11 +2,161 @@
 #define MESSAGE_SLOT_H
 
 #include <linux/ioctl.h> /* For I/O control device operations */
-#define MAJOR_NUMBER 235
-#define MAX_NUMBER_OF_MINOR_DEVICES 256
-#define MAX_ZISE_BUFFER 128 /*Max size of buffer for message as mention in the assignment*/
+#include <linux/types.h> /* For the fixed size types shared with user space */
+#define MAJOR_NUMBER 235 /*The magic number of the ioctl commands, the major of the device is allocated dynamically*/
+#define MAX_NUMBER_OF_MINOR_DEVICES 256 /*The default number of minors, set with the minor_count module parameter*/
+#define MAX_ZISE_BUFFER 128 /*Max size of buffer for message as mention in the assignment, the default max message size of a slot*/
+#define MAX_MESSAGE_SIZE_LIMIT 65536 /*The largest max message size that a slot can be configured with*/
 #define DEVICE_FILE_NAME "message_slot"
 #define MSG_SLOT_CHANNEL _IOW(MAJOR_NUMBER, 0, unsigned int) /* Define ioctl command */
+#define MSG_SLOT_QUEUE_DEPTH _IOW(MAJOR_NUMBER, 1, unsigned int) /* Set the queue depth of the channel, 0 for last message mode */
+#define MAX_QUEUE_DEPTH 4096 /*Max number of messages queued in a channel in queue mode*/
+#define MSG_SLOT_MAX_MESSAGE_SIZE _IOW(MAJOR_NUMBER, 2, unsigned int) /* Set the max message size of the message slot */
+#define MSG_SLOT_RING_SETUP _IOW(MAJOR_NUMBER, 3, struct msg_slot_ring_setup) /* Allocate the shared ring of the message slot */
+#define MSG_SLOT_RING_FLUSH _IO(MAJOR_NUMBER, 4) /* Deliver the messages of the shared ring to their channels */
+#define MSG_SLOT_WRITE_BATCH _IOW(MAJOR_NUMBER, 5, struct msg_slot_batch) /* Write a message to each channel of a batch */
+#define MSG_SLOT_READ_BATCH _IOW(MAJOR_NUMBER, 6, struct msg_slot_batch) /* Read a message from each channel of a batch */
+#define MSG_SLOT_CHANNEL_STATS _IOWR(MAJOR_NUMBER, 7, struct msg_slot_channel_stats) /* Read the statistics of a channel */
+#define MSG_SLOT_DELETE_CHANNEL _IOW(MAJOR_NUMBER, 8, unsigned int) /* Delete a channel that no file descriptor has selected, with its messages */
+#define MSG_SLOT_READ_VERSIONED _IOWR(MAJOR_NUMBER, 9, struct msg_slot_versioned_read) /* Read a message with its sequence and write time, only if it is newer than a sequence */
+#define MSG_SLOT_SUBSCRIBE _IOW(MAJOR_NUMBER, 10, struct msg_slot_subscription) /* Publish the messages of a topic channel to another channel too */
+#define MSG_SLOT_UNSUBSCRIBE _IOW(MAJOR_NUMBER, 11, struct msg_slot_subscription) /* Stop publishing the messages of a topic channel to another channel */
+#define MSG_SLOT_RESTORE _IOW(MAJOR_NUMBER, 12, struct msg_slot_restore) /* Load the messages of a snapshot back into the message slots */
+#define MSG_SLOT_BATCH_MAX_ENTRIES 4096 /*Max number of entries of a batch*/
+#define MSG_SLOT_MAX_SUBSCRIBERS 1024 /*Max number of subscribers of a topic channel*/
 #define SUCCESS 0
 
+/*
+Shared ring of a message slot, mapped with mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0).
+The header page is followed by entry_count entries of entry_size bytes. Producers fill the entry at
+tail % entry_count and then advance tail with a release store, the consumer reads the entry at
+head % entry_count and then advances head with a release store. The ring is full when
+tail - head == entry_count. The consumer is either a user space process or the kernel through
+MSG_SLOT_RING_FLUSH, which delivers the entries to their channels for read().
+*/
+#define MSG_SLOT_RING_ENTRIES_OFFSET 4096 /*The entries start after the header page*/
+#define MSG_SLOT_RING_MAX_ENTRIES 65536 /*Max number of entries of a ring*/
+#define MSG_SLOT_RING_MAX_SIZE (64 << 20) /*Max size of a ring in bytes*/
+#define MSG_SLOT_RING_ENTRY_SIZE(max_message_size) (((max_message_size) + 8 + 7) & ~7U) /*Entry header plus message, 8 byte aligned*/
+
+/*The argument of MSG_SLOT_RING_SETUP*/
+struct msg_slot_ring_setup {
+    __u32 entry_count; /*Number of entries, a power of two*/
+    __u32 max_message_size; /*Longest message that an entry holds*/
+};
+
+/*The header page of a shared ring, the indexes are on their own cache lines*/
+struct msg_slot_ring_header {
+    __u32 entry_count; /*Number of entries, set by the kernel*/
+    __u32 entry_size; /*Size of an entry in bytes, set by the kernel*/
+    __u8 reserved0[56];
+    __u64 tail; /*Index of the next entry to produce, only increases*/
+    __u8 reserved1[56];
+    __u64 head; /*Index of the next entry to consume, only increases*/
+    __u8 reserved2[56];
+};
+
+/*An entry of a shared ring*/
+struct msg_slot_ring_entry {
+    __u32 channel_id; /*The non-zero channel that the message is sent to*/
+    __u32 message_length; /*The length of the message*/
+    char message[]; /*The message*/
+};
+
+/*An entry of a batch, one message of one channel*/
+struct msg_slot_batch_entry {
+    __u32 channel_id; /*The non-zero channel to write to or read from*/
+    __u32 length; /*Write- the length of the message. Read- the size of the buffer, set to the length of the message*/
+    __u64 buffer; /*The user buffer of the message*/
+    __s32 status; /*Set by the kernel to 0 or to a negative error code*/
+    __u32 reserved;
+};
+
+/*The argument of MSG_SLOT_WRITE_BATCH and MSG_SLOT_READ_BATCH*/
+struct msg_slot_batch {
+    __u64 entries; /*The array of entries*/
+    __u32 count; /*The number of entries*/
+    __u32 reserved;
+};
+
+/*The argument of MSG_SLOT_CHANNEL_STATS, the counters are totals since the channel was created*/
+struct msg_slot_channel_stats {
+    __u32 channel_id; /*The channel to read, 0 for the file descriptor's channel. Set to the channel that was read*/
+    __u32 queue_depth; /*The capacity of the channel's queue, 0 in last message mode*/
+    __u32 queue_count; /*The number of queued messages*/
+    __u32 reserved;
+    __u64 message_sequence; /*The sequence of the channel's last message, 0 if it has none*/
+    __u64 reads; /*Successful reads*/
+    __u64 read_bytes; /*Bytes returned by the successful reads*/
+    __u64 read_misses; /*Reads that found no message*/
+    __u64 writes; /*Successful writes*/
+    __u64 write_bytes; /*Bytes stored by the successful writes*/
+    __u64 no_space_errors; /*Reads that failed with ENOSPC*/
+    __u64 message_size_errors; /*Writes that failed with EMSGSIZE*/
+};
+
+/*
+The argument of MSG_SLOT_READ_VERSIONED. Every message gets the next sequence of its message slot, so the sequence
+of a channel increases with every write, and a message fanned out to subscribers has the same sequence in all of them.
+In last message mode the message is read only if its sequence is larger than min_sequence, so a consumer
+that passes the sequence it read last gets EWOULDBLOCK without a copy until the message changes.
+In queue mode the oldest queued message is consumed whatever min_sequence is.
+*/
+struct msg_slot_versioned_read {
+    __u32 channel_id; /*The channel to read, 0 for the file descriptor's channel*/
+    __u32 length; /*The size of the buffer, set to the length of the message*/
+    __u64 buffer; /*The user buffer of the message*/
+    __u64 min_sequence; /*Only a message with a larger sequence is read, 0 for any message*/
+    __u64 sequence; /*Set to the sequence of the message, or of the channel's last message when nothing newer was read*/
+    __u64 timestamp_ns; /*Set to the CLOCK_REALTIME time when the message was written, in nanoseconds*/
+};
+
+/*
+The argument of MSG_SLOT_SUBSCRIBE and MSG_SLOT_UNSUBSCRIBE, both channels are of the file descriptor's message slot.
+Every message written to the topic channel is also published to its subscribers, which share one copy of it.
+*/
+struct msg_slot_subscription {
+    __u32 topic_channel_id; /*The channel whose messages are published*/
+    __u32 channel_id; /*The subscriber that also gets them*/
+};
+
+/*
+A snapshot of every message slot, read from debugfs message_slot/snapshot and loaded back with MSG_SLOT_RESTORE.
+The snapshot is a struct msg_slot_snapshot_header followed by records. Every message slot has a record with
+channel_id 0, followed by a record for every message of its channels: the last message in last message mode,
+or every queued message from the oldest in queue mode, each followed by the message padded to 8 bytes.
+A channel in queue mode with an empty queue has a record of length 0, so its queue depth is kept.
+Every record is consistent, but the snapshot is not taken at one instant, messages written meanwhile may be missing.
+Subscriptions and shared rings are not part of the snapshot.
+*/
+#define MSG_SLOT_SNAPSHOT_MAGIC 0x534C534D /*"MSLS"*/
+#define MSG_SLOT_SNAPSHOT_VERSION 1
+#define MSG_SLOT_SNAPSHOT_RECORD_SIZE(length) (sizeof(struct msg_slot_snapshot_record) + (((length) + 7) & ~7U)) /*A record and its padded message*/
+
+/*The start of a snapshot*/
+struct msg_slot_snapshot_header {
+    __u32 magic; /*MSG_SLOT_SNAPSHOT_MAGIC*/
+    __u32 version; /*MSG_SLOT_SNAPSHOT_VERSION*/
+};
+
+/*A record of a snapshot, a message slot or a message of one of its channels*/
+struct msg_slot_snapshot_record {
+    __u32 minor; /*The minor of the message slot*/
+    __u32 channel_id; /*The channel of the message, 0 for the record of the message slot*/
+    __u64 sequence; /*The sequence of the message, the last sequence of the message slot in its record*/
+    __u64 timestamp_ns; /*The CLOCK_REALTIME time when the message was written, 0 in the record of the message slot*/
+    __u32 length; /*The length of the message that follows, 0 when there is none*/
+    __u32 setting; /*The max message size of the message slot in its record, the queue depth of the channel in a message record*/
+};
+
+/*
+The argument of MSG_SLOT_RESTORE, a buffer that holds a snapshot or a part of it: the header and whole records.
+Every message keeps its sequence and write time, and is restored only if it is newer than the last message
+of its channel, so restoring a snapshot twice changes nothing. Subscribers don't get the restored messages.
+*/
+struct msg_slot_restore {
+    __u64 buffer; /*The snapshot*/
+    __u64 length; /*The length of the snapshot in bytes*/
+};
+
 #endif
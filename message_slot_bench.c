@@ -0,0 +1,1675 @@
+#include "message_slot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h> /*For the zipf distribution of the channels*/
+#include <time.h> /*For clock_gettime and nanosleep*/
+#include <pthread.h> /*For the writer and reader threads*/
+#include <stdatomic.h> /*For the flag that stops the threads*/
+#include <stdint.h>
+#include <getopt.h> /*For parsing the command line options*/
+#include <fcntl.h> /*For file control options (e.g., O_RDONLY, O_WRONLY)*/
+#include <unistd.h> /*For POSIX operating system API (e.g., pread, pwrite, close)*/
+#include <sys/ioctl.h> /*For I/O control device operations*/
+#include <sys/resource.h> /*For raising the limit of open file descriptors*/
+#include <sys/mman.h> /*For mapping the shared ring of a slot*/
+#include <poll.h> /*For the readers of the wakeup mode that wait in poll*/
+#include <sched.h> /*For sched_yield while the writer of the wakeup mode waits for its reader*/
+
+/*
+A user space benchmark of the message slot device.
+Writer and reader threads hammer the channels of one or more device files (minors) for a fixed time,
+every operation picks its channel from a uniform or zipf distribution and addresses it through the
+file offset (pwrite/pread on a file descriptor with no channel), so no ioctl is needed per operation.
+The result is printed as one JSON object: the configuration, ops/sec and p50/p99/p99.9 latencies per role.
+Other modes, selected with -m, measure one path of the device each and print their own JSON object.
+*/
+
+/*
+Latencies are counted in a log-linear histogram: exact below 64 ns, then 32 buckets per power of two,
+which keeps every percentile within about 3% of the real value.
+*/
+#define LATENCY_LINEAR_BUCKETS 64
+#define LATENCY_SUB_BUCKETS 32
+#define LATENCY_BUCKETS (LATENCY_LINEAR_BUCKETS + 58 * LATENCY_SUB_BUCKETS)
+
+/*The options of the run*/
+typedef struct bench_options {
+    const char **device_paths; /*The device files, one per minor*/
+    unsigned int device_count; /*The number of device files*/
+    unsigned int writer_count; /*The number of writer threads*/
+    unsigned int reader_count; /*The number of reader threads*/
+    unsigned int channel_count; /*The number of channels of every device file*/
+    unsigned int message_size; /*The size of every message*/
+    unsigned int duration_seconds; /*The duration of the run*/
+    double zipf_exponent; /*The skew of the channels, 0 for uniform*/
+    const char *mode; /*The measurement, see bench_modes*/
+} bench_options;
+
+/*A measurement of the benchmark, selected with -m*/
+typedef struct bench_mode {
+    const char *name; /*The name of the mode*/
+    const char *description; /*What the mode measures, printed by the usage*/
+    void (*run)(void); /*Runs the measurement and prints its results*/
+} bench_mode;
+
+/*The counters of one thread, merged into its role's counters at the end of the run*/
+typedef struct bench_thread {
+    pthread_t thread; /*The thread*/
+    unsigned int thread_index; /*The index of the thread in its role, seeds its random channel choice*/
+    int is_writer; /*Whether the thread writes or reads*/
+    int *files; /*The thread's file descriptor of every device file*/
+    uint64_t operations; /*Successful operations*/
+    uint64_t misses; /*Reads that found no message*/
+    uint64_t errors; /*Operations that failed*/
+    uint64_t latency_histogram[LATENCY_BUCKETS]; /*The latencies of the successful operations*/
+} bench_thread;
+
+static bench_options options;
+static double *channel_cdf; /*The cumulative distribution of the channels of all the device files*/
+static unsigned int total_channel_count; /*device_count * channel_count*/
+static atomic_int bench_stop; /*Set when the duration of the run is over*/
+
+/*Returns the time of the monotonic clock in nanoseconds*/
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*Returns the histogram bucket of a latency*/
+static unsigned int latency_bucket(uint64_t latency)
+{
+    unsigned int highest_bit;
+    unsigned int shift;
+
+    if (latency < LATENCY_LINEAR_BUCKETS)
+    {
+        return (unsigned int)latency;
+    }
+    highest_bit = 63 - __builtin_clzll(latency);
+    shift = highest_bit - 5; /*latency >> shift is in [32, 64)*/
+    return LATENCY_LINEAR_BUCKETS + (shift - 1) * LATENCY_SUB_BUCKETS + (unsigned int)((latency >> shift) - LATENCY_SUB_BUCKETS);
+}
+
+/*Returns the lowest latency that falls in a histogram bucket*/
+static uint64_t latency_bucket_value(unsigned int bucket)
+{
+    unsigned int shift;
+
+    if (bucket < LATENCY_LINEAR_BUCKETS)
+    {
+        return bucket;
+    }
+    bucket -= LATENCY_LINEAR_BUCKETS;
+    shift = bucket / LATENCY_SUB_BUCKETS + 1;
+    return (uint64_t)(bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS) << shift;
+}
+
+/*Returns the latency below which the given fraction of the operations of a histogram fall*/
+static uint64_t latency_percentile(const uint64_t *latency_histogram, uint64_t operations, double fraction)
+{
+    uint64_t target;
+    uint64_t seen;
+    unsigned int bucket;
+
+    if (operations == 0)
+    {
+        return 0;
+    }
+    target = (uint64_t)ceil(fraction * (double)operations);
+    seen = 0;
+    for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+    {
+        seen += latency_histogram[bucket];
+        if (seen >= target)
+        {
+            return latency_bucket_value(bucket);
+        }
+    }
+    return latency_bucket_value(LATENCY_BUCKETS - 1);
+}
+
+/*A xorshift64* generator, one per thread so that picking a channel shares nothing*/
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+/*
+Builds the cumulative distribution of the channels, channel i (from 1) has weight 1/i^zipf_exponent.
+With an exponent of 0 every channel has the same weight.
+Returns 0 on success, -1 on memory allocation failure.
+*/
+static int build_channel_cdf(void)
+{
+    double total_weight;
+    unsigned int i;
+
+    channel_cdf = (double*)malloc(total_channel_count * sizeof(double));
+    if (channel_cdf == NULL)
+    {
+        return -1;
+    }
+    total_weight = 0;
+    for (i = 0; i < total_channel_count; i++)
+    {
+        total_weight += 1.0 / pow((double)(i + 1), options.zipf_exponent);
+        channel_cdf[i] = total_weight;
+    }
+    for (i = 0; i < total_channel_count; i++)
+    {
+        channel_cdf[i] /= total_weight;
+    }
+    return 0;
+}
+
+/*Picks a channel of one of the device files from the channel distribution, returns its index in [0, total_channel_count)*/
+static unsigned int pick_channel(uint64_t *random_state)
+{
+    double point;
+    unsigned int low;
+    unsigned int high;
+    unsigned int middle;
+
+    point = (double)(next_random(random_state) >> 11) / (double)(1ULL << 53);
+    low = 0;
+    high = total_channel_count - 1;
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if (channel_cdf[middle] < point)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/*The loop of a writer or a reader thread, runs until bench_stop is set*/
+static void *bench_thread_main(void *argument)
+{
+    bench_thread *current_thread;
+    char *message_buffer;
+    uint64_t random_state;
+    uint64_t start;
+    unsigned int channel_index;
+    unsigned int device_index;
+    unsigned int channel_ID;
+    ssize_t transfer_ret;
+
+    current_thread = (bench_thread*)argument;
+    message_buffer = (char*)malloc(MAX_MESSAGE_SIZE_LIMIT);
+    if (message_buffer == NULL)
+    {
+        current_thread->errors++;
+        return NULL;
+    }
+    memset(message_buffer, 'm', MAX_MESSAGE_SIZE_LIMIT);
+    random_state = 0x9E3779B97F4A7C15ULL * (current_thread->thread_index + 1) + (uint64_t)current_thread->is_writer;
+    while (!atomic_load_explicit(&bench_stop, memory_order_relaxed))
+    {
+        /*channels are spread over the device files, channel IDs start at 1*/
+        channel_index = pick_channel(&random_state);
+        device_index = channel_index % options.device_count;
+        channel_ID = channel_index / options.device_count + 1;
+        start = now_ns();
+        if (current_thread->is_writer)
+        {
+            transfer_ret = pwrite(current_thread->files[device_index], message_buffer, options.message_size, channel_ID);
+        }
+        else
+        {
+            transfer_ret = pread(current_thread->files[device_index], message_buffer, MAX_MESSAGE_SIZE_LIMIT, channel_ID);
+        }
+        if (transfer_ret >= 0)
+        {
+            current_thread->operations++;
+            current_thread->latency_histogram[latency_bucket(now_ns() - start)]++;
+        }
+        else if (errno == EWOULDBLOCK || errno == EAGAIN)
+        {
+            /*The channel has no message yet, or its queue is full*/
+            current_thread->misses++;
+        }
+        else
+        {
+            current_thread->errors++;
+        }
+    }
+    free(message_buffer);
+    return NULL;
+}
+
+/*Prints the results of a role as a JSON object member*/
+static void print_role_results(const char *role, bench_thread *threads, unsigned int thread_count, double elapsed_seconds)
+{
+    static uint64_t latency_histogram[LATENCY_BUCKETS];
+    uint64_t operations;
+    uint64_t misses;
+    uint64_t errors;
+    unsigned int i;
+    unsigned int bucket;
+
+    memset(latency_histogram, 0, sizeof(latency_histogram));
+    operations = 0;
+    misses = 0;
+    errors = 0;
+    for (i = 0; i < thread_count; i++)
+    {
+        operations += threads[i].operations;
+        misses += threads[i].misses;
+        errors += threads[i].errors;
+        for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+        {
+            latency_histogram[bucket] += threads[i].latency_histogram[bucket];
+        }
+    }
+    printf("\"%s\":{\"threads\":%u,\"ops\":%llu,\"ops_per_sec\":%.0f,\"misses\":%llu,\"errors\":%llu,"
+           "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}",
+           role, thread_count, (unsigned long long)operations, operations / elapsed_seconds,
+           (unsigned long long)misses, (unsigned long long)errors,
+           (unsigned long long)latency_percentile(latency_histogram, operations, 0.50),
+           (unsigned long long)latency_percentile(latency_histogram, operations, 0.99),
+           (unsigned long long)latency_percentile(latency_histogram, operations, 0.999));
+}
+
+/*Stops the run when the duration of the benchmark is over, returns nonzero once it is*/
+static int bench_time_is_over(uint64_t end)
+{
+    return now_ns() >= end;
+}
+
+/*Opens the first device file with no channel selected, so the offset of every read and write picks its channel*/
+static int open_first_device_file(int flags)
+{
+    int file;
+
+    file = open(options.device_paths[0], flags);
+    if (file < 0)
+    {
+        /*Couldn't open the file*/
+        perror("Error");
+        exit(1);
+    }
+    return file;
+}
+
+/*
+Runs the writes of the ring mode through write(): one pwrite per message on the channels of the first device file, in turn.
+Returns the messages written per second.
+*/
+static double run_ring_mode_writes(int file, const char *message)
+{
+    uint64_t start;
+    uint64_t end;
+    uint64_t written;
+
+    written = 0;
+    start = now_ns();
+    end = start + options.duration_seconds * 1000000000ULL;
+    while ((written & 255) != 0 || !bench_time_is_over(end))
+    {
+        if (pwrite(file, message, options.message_size, written % options.channel_count + 1) < 0)
+        {
+            perror("Error");
+            exit(1);
+        }
+        written++;
+    }
+    return written / ((now_ns() - start) / 1e9);
+}
+
+/*
+Runs the writes of the ring mode through the shared ring: the messages are produced in the mapped entries
+and MSG_SLOT_RING_FLUSH delivers every full ring to the channels.
+Returns the messages delivered per second.
+*/
+static double run_ring_mode_flushes(int file, const char *message)
+{
+    struct msg_slot_ring_setup ring_setup;
+    struct msg_slot_ring_header *header;
+    struct msg_slot_ring_entry *entry;
+    size_t ring_size;
+    char *ring;
+    uint64_t tail;
+    uint64_t start;
+    uint64_t end;
+    uint64_t delivered;
+    long flush_ret;
+
+    ring_setup.entry_count = 4096;
+    ring_setup.max_message_size = options.message_size;
+    if (ioctl(file, MSG_SLOT_RING_SETUP, &ring_setup) != 0 && errno != EBUSY)
+    {
+        perror("Error");
+        exit(1);
+    }
+    /*the slot may already have a ring from an earlier run, its header tells the real size*/
+    header = (struct msg_slot_ring_header*)mmap(NULL, MSG_SLOT_RING_ENTRIES_OFFSET, PROT_READ, MAP_SHARED, file, 0);
+    if (header == MAP_FAILED)
+    {
+        perror("Error");
+        exit(1);
+    }
+    ring_size = MSG_SLOT_RING_ENTRIES_OFFSET + (size_t)header->entry_count * header->entry_size;
+    munmap(header, MSG_SLOT_RING_ENTRIES_OFFSET);
+    ring = (char*)mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, file, 0);
+    if (ring == MAP_FAILED)
+    {
+        perror("Error");
+        exit(1);
+    }
+    header = (struct msg_slot_ring_header*)ring;
+    if (header->entry_size < MSG_SLOT_RING_ENTRY_SIZE(options.message_size))
+    {
+        fprintf(stderr, "The slot already has a ring for shorter messages\n");
+        exit(1);
+    }
+
+    delivered = 0;
+    start = now_ns();
+    end = start + options.duration_seconds * 1000000000ULL;
+    tail = __atomic_load_n(&header->tail, __ATOMIC_RELAXED);
+    while (!bench_time_is_over(end))
+    {
+        /*fill the ring, then let the kernel consume it in one call*/
+        while (tail - __atomic_load_n(&header->head, __ATOMIC_ACQUIRE) < header->entry_count)
+        {
+            entry = (struct msg_slot_ring_entry*)(ring + MSG_SLOT_RING_ENTRIES_OFFSET + (tail % header->entry_count) * header->entry_size);
+            entry->channel_id = (uint32_t)(tail % options.channel_count + 1);
+            entry->message_length = options.message_size;
+            memcpy(entry->message, message, options.message_size);
+            tail++;
+            __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+        }
+        flush_ret = ioctl(file, MSG_SLOT_RING_FLUSH);
+        if (flush_ret < 0)
+        {
+            perror("Error");
+            exit(1);
+        }
+        delivered += flush_ret;
+    }
+    munmap(ring, ring_size);
+    return delivered / ((now_ns() - start) / 1e9);
+}
+
+/*Compares the messages per second of write() with the shared ring flushed by MSG_SLOT_RING_FLUSH, each for the whole duration*/
+static void run_ring_mode(void)
+{
+    char *message;
+    double write_rate;
+    double ring_rate;
+    int file;
+
+    message = (char*)malloc(options.message_size);
+    if (message == NULL)
+    {
+        perror("Error");
+        exit(1);
+    }
+    memset(message, 'm', options.message_size);
+    file = open_first_device_file(O_RDWR | O_NONBLOCK);
+    write_rate = run_ring_mode_writes(file, message);
+    ring_rate = run_ring_mode_flushes(file, message);
+    printf("{\"mode\":\"ring\",\"channels\":%u,\"message_size\":%u,\"write_msgs_per_sec\":%.0f,\"ring_msgs_per_sec\":%.0f}\n",
+           options.channel_count, options.message_size, write_rate, ring_rate);
+    close(file);
+    free(message);
+}
+
+/*
+Activates a message slot behind every device file given, by writing the first message of its channel 1,
+then writes and reads random slots for the duration, so the cost of tens of thousands of live slots shows up
+in the activation time per slot and in the ops/sec and latencies of the later operations.
+*/
+static void run_slots_mode(void)
+{
+    static uint64_t latency_histogram[LATENCY_BUCKETS];
+    char *message;
+    int *files;
+    uint64_t random_state;
+    uint64_t start;
+    uint64_t end;
+    uint64_t activation_ns;
+    uint64_t operations;
+    uint64_t operation_start;
+    unsigned int device_index;
+    unsigned int i;
+    ssize_t transfer_ret;
+
+    message = (char*)malloc(MAX_MESSAGE_SIZE_LIMIT);
+    files = (int*)malloc(options.device_count * sizeof(int));
+    if (message == NULL || files == NULL)
+    {
+        perror("Error");
+        exit(1);
+    }
+    memset(message, 'm', options.message_size);
+    start = now_ns();
+    for (i = 0; i < options.device_count; i++)
+    {
+        files[i] = open(options.device_paths[i], O_RDWR | O_NONBLOCK);
+        if (files[i] < 0 || pwrite(files[i], message, options.message_size, 1) < 0)
+        {
+            perror(options.device_paths[i]);
+            exit(1);
+        }
+    }
+    activation_ns = now_ns() - start;
+
+    operations = 0;
+    random_state = 0x9E3779B97F4A7C15ULL;
+    start = now_ns();
+    end = start + options.duration_seconds * 1000000000ULL;
+    while (!bench_time_is_over(end))
+    {
+        device_index = (unsigned int)(next_random(&random_state) % options.device_count);
+        operation_start = now_ns();
+        if (operations & 1)
+        {
+            transfer_ret = pread(files[device_index], message, MAX_MESSAGE_SIZE_LIMIT, 1);
+        }
+        else
+        {
+            transfer_ret = pwrite(files[device_index], message, options.message_size, 1);
+        }
+        if (transfer_ret < 0)
+        {
+            perror("Error");
+            exit(1);
+        }
+        latency_histogram[latency_bucket(now_ns() - operation_start)]++;
+        operations++;
+    }
+    printf("{\"mode\":\"slots\",\"slots\":%u,\"message_size\":%u,\"activation_ns_per_slot\":%.0f,\"ops_per_sec\":%.0f,"
+           "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}\n",
+           options.device_count, options.message_size, (double)activation_ns / options.device_count,
+           operations / ((now_ns() - start) / 1e9),
+           (unsigned long long)latency_percentile(latency_histogram, operations, 0.50),
+           (unsigned long long)latency_percentile(latency_histogram, operations, 0.99),
+           (unsigned long long)latency_percentile(latency_histogram, operations, 0.999));
+    for (i = 0; i < options.device_count; i++)
+    {
+        close(files[i]);
+    }
+    free(files);
+    free(message);
+}
+
+/*Counts a read or write of a single threaded mode in the counters of its role*/
+static void count_bench_operation(bench_thread *role, ssize_t transfer_ret, uint64_t start)
+{
+    if (transfer_ret >= 0)
+    {
+        role->operations++;
+        role->latency_histogram[latency_bucket(now_ns() - start)]++;
+    }
+    else if (errno == EWOULDBLOCK || errno == EAGAIN)
+    {
+        role->misses++;
+    }
+    else
+    {
+        role->errors++;
+    }
+}
+
+/*
+Grows the channels of the first device file tenfold per step, from 1 up to -c, writing the first message of every new channel,
+then writes and reads random channels among them for the duration. Every step prints a JSON line, so the latencies
+show how the lookup of a channel scales with the channel count of its slot.
+*/
+static void run_channels_mode(void)
+{
+    static bench_thread roles[2]; /*The writes and the reads of the current step*/
+    char *message;
+    int file;
+    uint64_t random_state;
+    uint64_t start;
+    uint64_t end;
+    uint64_t populate_ns;
+    uint64_t operation_start;
+    unsigned int populated;
+    unsigned int step_channels;
+    unsigned int channel_ID;
+    ssize_t transfer_ret;
+    int is_write;
+
+    message = (char*)malloc(MAX_MESSAGE_SIZE_LIMIT);
+    if (message == NULL)
+    {
+        perror("Error");
+        exit(1);
+    }
+    memset(message, 'm', MAX_MESSAGE_SIZE_LIMIT);
+    file = open_first_device_file(O_RDWR | O_NONBLOCK);
+    random_state = 0x9E3779B97F4A7C15ULL;
+    populated = 0;
+    for (step_channels = 1; populated < options.channel_count; step_channels *= 10)
+    {
+        if (step_channels > options.channel_count)
+        {
+            step_channels = options.channel_count;
+        }
+        start = now_ns();
+        for (channel_ID = populated + 1; channel_ID <= step_channels; channel_ID++)
+        {
+            if (pwrite(file, message, options.message_size, channel_ID) < 0)
+            {
+                perror("Error");
+                exit(1);
+            }
+        }
+        populate_ns = now_ns() - start;
+
+        memset(roles, 0, sizeof(roles));
+        start = now_ns();
+        end = start + options.duration_seconds * 1000000000ULL;
+        for (is_write = 1; !bench_time_is_over(end); is_write = !is_write)
+        {
+            channel_ID = (unsigned int)(next_random(&random_state) % step_channels) + 1;
+            operation_start = now_ns();
+            if (is_write)
+            {
+                transfer_ret = pwrite(file, message, options.message_size, channel_ID);
+            }
+            else
+            {
+                transfer_ret = pread(file, message, MAX_MESSAGE_SIZE_LIMIT, channel_ID);
+            }
+            count_bench_operation(&roles[is_write ? 0 : 1], transfer_ret, operation_start);
+        }
+        printf("{\"mode\":\"channels\",\"channels\":%u,\"message_size\":%u,\"populate_ns_per_channel\":%.0f,",
+               step_channels, options.message_size, (double)populate_ns / (step_channels - populated));
+        print_role_results("write", &roles[0], 1, (now_ns() - start) / 1e9);
+        printf(",");
+        print_role_results("read", &roles[1], 1, (now_ns() - start) / 1e9);
+        printf("}\n");
+        fflush(stdout);
+        populated = step_channels;
+    }
+    close(file);
+    free(message);
+}
+
+/*Returns the kernel slab memory in kB from /proc/meminfo, which a leak of open or close would grow, or -1*/
+static long read_slab_kb(void)
+{
+    FILE *meminfo;
+    char line[128];
+    long slab_kb;
+
+    meminfo = fopen("/proc/meminfo", "r");
+    if (meminfo == NULL)
+    {
+        return -1;
+    }
+    slab_kb = -1;
+    while (fgets(line, sizeof(line), meminfo) != NULL)
+    {
+        if (sscanf(line, "Slab: %ld kB", &slab_kb) == 1)
+        {
+            break;
+        }
+    }
+    fclose(meminfo);
+    return slab_kb;
+}
+
+/*
+Opens and closes the first device file for the duration, a soak test of open and close: the latency percentiles
+of every second and the kernel slab memory before and after show whether either grows with the cycles.
+*/
+static void run_open_mode(void)
+{
+    static uint64_t latency_histogram[LATENCY_BUCKETS];
+    uint64_t *p50_by_second;
+    uint64_t *p99_by_second;
+    uint64_t cycles;
+    uint64_t second_cycles;
+    uint64_t start;
+    uint64_t second_end;
+    uint64_t cycle_start;
+    unsigned int seconds;
+    unsigned int i;
+    long slab_kb_start;
+    int file;
+
+    p50_by_second = (uint64_t*)calloc(options.duration_seconds, sizeof(uint64_t));
+    p99_by_second = (uint64_t*)calloc(options.duration_seconds, sizeof(uint64_t));
+    if (p50_by_second == NULL || p99_by_second == NULL)
+    {
+        perror("Error");
+        exit(1);
+    }
+    slab_kb_start = read_slab_kb();
+    cycles = 0;
+    seconds = 0;
+    start = now_ns();
+    while (seconds < options.duration_seconds)
+    {
+        memset(latency_histogram, 0, sizeof(latency_histogram));
+        second_cycles = 0;
+        second_end = start + (seconds + 1) * 1000000000ULL;
+        while (!bench_time_is_over(second_end))
+        {
+            cycle_start = now_ns();
+            file = open(options.device_paths[0], O_RDWR);
+            if (file < 0 || close(file) != 0)
+            {
+                perror("Error");
+                exit(1);
+            }
+            latency_histogram[latency_bucket(now_ns() - cycle_start)]++;
+            second_cycles++;
+        }
+        p50_by_second[seconds] = latency_percentile(latency_histogram, second_cycles, 0.50);
+        p99_by_second[seconds] = latency_percentile(latency_histogram, second_cycles, 0.99);
+        cycles += second_cycles;
+        seconds++;
+    }
+    printf("{\"mode\":\"open\",\"cycles\":%llu,\"cycles_per_sec\":%.0f,\"slab_kb_start\":%ld,\"slab_kb_end\":%ld,\"p50_ns_by_second\":[",
+           (unsigned long long)cycles, cycles / ((now_ns() - start) / 1e9), slab_kb_start, read_slab_kb());
+    for (i = 0; i < seconds; i++)
+    {
+        printf("%s%llu", i == 0 ? "" : ",", (unsigned long long)p50_by_second[i]);
+    }
+    printf("],\"p99_ns_by_second\":[");
+    for (i = 0; i < seconds; i++)
+    {
+        printf("%s%llu", i == 0 ? "" : ",", (unsigned long long)p99_by_second[i]);
+    }
+    printf("]}\n");
+    free(p50_by_second);
+    free(p99_by_second);
+}
+
+/*The operations of the stress mode, every thread picks one at random for every step*/
+enum stress_operation {
+    STRESS_SELECT_CHANNEL, /*MSG_SLOT_CHANNEL on the thread's selecting file descriptor*/
+    STRESS_WRITE, /*write on the selected channel*/
+    STRESS_READ, /*read of the selected channel*/
+    STRESS_OFFSET_WRITE, /*pwrite on the file descriptor with no channel*/
+    STRESS_OFFSET_READ, /*pread on the file descriptor with no channel*/
+    STRESS_QUEUE_DEPTH, /*switch the selected channel between last message and queue mode*/
+    STRESS_DELETE_CHANNEL, /*MSG_SLOT_DELETE_CHANNEL of a random channel*/
+    STRESS_SUBSCRIBE, /*MSG_SLOT_SUBSCRIBE or MSG_SLOT_UNSUBSCRIBE of two random channels*/
+    STRESS_READ_VERSIONED, /*MSG_SLOT_READ_VERSIONED of a random channel*/
+    STRESS_WRITE_BATCH, /*MSG_SLOT_WRITE_BATCH of four random channels*/
+    STRESS_OPERATIONS
+};
+
+/*Returns whether an error is one that the racing operations of the stress mode cause, as opposed to a bug*/
+static int is_expected_stress_error(int error)
+{
+    return error == EWOULDBLOCK || error == EAGAIN || error == EBUSY || error == EINVAL || error == EEXIST || error == ENOMEM;
+}
+
+/*Counts the result of an operation of the stress mode, misses are the expected errors*/
+static void count_stress_result(bench_thread *current_thread, long result, int error, enum stress_operation operation)
+{
+    if (result >= 0)
+    {
+        current_thread->operations++;
+    }
+    else if (is_expected_stress_error(error))
+    {
+        current_thread->misses++;
+    }
+    else
+    {
+        if (current_thread->errors++ == 0)
+        {
+            fprintf(stderr, "Stress operation %d failed: %s\n", operation, strerror(error));
+        }
+    }
+}
+
+/*Returns whether a message read by the stress mode is whole- all of it from one writer, every writer fills its messages with one byte*/
+static int is_whole_stress_message(const char *message, ssize_t length)
+{
+    ssize_t i;
+
+    if (length != (ssize_t)options.message_size)
+    {
+        return 0;
+    }
+    for (i = 1; i < length; i++)
+    {
+        if (message[i] != message[0])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+The loop of a thread of the stress mode: every step is a random operation on random channels of the first device file,
+through a file descriptor that selects channels and one that addresses them by offset. Runs until bench_stop is set.
+*/
+static void *stress_thread_main(void *argument)
+{
+    bench_thread *current_thread;
+    struct msg_slot_subscription subscription;
+    struct msg_slot_versioned_read versioned_read;
+    struct msg_slot_batch_entry batch_entries[4];
+    struct msg_slot_batch batch;
+    char *message;
+    char *read_buffer;
+    uint64_t random_state;
+    uint64_t random;
+    enum stress_operation operation;
+    unsigned int i;
+    long result;
+
+    current_thread = (bench_thread*)argument;
+    message = (char*)malloc(options.message_size);
+    read_buffer = (char*)malloc(MAX_MESSAGE_SIZE_LIMIT);
+    if (message == NULL || read_buffer == NULL)
+    {
+        current_thread->errors++;
+        return NULL;
+    }
+    random_state = 0x9E3779B97F4A7C15ULL * (current_thread->thread_index + 1);
+    while (!atomic_load_explicit(&bench_stop, memory_order_relaxed))
+    {
+        random = next_random(&random_state);
+        operation = (enum stress_operation)(random % STRESS_OPERATIONS);
+        random /= STRESS_OPERATIONS;
+        memset(message, (int)(random & 0xff), options.message_size);
+        result = 0;
+        switch (operation)
+        {
+        case STRESS_SELECT_CHANNEL:
+            result = ioctl(current_thread->files[0], MSG_SLOT_CHANNEL, random % options.channel_count + 1);
+            break;
+        case STRESS_WRITE:
+            result = write(current_thread->files[0], message, options.message_size);
+            break;
+        case STRESS_READ:
+            result = read(current_thread->files[0], read_buffer, MAX_MESSAGE_SIZE_LIMIT);
+            break;
+        case STRESS_OFFSET_WRITE:
+            result = pwrite(current_thread->files[1], message, options.message_size, random % options.channel_count + 1);
+            break;
+        case STRESS_OFFSET_READ:
+            result = pread(current_thread->files[1], read_buffer, MAX_MESSAGE_SIZE_LIMIT, random % options.channel_count + 1);
+            break;
+        case STRESS_QUEUE_DEPTH:
+            result = ioctl(current_thread->files[0], MSG_SLOT_QUEUE_DEPTH, (random & 1) * 4);
+            break;
+        case STRESS_DELETE_CHANNEL:
+            result = ioctl(current_thread->files[0], MSG_SLOT_DELETE_CHANNEL, random % options.channel_count + 1);
+            break;
+        case STRESS_SUBSCRIBE:
+            subscription.topic_channel_id = (uint32_t)(random % options.channel_count + 1);
+            subscription.channel_id = (uint32_t)((random >> 20) % options.channel_count + 1);
+            result = ioctl(current_thread->files[0], (random >> 40) & 1 ? MSG_SLOT_SUBSCRIBE : MSG_SLOT_UNSUBSCRIBE, &subscription);
+            break;
+        case STRESS_READ_VERSIONED:
+            memset(&versioned_read, 0, sizeof(versioned_read));
+            versioned_read.channel_id = (uint32_t)(random % options.channel_count + 1);
+            versioned_read.buffer = (uint64_t)(uintptr_t)read_buffer;
+            versioned_read.length = MAX_MESSAGE_SIZE_LIMIT;
+            result = ioctl(current_thread->files[0], MSG_SLOT_READ_VERSIONED, &versioned_read);
+            if (result >= 0)
+            {
+                result = versioned_read.length;
+            }
+            break;
+        case STRESS_WRITE_BATCH:
+            for (i = 0; i < 4; i++)
+            {
+                batch_entries[i].channel_id = (uint32_t)((random >> (i * 10)) % options.channel_count + 1);
+                batch_entries[i].length = options.message_size;
+                batch_entries[i].buffer = (uint64_t)(uintptr_t)message;
+                batch_entries[i].status = 0;
+                batch_entries[i].reserved = 0;
+            }
+            batch.entries = (uint64_t)(uintptr_t)batch_entries;
+            batch.count = 4;
+            batch.reserved = 0;
+            result = ioctl(current_thread->files[0], MSG_SLOT_WRITE_BATCH, &batch);
+            break;
+        default:
+            break;
+        }
+        count_stress_result(current_thread, result, errno, operation);
+        if (result > 0 && (operation == STRESS_READ || operation == STRESS_OFFSET_READ || operation == STRESS_READ_VERSIONED) &&
+            !is_whole_stress_message(read_buffer, result))
+        {
+            /*A torn or mixed message*/
+            if (current_thread->errors++ == 0)
+            {
+                fprintf(stderr, "Stress operation %d read a torn message\n", operation);
+            }
+        }
+    }
+    free(read_buffer);
+    free(message);
+    return NULL;
+}
+
+/*
+Runs -w + -r threads of random operations of every kind, see enum stress_operation, on the -c channels of the first
+device file for the duration. It is the workload to run on a kernel with lockdep or KCSAN. Errors that the races cause,
+like EBUSY or EWOULDBLOCK, are counted apart from the others and from torn reads, which fail the run.
+*/
+static void run_stress_mode(void)
+{
+    bench_thread *threads;
+    unsigned int thread_count;
+    unsigned int i;
+    uint64_t start;
+    uint64_t operations;
+    uint64_t expected_errors;
+    uint64_t errors;
+    double elapsed_seconds;
+
+    thread_count = options.writer_count + options.reader_count;
+    threads = (bench_thread*)calloc(thread_count, sizeof(bench_thread));
+    if (threads == NULL || thread_count == 0)
+    {
+        fprintf(stderr, "The stress mode needs threads\n");
+        exit(1);
+    }
+    atomic_store(&bench_stop, 0);
+    for (i = 0; i < thread_count; i++)
+    {
+        threads[i].thread_index = i;
+        threads[i].files = (int*)malloc(2 * sizeof(int));
+        if (threads[i].files == NULL)
+        {
+            perror("Error");
+            exit(1);
+        }
+        threads[i].files[0] = open_first_device_file(O_RDWR | O_NONBLOCK);
+        threads[i].files[1] = open_first_device_file(O_RDWR | O_NONBLOCK);
+    }
+    start = now_ns();
+    for (i = 0; i < thread_count; i++)
+    {
+        if (pthread_create(&threads[i].thread, NULL, stress_thread_main, &threads[i]) != 0)
+        {
+            fprintf(stderr, "Failed to create a stress thread\n");
+            exit(1);
+        }
+    }
+    while (!bench_time_is_over(start + options.duration_seconds * 1000000000ULL))
+    {
+        usleep(10000);
+    }
+    atomic_store(&bench_stop, 1);
+    operations = 0;
+    expected_errors = 0;
+    errors = 0;
+    for (i = 0; i < thread_count; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        operations += threads[i].operations;
+        expected_errors += threads[i].misses;
+        errors += threads[i].errors;
+        close(threads[i].files[0]);
+        close(threads[i].files[1]);
+        free(threads[i].files);
+    }
+    elapsed_seconds = (double)(now_ns() - start) / 1e9;
+    printf("{\"mode\":\"stress\",\"threads\":%u,\"channels\":%u,\"message_size\":%u,\"ops\":%llu,\"ops_per_sec\":%.0f,"
+           "\"expected_errors\":%llu,\"errors\":%llu}\n",
+           thread_count, options.channel_count, options.message_size, (unsigned long long)operations, operations / elapsed_seconds,
+           (unsigned long long)expected_errors, (unsigned long long)errors);
+    free(threads);
+    if (errors != 0)
+    {
+        exit(1);
+    }
+}
+
+/*The channel of the first device file that the wakeup mode writes to*/
+#define WAKEUP_CHANNEL 1
+/*How long the writer of the wakeup mode lets the reader sleep before every message, in nanoseconds*/
+#define WAKEUP_SLEEP_NS 50000
+
+/*The reader of the wakeup mode*/
+typedef struct wakeup_reader {
+    pthread_t thread; /*The thread*/
+    int file; /*The reader's file descriptor, with WAKEUP_CHANNEL selected*/
+    int use_poll; /*Whether the reader waits in poll on an O_NONBLOCK file descriptor instead of in a blocking read*/
+    bench_thread *counters; /*The wakeups and their latencies*/
+    atomic_ullong received; /*The messages read so far, the writer waits for every one before the next*/
+} wakeup_reader;
+
+/*The loop of the reader of the wakeup mode: waits for every message and counts the time since its writer wrote it*/
+static void *wakeup_reader_main(void *argument)
+{
+    wakeup_reader *reader;
+    struct pollfd poll_file;
+    char buffer[MAX_MESSAGE_SIZE_LIMIT];
+    uint64_t written_ns;
+    uint64_t woken_ns;
+    ssize_t read_ret;
+
+    reader = (wakeup_reader*)argument;
+    poll_file.fd = reader->file;
+    poll_file.events = POLLIN;
+    while (!atomic_load(&bench_stop))
+    {
+        if (reader->use_poll && poll(&poll_file, 1, -1) < 0)
+        {
+            reader->counters->errors++;
+            continue;
+        }
+        read_ret = read(reader->file, buffer, sizeof(buffer));
+        woken_ns = now_ns();
+        if (read_ret < (ssize_t)sizeof(written_ns))
+        {
+            /*a spurious poll wakeup finds no new message, anything else is an error*/
+            count_bench_operation(reader->counters, -1, 0);
+            continue;
+        }
+        memcpy(&written_ns, buffer, sizeof(written_ns));
+        /*the writer's start signal, or an older message of the channel, has no write time*/
+        if (written_ns != 0 && written_ns <= woken_ns)
+        {
+            reader->counters->operations++;
+            reader->counters->latency_histogram[latency_bucket(woken_ns - written_ns)]++;
+        }
+        atomic_fetch_add(&reader->received, 1);
+    }
+    return NULL;
+}
+
+/*
+Measures the time from a write to the wakeup of a reader of the channel, in a blocking read and then in poll.
+The writer lets the reader fall asleep before every message and waits for it to read the message before the next,
+every message carries its write time. Messages are at least 8 bytes, for the write time.
+*/
+static void run_wakeup_mode(void)
+{
+    static bench_thread roles[2]; /*The wakeups of the blocking reader and of the poll reader*/
+    static wakeup_reader reader;
+    struct timespec sleep_time;
+    char *message;
+    size_t message_size;
+    uint64_t written_ns;
+    uint64_t sent;
+    uint64_t start;
+    uint64_t end;
+    int writer_file;
+    int use_poll;
+
+    message_size = options.message_size < sizeof(written_ns) ? sizeof(written_ns) : options.message_size;
+    message = (char*)calloc(1, message_size);
+    if (message == NULL)
+    {
+        perror("Error");
+        exit(1);
+    }
+    writer_file = open_first_device_file(O_WRONLY);
+    if (ioctl(writer_file, MSG_SLOT_CHANNEL, WAKEUP_CHANNEL) != 0)
+    {
+        perror("Error");
+        exit(1);
+    }
+    sleep_time.tv_sec = 0;
+    sleep_time.tv_nsec = WAKEUP_SLEEP_NS;
+    start = now_ns();
+    for (use_poll = 0; use_poll < 2; use_poll++)
+    {
+        atomic_store(&bench_stop, 0);
+        atomic_store(&reader.received, 0);
+        reader.use_poll = use_poll;
+        reader.counters = &roles[use_poll];
+        reader.file = open_first_device_file(use_poll ? O_RDONLY | O_NONBLOCK : O_RDONLY);
+        if (ioctl(reader.file, MSG_SLOT_CHANNEL, WAKEUP_CHANNEL) != 0 ||
+            pthread_create(&reader.thread, NULL, wakeup_reader_main, &reader) != 0)
+        {
+            perror("Error");
+            exit(1);
+        }
+        /*the start signal, with no write time, which the reader reads as soon as it runs*/
+        memset(message, 0, message_size);
+        if (write(writer_file, message, message_size) < 0)
+        {
+            perror("Error");
+            exit(1);
+        }
+        sent = 0;
+        end = now_ns() + options.duration_seconds * 1000000000ULL / 2;
+        while (!bench_time_is_over(end))
+        {
+            /*wait for the reader to take the last message, then let it fall asleep again*/
+            while (atomic_load(&reader.received) < sent + 1 && !bench_time_is_over(end))
+            {
+                sched_yield();
+            }
+            nanosleep(&sleep_time, NULL);
+            written_ns = now_ns();
+            memcpy(message, &written_ns, sizeof(written_ns));
+            if (write(writer_file, message, message_size) < 0)
+            {
+                perror("Error");
+                exit(1);
+            }
+            sent++;
+        }
+        /*wake the reader a last time to stop it*/
+        atomic_store(&bench_stop, 1);
+        if (write(writer_file, message, message_size) < 0)
+        {
+            perror("Error");
+            exit(1);
+        }
+        pthread_join(reader.thread, NULL);
+        close(reader.file);
+    }
+    printf("{\"mode\":\"wakeup\",\"message_size\":%zu,\"sleep_ns\":%d,", message_size, WAKEUP_SLEEP_NS);
+    print_role_results("read", &roles[0], 1, (now_ns() - start) / 1e9);
+    printf(",");
+    print_role_results("poll", &roles[1], 1, (now_ns() - start) / 1e9);
+    printf("}\n");
+    close(writer_file);
+    free(message);
+}
+
+/*The channel of the first device file that the queue mode runs on, and the depth of its queue*/
+#define QUEUE_CHANNEL 1
+#define QUEUE_DEPTH 1024
+/*The first byte of the message that stops the consumer of the queue mode, the producers' messages are filled with 'm'*/
+#define QUEUE_STOP_BYTE 'x'
+
+/*Opens a file descriptor of the first device file with the channel of the queue mode selected*/
+static int open_queue_file(int flags)
+{
+    int file;
+
+    file = open_first_device_file(flags);
+    if (ioctl(file, MSG_SLOT_CHANNEL, QUEUE_CHANNEL) != 0)
+    {
+        perror("Error");
+        exit(1);
+    }
+    return file;
+}
+
+/*The loop of a producer of the queue mode: blocking writes, which wait while the queue is full, until bench_stop is set*/
+static void *queue_producer_main(void *argument)
+{
+    bench_thread *current_thread;
+    char message[MAX_MESSAGE_SIZE_LIMIT];
+    uint64_t start;
+
+    current_thread = (bench_thread*)argument;
+    memset(message, 'm', options.message_size);
+    while (!atomic_load_explicit(&bench_stop, memory_order_relaxed))
+    {
+        start = now_ns();
+        count_bench_operation(current_thread, write(current_thread->files[0], message, options.message_size), start);
+    }
+    return NULL;
+}
+
+/*The loop of the consumer of the queue mode: blocking reads, which wait while the queue is empty, until the stop message*/
+static void *queue_consumer_main(void *argument)
+{
+    bench_thread *current_thread;
+    char message[MAX_MESSAGE_SIZE_LIMIT];
+    uint64_t start;
+    ssize_t read_ret;
+
+    current_thread = (bench_thread*)argument;
+    for (;;)
+    {
+        start = now_ns();
+        read_ret = read(current_thread->files[0], message, sizeof(message));
+        if (read_ret > 0 && message[0] == QUEUE_STOP_BYTE)
+        {
+            break;
+        }
+        count_bench_operation(current_thread, read_ret, start);
+    }
+    return NULL;
+}
+
+/*
+Runs producers and one consumer on a channel in queue mode for half of the duration and prints their results as a JSON member,
+the ops_per_sec of the reader is the throughput of the queue. The producers block while the queue is full, so no message is lost.
+*/
+static void run_queue_mode_phase(const char *name, unsigned int producer_count, int control_file)
+{
+    bench_thread *threads;
+    char stop_message[MAX_MESSAGE_SIZE_LIMIT];
+    unsigned int i;
+    uint64_t start;
+    double elapsed_seconds;
+
+    threads = (bench_thread*)calloc(producer_count + 1, sizeof(bench_thread));
+    if (threads == NULL)
+    {
+        perror("Error");
+        exit(1);
+    }
+    /*a new depth drops the messages that an earlier run left in the queue*/
+    if (ioctl(control_file, MSG_SLOT_QUEUE_DEPTH, QUEUE_DEPTH) != 0)
+    {
+        perror("Error");
+        exit(1);
+    }
+    atomic_store(&bench_stop, 0);
+    for (i = 0; i <= producer_count; i++)
+    {
+        threads[i].is_writer = i < producer_count;
+        threads[i].thread_index = i;
+        threads[i].files = (int*)malloc(sizeof(int));
+        if (threads[i].files == NULL)
+        {
+            perror("Error");
+            exit(1);
+        }
+        threads[i].files[0] = open_queue_file(threads[i].is_writer ? O_WRONLY : O_RDONLY);
+    }
+    start = now_ns();
+    for (i = 0; i <= producer_count; i++)
+    {
+        if (pthread_create(&threads[i].thread, NULL, threads[i].is_writer ? queue_producer_main : queue_consumer_main, &threads[i]) != 0)
+        {
+            fprintf(stderr, "Failed to create a queue thread\n");
+            exit(1);
+        }
+    }
+    while (!bench_time_is_over(start + options.duration_seconds * 1000000000ULL / 2))
+    {
+        usleep(10000);
+    }
+    atomic_store(&bench_stop, 1);
+    for (i = 0; i < producer_count; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+    }
+    /*the stop message is queued after every produced message, so the consumer drains the queue first*/
+    memset(stop_message, QUEUE_STOP_BYTE, options.message_size);
+    if (write(control_file, stop_message, options.message_size) < 0)
+    {
+        perror("Error");
+        exit(1);
+    }
+    pthread_join(threads[producer_count].thread, NULL);
+    elapsed_seconds = (double)(now_ns() - start) / 1e9;
+    printf("\"%s\":{\"producers\":%u,", name, producer_count);
+    print_role_results("write", threads, producer_count, elapsed_seconds);
+    printf(",");
+    print_role_results("read", threads + producer_count, 1, elapsed_seconds);
+    printf("}");
+    for (i = 0; i <= producer_count; i++)
+    {
+        close(threads[i].files[0]);
+        free(threads[i].files);
+    }
+    free(threads);
+}
+
+/*
+Measures the throughput of a channel in queue mode, first with a single producer and a single consumer,
+then with -w producers (at least 2) and a single consumer, each for half of the duration.
+*/
+static void run_queue_mode(void)
+{
+    int control_file;
+
+    control_file = open_queue_file(O_WRONLY);
+    printf("{\"mode\":\"queue\",\"depth\":%d,\"message_size\":%u,", QUEUE_DEPTH, options.message_size);
+    run_queue_mode_phase("spsc", 1, control_file);
+    printf(",");
+    run_queue_mode_phase("mpsc", options.writer_count < 2 ? 2 : options.writer_count, control_file);
+    printf("}\n");
+    /*back to last message mode for the other modes*/
+    if (ioctl(control_file, MSG_SLOT_QUEUE_DEPTH, 0) != 0)
+    {
+        perror("Error");
+        exit(1);
+    }
+    close(control_file);
+}
+
+/*
+Measures the cost of a write and a read system call with 1, 64 and 128 byte messages, on channel 1 of the first device file
+selected by MSG_SLOT_CHANNEL, each size for a third of the duration. Loading the module of an older version and running
+the same mode shows the difference between them.
+*/
+static void run_sizes_mode(void)
+{
+    static const unsigned int message_sizes[] = {1, 64, 128};
+    static bench_thread roles[2]; /*The writes and the reads of the current size*/
+    char message[MAX_ZISE_BUFFER];
+    uint64_t start;
+    uint64_t end;
+    uint64_t operation_start;
+    unsigned int i;
+    int file;
+
+    memset(message, 'm', sizeof(message));
+    file = open_first_device_file(O_RDWR | O_NONBLOCK);
+    if (ioctl(file, MSG_SLOT_CHANNEL, 1) != 0)
+    {
+        perror("Error");
+        exit(1);
+    }
+    printf("{\"mode\":\"sizes\",\"sizes\":[");
+    for (i = 0; i < sizeof(message_sizes) / sizeof(message_sizes[0]); i++)
+    {
+        memset(roles, 0, sizeof(roles));
+        start = now_ns();
+        end = start + options.duration_seconds * 1000000000ULL / 3;
+        while (!bench_time_is_over(end))
+        {
+            operation_start = now_ns();
+            count_bench_operation(&roles[0], write(file, message, message_sizes[i]), operation_start);
+            operation_start = now_ns();
+            count_bench_operation(&roles[1], read(file, message, sizeof(message)), operation_start);
+        }
+        printf("%s{\"message_size\":%u,", i == 0 ? "" : ",", message_sizes[i]);
+        print_role_results("write", &roles[0], 1, (now_ns() - start) / 1e9);
+        printf(",");
+        print_role_results("read", &roles[1], 1, (now_ns() - start) / 1e9);
+        printf("}");
+    }
+    printf("]}\n");
+    close(file);
+}
+
+/*The ways of the batch mode to write or read a message of every channel*/
+enum batch_round_kind {
+    BATCH_IOCTL_WRITE_LOOP, /*MSG_SLOT_CHANNEL and write per channel*/
+    BATCH_PWRITE_LOOP, /*pwrite per channel, addressed by the offset*/
+    BATCH_WRITE_BATCH, /*one MSG_SLOT_WRITE_BATCH*/
+    BATCH_IOCTL_READ_LOOP, /*MSG_SLOT_CHANNEL and read per channel*/
+    BATCH_PREAD_LOOP, /*pread per channel, addressed by the offset*/
+    BATCH_READ_BATCH, /*one MSG_SLOT_READ_BATCH*/
+    BATCH_ROUND_KINDS
+};
+
+static const char *batch_round_names[BATCH_ROUND_KINDS] = {
+    "ioctl_write_loop",
+    "pwrite_loop",
+    "write_batch",
+    "ioctl_read_loop",
+    "pread_loop",
+    "read_batch",
+};
+
+/*
+Writes or reads a message of every one of the channel_count channels once, in one of the ways of the batch mode.
+Returns 0, or -1 if a system call or a batch entry failed.
+*/
+static int run_batch_round(enum batch_round_kind kind, int selecting_file, int offset_file, char *buffers,
+                           struct msg_slot_batch_entry *entries, unsigned int channel_count)
+{
+    struct msg_slot_batch batch;
+    unsigned int i;
+    long batch_ret;
+
+    for (i = 0; i < channel_count; i++)
+    {
+        if (kind == BATCH_IOCTL_WRITE_LOOP)
+        {
+            if (ioctl(selecting_file, MSG_SLOT_CHANNEL, i + 1) != 0 || write(selecting_file, buffers, options.message_size) < 0)
+            {
+                return -1;
+            }
+        }
+        else if (kind == BATCH_IOCTL_READ_LOOP)
+        {
+            if (ioctl(selecting_file, MSG_SLOT_CHANNEL, i + 1) != 0 ||
+                read(selecting_file, buffers + (size_t)i * options.message_size, options.message_size) < 0)
+            {
+                return -1;
+            }
+        }
+        else if (kind == BATCH_PWRITE_LOOP)
+        {
+            if (pwrite(offset_file, buffers, options.message_size, i + 1) < 0)
+            {
+                return -1;
+            }
+        }
+        else if (kind == BATCH_PREAD_LOOP)
+        {
+            if (pread(offset_file, buffers + (size_t)i * options.message_size, options.message_size, i + 1) < 0)
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            entries[i].channel_id = i + 1;
+            entries[i].length = options.message_size;
+            entries[i].buffer = (uint64_t)(uintptr_t)(buffers + (size_t)i * options.message_size);
+            entries[i].status = 0;
+            entries[i].reserved = 0;
+        }
+    }
+    if (kind != BATCH_WRITE_BATCH && kind != BATCH_READ_BATCH)
+    {
+        return 0;
+    }
+    batch.entries = (uint64_t)(uintptr_t)entries;
+    batch.count = channel_count;
+    batch.reserved = 0;
+    batch_ret = ioctl(selecting_file, kind == BATCH_WRITE_BATCH ? MSG_SLOT_WRITE_BATCH : MSG_SLOT_READ_BATCH, &batch);
+    if (batch_ret < 0)
+    {
+        return -1;
+    }
+    for (i = 0; i < channel_count; i++)
+    {
+        if (entries[i].status < 0)
+        {
+            /*report the error of the first entry that failed*/
+            errno = -entries[i].status;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+Compares writing and reading a message of each of -c channels (up to MSG_SLOT_BATCH_MAX_ENTRIES) of the first device file
+in one MSG_SLOT_WRITE_BATCH or MSG_SLOT_READ_BATCH against a loop of system calls per channel, each way for an equal share of the duration.
+*/
+static void run_batch_mode(void)
+{
+    struct msg_slot_batch_entry *entries;
+    char *buffers;
+    unsigned int channel_count;
+    uint64_t rounds;
+    uint64_t start;
+    uint64_t end;
+    double elapsed_seconds;
+    int selecting_file;
+    int offset_file;
+    int kind;
+
+    channel_count = options.channel_count < MSG_SLOT_BATCH_MAX_ENTRIES ? options.channel_count : MSG_SLOT_BATCH_MAX_ENTRIES;
+    entries = (struct msg_slot_batch_entry*)calloc(channel_count, sizeof(struct msg_slot_batch_entry));
+    buffers = (char*)malloc((size_t)channel_count * options.message_size);
+    if (entries == NULL || buffers == NULL)
+    {
+        perror("Error");
+        exit(1);
+    }
+    memset(buffers, 'm', (size_t)channel_count * options.message_size);
+    selecting_file = open_first_device_file(O_RDWR | O_NONBLOCK);
+    offset_file = open_first_device_file(O_RDWR | O_NONBLOCK);
+    printf("{\"mode\":\"batch\",\"channels\":%u,\"message_size\":%u", channel_count, options.message_size);
+    for (kind = 0; kind < BATCH_ROUND_KINDS; kind++)
+    {
+        rounds = 0;
+        start = now_ns();
+        end = start + options.duration_seconds * 1000000000ULL / BATCH_ROUND_KINDS;
+        while (rounds == 0 || !bench_time_is_over(end))
+        {
+            if (run_batch_round((enum batch_round_kind)kind, selecting_file, offset_file, buffers, entries, channel_count) != 0)
+            {
+                perror(batch_round_names[kind]);
+                exit(1);
+            }
+            rounds++;
+        }
+        elapsed_seconds = (double)(now_ns() - start) / 1e9;
+        printf(",\"%s\":{\"rounds\":%llu,\"us_per_round\":%.1f,\"msgs_per_sec\":%.0f}", batch_round_names[kind],
+               (unsigned long long)rounds, elapsed_seconds * 1e6 / rounds, rounds * channel_count / elapsed_seconds);
+    }
+    printf("}\n");
+    close(offset_file);
+    close(selecting_file);
+    free(buffers);
+    free(entries);
+}
+
+static void run_mixed_mode(void);
+
+/*The measurements of the benchmark, the first one is the default*/
+static const bench_mode bench_modes[] = {
+    {"mixed", "writer and reader threads on the channels of all the device files (default)", run_mixed_mode},
+    {"ring", "messages/sec of write() against the shared ring and MSG_SLOT_RING_FLUSH, on the first device file", run_ring_mode},
+    {"slots", "activation time of a slot behind every device file, then ops/sec on random slots", run_slots_mode},
+    {"channels", "latencies of random writes and reads as the first device file grows from 1 to -c channels", run_channels_mode},
+    {"open", "open/close cycles of the first device file, with their latencies per second and the kernel slab memory", run_open_mode},
+    {"stress", "-w + -r threads of random operations of every kind on the -c channels of the first device file", run_stress_mode},
+    {"wakeup", "latency from a write to the wakeup of a reader in a blocking read and in poll, on the first device file", run_wakeup_mode},
+    {"queue", "throughput of a channel in queue mode, one producer then -w producers, with one consumer", run_queue_mode},
+    {"sizes", "cost of a write and a read system call with 1, 64 and 128 byte messages, on the first device file", run_sizes_mode},
+    {"batch", "a message of each of -c channels in one batch ioctl against a loop of system calls, on the first device file", run_batch_mode},
+};
+
+/*Prints the usage of the benchmark*/
+static void print_usage(const char *program_name)
+{
+    unsigned int i;
+
+    fprintf(stderr,
+            "Usage: %s [-m mode] [-w writers] [-r readers] [-c channels] [-s message size] [-t seconds] [-z zipf exponent] device_file...\n"
+            "  -w  writer threads (default 1)\n"
+            "  -r  reader threads (default 1)\n"
+            "  -c  channels of every device file (default 1)\n"
+            "  -s  message size in bytes (default 64)\n"
+            "  -t  duration in seconds (default 5)\n"
+            "  -z  zipf exponent of the channel choice, 0 for uniform (default 0)\n"
+            "  -m  mode of the benchmark (default mixed):\n",
+            program_name);
+    for (i = 0; i < sizeof(bench_modes) / sizeof(bench_modes[0]); i++)
+    {
+        fprintf(stderr, "      %-10s %s\n", bench_modes[i].name, bench_modes[i].description);
+    }
+}
+
+/*Opens a thread's file descriptor of every device file, with no channel selected so the offset picks it*/
+static int *open_device_files(int is_writer)
+{
+    int *files;
+    unsigned int i;
+
+    files = (int*)malloc(options.device_count * sizeof(int));
+    if (files == NULL)
+    {
+        return NULL;
+    }
+    for (i = 0; i < options.device_count; i++)
+    {
+        files[i] = open(options.device_paths[i], is_writer ? O_WRONLY | O_NONBLOCK : O_RDONLY | O_NONBLOCK);
+        if (files[i] < 0)
+        {
+            /*Couldn't open the file*/
+            perror("Error");
+            exit(1);
+        }
+    }
+    return files;
+}
+
+/*The default mode: writer and reader threads on the channels of all the device files, see bench_thread_main*/
+static void run_mixed_mode(void)
+{
+    bench_thread *threads;
+    unsigned int thread_count;
+    unsigned int i;
+    unsigned int j;
+    uint64_t start;
+    double elapsed_seconds;
+    struct timespec duration;
+
+    thread_count = options.writer_count + options.reader_count;
+    threads = (bench_thread*)calloc(thread_count, sizeof(bench_thread));
+    if (threads == NULL)
+    {
+        perror("Error");
+        exit(1);
+    }
+    atomic_store(&bench_stop, 0);
+    for (i = 0; i < thread_count; i++)
+    {
+        threads[i].is_writer = i < options.writer_count;
+        threads[i].thread_index = threads[i].is_writer ? i : i - options.writer_count;
+        threads[i].files = open_device_files(threads[i].is_writer);
+        if (threads[i].files == NULL)
+        {
+            perror("Error");
+            exit(1);
+        }
+    }
+    start = now_ns();
+    for (i = 0; i < thread_count; i++)
+    {
+        if (pthread_create(&threads[i].thread, NULL, bench_thread_main, &threads[i]) != 0)
+        {
+            fprintf(stderr, "Failed to create a benchmark thread\n");
+            exit(1);
+        }
+    }
+
+    /*Main part- let the threads run for the duration of the benchmark*/
+    duration.tv_sec = options.duration_seconds;
+    duration.tv_nsec = 0;
+    while (nanosleep(&duration, &duration) != 0 && errno == EINTR)
+    {
+        /*Interrupted by a signal, sleep for the rest of the duration*/
+    }
+    atomic_store(&bench_stop, 1);
+    for (i = 0; i < thread_count; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+    }
+    elapsed_seconds = (double)(now_ns() - start) / 1e9;
+
+    /*Print the configuration and the results of both roles as one JSON line*/
+    printf("{\"devices\":%u,\"channels\":%u,\"message_size\":%u,\"zipf_exponent\":%g,\"seconds\":%.3f,",
+           options.device_count, options.channel_count, options.message_size, options.zipf_exponent, elapsed_seconds);
+    print_role_results("write", threads, options.writer_count, elapsed_seconds);
+    printf(",");
+    print_role_results("read", threads + options.writer_count, options.reader_count, elapsed_seconds);
+    printf("}\n");
+
+    for (i = 0; i < thread_count; i++)
+    {
+        for (j = 0; j < options.device_count; j++)
+        {
+            close(threads[i].files[j]);
+        }
+        free(threads[i].files);
+    }
+    free(threads);
+}
+
+int main(int argc, char *argv[])
+{
+    const bench_mode *mode;
+    unsigned int i;
+    int option;
+    int file;
+    struct rlimit file_limit;
+
+    options.writer_count = 1;
+    options.reader_count = 1;
+    options.channel_count = 1;
+    options.message_size = 64;
+    options.duration_seconds = 5;
+    options.zipf_exponent = 0;
+    options.mode = bench_modes[0].name;
+    while ((option = getopt(argc, argv, "m:w:r:c:s:t:z:h")) != -1)
+    {
+        switch (option)
+        {
+        case 'm':
+            options.mode = optarg;
+            break;
+        case 'w':
+            options.writer_count = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            options.reader_count = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            options.channel_count = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            options.message_size = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            options.duration_seconds = strtoul(optarg, NULL, 10);
+            break;
+        case 'z':
+            options.zipf_exponent = strtod(optarg, NULL);
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (optind == argc || options.channel_count == 0 || options.duration_seconds == 0 ||
+        options.message_size == 0 || options.message_size > MAX_MESSAGE_SIZE_LIMIT || options.zipf_exponent < 0)
+    {
+        /*No device file, or an option that is not valid*/
+        print_usage(argv[0]);
+        exit(1);
+    }
+    mode = NULL;
+    for (i = 0; i < sizeof(bench_modes) / sizeof(bench_modes[0]); i++)
+    {
+        if (strcmp(bench_modes[i].name, options.mode) == 0)
+        {
+            mode = &bench_modes[i];
+        }
+    }
+    if (mode == NULL)
+    {
+        /*The mode is not valid*/
+        print_usage(argv[0]);
+        exit(1);
+    }
+    options.device_paths = (const char**)&argv[optind];
+    options.device_count = argc - optind;
+    /*every thread opens every device file, so tens of thousands of slots need more than the default limit*/
+    if (getrlimit(RLIMIT_NOFILE, &file_limit) == 0 && file_limit.rlim_cur < file_limit.rlim_max)
+    {
+        file_limit.rlim_cur = file_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &file_limit);
+    }
+    total_channel_count = options.device_count * options.channel_count;
+    if (build_channel_cdf() != 0)
+    {
+        perror("Error");
+        exit(1);
+    }
+
+    /*Messages longer than the default max message size need the slots to accept them*/
+    if (options.message_size > MAX_ZISE_BUFFER)
+    {
+        for (i = 0; i < options.device_count; i++)
+        {
+            file = open(options.device_paths[i], O_WRONLY);
+            if (file < 0 || ioctl(file, MSG_SLOT_MAX_MESSAGE_SIZE, options.message_size) != 0)
+            {
+                perror("Error");
+                exit(1);
+            }
+            close(file);
+        }
+    }
+
+    mode->run();
+    free(channel_cdf);
+    exit(0);
+}
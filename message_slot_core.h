@@ -0,0 +1,1090 @@
+/*
+The message store of the message_slot module: the message payloads, the channels and the channel index of a slot.
+It holds no device or user copy code, so besides the module it also builds in user space on top of
+message_slot_shim.h, where message_slot_core_bench.c measures it without loading the module.
+*/
+#ifndef MESSAGE_SLOT_CORE_H
+#define MESSAGE_SLOT_CORE_H
+
+#ifdef __KERNEL__
+#include <linux/kernel.h> /*kernel.h for basic types and macros*/
+#include <linux/slab.h> /*slab.h for the slab caches of the store*/
+#include <linux/xarray.h> /*xarray.h for the channel index of every message slot*/
+#include <linux/kref.h> /*kref.h for the reference count of every message channel*/
+#include <linux/mutex.h> /*mutex.h for the ring lock of a message slot*/
+#include <linux/spinlock.h> /*spinlock.h for serializing the writers of a message slot*/
+#include <linux/rcupdate.h> /*rcupdate.h for lock-free lookup and freeing of message channels*/
+#include <linux/wait.h> /*wait.h for the wait queues of a channel*/
+#include <linux/mm.h> /*mm.h for kvmalloc of the message queues and of large messages*/
+#include <linux/refcount.h> /*refcount.h for the reference count of every message payload*/
+#include <linux/overflow.h> /*overflow.h for sizing the message payloads*/
+#include <linux/topology.h> /*topology.h for allocating on the NUMA node of the writer*/
+#include <linux/percpu.h> /*percpu.h for the statistics counters of the slots*/
+#include <linux/atomic.h> /*atomic.h for the statistics counters of the channels*/
+#include <linux/timekeeping.h> /*timekeeping.h for the write time of every message*/
+#else
+#include "message_slot_shim.h" /*message_slot_shim.h for the kernel API subset of the user space build*/
+#endif
+#include "message_slot.h" /*message_slot.h for the limits of the message slots*/
+
+struct message_slot;
+struct message_slot_ring;
+
+/*A message, allocated from the payload size class that fits its length and never changed once published*/
+typedef struct message_payload {
+    refcount_t refcount; /*One reference for the channel or queue holding it and one for every reader copying it*/
+    atomic_t holders; /*The channels and queues holding it, the payload is charged to the slot once while it has any*/
+    unsigned int message_length; /*The length of the message*/
+    unsigned int size_class; /*The payload cache it was allocated from, MESSAGE_PAYLOAD_SIZE_CLASSES for kvmalloc*/
+    u64 message_sequence; /*The sequence of the slot when the message was written, the same in every channel it was published to*/
+    u64 timestamp_ns; /*The CLOCK_REALTIME time when the message was written*/
+    struct rcu_head rcu; /*Defers the free of the payload until lock-free readers are done with it*/
+    char message[]; /*The message that the user sent*/
+} message_payload;
+
+/*
+Statistics counters of a message slot.
+They are kept per CPU, so counting an operation is a few local increments and
+lock-free readers on different CPUs never write to a shared cache line.
+*/
+typedef struct message_slot_stats {
+    u64 reads; /*Successful reads*/
+    u64 read_bytes; /*Bytes returned by the successful reads*/
+    u64 read_misses; /*Reads that found no message, -EWOULDBLOCK*/
+    u64 writes; /*Successful writes*/
+    u64 write_bytes; /*Bytes stored by the successful writes*/
+    u64 no_space_errors; /*Reads with a buffer too short for the message, -ENOSPC*/
+    u64 message_size_errors; /*Writes of an empty or too long message, -EMSGSIZE*/
+    u64 evictions; /*Idle channels evicted to keep the slot within the memory budgets*/
+} message_slot_stats;
+
+/*
+Statistics counters of a single channel, the same ones as message_slot_stats without evictions.
+A slot may have millions of channels, so they are plain atomics on a cache line of the channel of their own
+instead of per CPU counters, which would take a per CPU allocation of every channel.
+*/
+typedef struct message_channel_stats {
+    atomic64_t reads;
+    atomic64_t read_bytes;
+    atomic64_t read_misses;
+    atomic64_t writes;
+    atomic64_t write_bytes;
+    atomic64_t no_space_errors;
+    atomic64_t message_size_errors;
+} message_channel_stats;
+
+/*
+single message channel struct, allocated from its own cache-line aligned slab cache.
+The fields that lookups, reads and writes touch share the first cache line,
+the blocking, queue mode and freeing state is kept on the following ones, and the statistics on the last one.
+*/
+typedef struct single_message_channel {
+    /*hot fields*/
+    unsigned int message_channel_ID; /*The message channel ID*/
+    unsigned int queue_depth; /*The capacity of the queue ring, 0 in last message mode*/
+    message_payload __rcu *payload; /*The last message written to the channel, NULL while it has no message*/
+    u64 message_sequence; /*The sequence of the channel's last message, increases with every write, 0 while it has no message*/
+    struct message_slot *slot; /*The message slot that the channel belongs to*/
+    struct kref refcount; /*One reference for the slot index and one for every file descriptor using the channel*/
+    bool referenced; /*Set by lookups, cleared by the eviction clock hand that gives the channel a second chance*/
+    struct message_subscribers __rcu *subscribers; /*The channels that the channel's messages are also published to, NULL if none*/
+    /*cold fields*/
+    wait_queue_head_t readers_wait ____cacheline_aligned_in_smp; /*Blocking readers and pollers waiting for a new message*/
+    wait_queue_head_t writers_wait; /*Blocking writers waiting for room in a full queue*/
+    /*Queue mode- a bounded FIFO ring consumed by reads, protected by the slot's write_lock*/
+    message_payload **queue; /*The ring of queued messages, NULL in last message mode*/
+    unsigned int queue_head; /*The index of the oldest queued message*/
+    unsigned int queue_count; /*The number of queued messages*/
+    struct rcu_head rcu; /*Defers the free of the channel until lock-free readers are done with it*/
+    message_channel_stats stats ____cacheline_aligned_in_smp; /*The statistics of the channel, counting doesn't dirty the hot fields*/
+} single_message_channel;
+
+/*
+The subscribers of a topic channel, a write to the topic is published to each of them as well,
+all sharing the topic's payload. The list is never changed in place: a subscription change
+replaces it under the slot's write_lock, and the old one is freed after an RCU grace period.
+*/
+typedef struct message_subscribers {
+    struct rcu_head rcu; /*Defers the free of a replaced list until lock-free wakers are done with it*/
+    unsigned int count; /*The number of subscribers*/
+    struct single_message_channel *channels[]; /*The subscribers, the list holds a reference on each*/
+} message_subscribers;
+
+/*message_slot struct, a character device file that contains multiple message channels active concurrently*/
+typedef struct message_slot {
+    struct xarray channels; /*The message channels of the slot, indexed by message_channel_ID*/
+    spinlock_t write_lock; /*Serializes the writers of the slot's messages*/
+    u64 message_sequence; /*The sequence of the slot's last message, protected by write_lock*/
+    unsigned int max_message_size; /*The longest message that the slot's channels accept*/
+    struct message_slot_ring *ring; /*The shared ring that mmap exposes, NULL until MSG_SLOT_RING_SETUP*/
+    struct mutex ring_lock; /*Serializes the setup and the flushes of the shared ring*/
+    message_slot_stats __percpu *stats; /*The statistics of all the channels of the slot*/
+    unsigned int minor; /*The minor number of the slot*/
+    atomic_t channel_count; /*The number of channels in the index*/
+    atomic_long_t memory_bytes; /*The memory of the slot's channels, their queues and the messages they hold*/
+    unsigned long eviction_cursor; /*The channel ID where the eviction clock hand continues*/
+    struct mutex subscribers_lock; /*Serializes the subscription changes of the slot's channels*/
+} message_slot;
+
+/*
+Memory budgets in bytes, 0 for no budget, set by the module parameters.
+Channels and payloads are allocated with __GFP_ACCOUNT, so they are also charged to the memory cgroup of the writer.
+*/
+static unsigned long message_slot_memory_limit; /*The budget of all the slots together*/
+static unsigned long slot_memory_limit; /*The budget of every slot*/
+static atomic_long_t message_slot_memory_bytes; /*The memory of all the slots together*/
+
+/*Slab caches of the store's objects, visible in /proc/slabinfo under their names*/
+static struct kmem_cache *message_slot_cache; /*message_slot structs*/
+static struct kmem_cache *single_message_channel_cache; /*single_message_channel structs*/
+
+/*Payloads of up to 4 KiB come from power of two size classes starting at 64 bytes, larger ones from kvmalloc*/
+#define MESSAGE_PAYLOAD_SIZE_CLASSES 7
+#define MESSAGE_PAYLOAD_MIN_SIZE 64
+static struct kmem_cache *message_payload_caches[MESSAGE_PAYLOAD_SIZE_CLASSES];
+static const char *message_payload_cache_names[MESSAGE_PAYLOAD_SIZE_CLASSES] = {
+    "message_slot_payload_64",
+    "message_slot_payload_128",
+    "message_slot_payload_256",
+    "message_slot_payload_512",
+    "message_slot_payload_1024",
+    "message_slot_payload_2048",
+    "message_slot_payload_4096",
+};
+
+/*
+MESSAGE PAYLOAD FUNCTIONS
+*/
+/*
+Allocates a payload for a message of the given length from the smallest size class that fits it,
+so the memory of a channel tracks the length of its message. The payload is allocated on the
+NUMA node of the writer, which is the one that fills it.
+The payload starts with one reference, owned by the caller.
+Returns the payload, or NULL on memory allocation failure.
+*/
+static inline message_payload* alloc_message_payload(unsigned int message_length)
+{
+    message_payload *payload;
+    size_t payload_size;
+    unsigned int size_class;
+
+    payload_size = struct_size(payload, message, message_length);
+    for (size_class = 0; size_class < MESSAGE_PAYLOAD_SIZE_CLASSES; size_class++)
+    {
+        if (payload_size <= (MESSAGE_PAYLOAD_MIN_SIZE << size_class))
+        {
+            /*The smallest size class that fits the message*/
+            break;
+        }
+    }
+    if (size_class < MESSAGE_PAYLOAD_SIZE_CLASSES)
+    {
+        payload = (message_payload*)kmem_cache_alloc_node(message_payload_caches[size_class], GFP_KERNEL_ACCOUNT, numa_node_id());
+    }
+    else
+    {
+        /*Larger than every size class*/
+        payload = (message_payload*)kvmalloc_node(payload_size, GFP_KERNEL_ACCOUNT, numa_node_id());
+    }
+    if (payload == NULL)
+    {
+        return NULL;
+    }
+    refcount_set(&payload->refcount, 1);
+    atomic_set(&payload->holders, 0);
+    payload->message_length = message_length;
+    payload->size_class = size_class;
+    payload->message_sequence = 0; /*Set when the payload is published*/
+    payload->timestamp_ns = 0;
+    return payload;
+}
+
+/*Returns a payload to its size class once no lock-free reader can still see it*/
+static inline void free_message_payload_rcu(struct rcu_head *rcu)
+{
+    message_payload *payload;
+    payload = container_of(rcu, message_payload, rcu);
+    if (payload->size_class < MESSAGE_PAYLOAD_SIZE_CLASSES)
+    {
+        kmem_cache_free(message_payload_caches[payload->size_class], payload);
+    }
+    else
+    {
+        kvfree(payload);
+    }
+}
+
+/*Drops a reference on a payload, freeing it when it was the last one*/
+static inline void put_message_payload(message_payload *payload)
+{
+    if (payload != NULL && refcount_dec_and_test(&payload->refcount))
+    {
+        call_rcu(&payload->rcu, free_message_payload_rcu);
+    }
+}
+
+/*Returns the memory that a payload takes, charged to the slot once while any of its channels holds the payload*/
+static inline long message_payload_memory(const message_payload *payload)
+{
+    if (payload->size_class < MESSAGE_PAYLOAD_SIZE_CLASSES)
+    {
+        return MESSAGE_PAYLOAD_MIN_SIZE << payload->size_class;
+    }
+    return struct_size(payload, message, payload->message_length);
+}
+
+/*Adds bytes, or removes them when negative, to the memory of a slot and of all the slots*/
+static inline void charge_message_slot_memory(struct message_slot *current_message_slot, long bytes)
+{
+    atomic_long_add(bytes, &current_message_slot->memory_bytes);
+    atomic_long_add(bytes, &message_slot_memory_bytes);
+}
+
+/*
+Counts a new holder of a payload, a channel or a queue.
+A payload published to many channels is shared by them, so only its first holder charges it to the slot.
+Returns the bytes to charge to the slot, 0 if the payload was already charged.
+*/
+static inline long hold_message_payload(message_payload *payload)
+{
+    return atomic_inc_return(&payload->holders) == 1 ? message_payload_memory(payload) : 0;
+}
+
+/*
+Counts a holder that dropped a payload, see hold_message_payload.
+Returns the bytes to uncharge from the slot, 0 if other holders still have the payload.
+*/
+static inline long release_message_payload(message_payload *payload)
+{
+    return atomic_dec_and_test(&payload->holders) ? message_payload_memory(payload) : 0;
+}
+
+/*Drops the payloads left in a queue ring of a slot's channel and frees the ring*/
+static inline void free_message_queue(struct message_slot *current_message_slot, message_payload **queue, unsigned int queue_depth, unsigned int queue_head, unsigned int queue_count)
+{
+    long freed_bytes;
+    unsigned int i;
+
+    freed_bytes = queue_depth * sizeof(message_payload*);
+    for (i = 0; i < queue_count; i++)
+    {
+        freed_bytes += release_message_payload(queue[(queue_head + i) % queue_depth]);
+        put_message_payload(queue[(queue_head + i) % queue_depth]);
+    }
+    kvfree(queue);
+    charge_message_slot_memory(current_message_slot, -freed_bytes);
+}
+
+/*Creates the slab caches of the slots and channels and the payload caches of every size class*/
+static inline int create_message_slot_caches(void)
+{
+    int i;
+    message_slot_cache = kmem_cache_create("message_slot", sizeof(struct message_slot), 0, SLAB_HWCACHE_ALIGN, NULL);
+    single_message_channel_cache = kmem_cache_create("message_slot_channel", sizeof(struct single_message_channel), 0, SLAB_HWCACHE_ALIGN | SLAB_ACCOUNT, NULL);
+    if (message_slot_cache == NULL || single_message_channel_cache == NULL)
+    {
+        printk(KERN_ERR "message_slot: Failed to create the slab caches\n");
+        return -ENOMEM;
+    }
+    for (i = 0; i < MESSAGE_PAYLOAD_SIZE_CLASSES; i++)
+    {
+        message_payload_caches[i] = kmem_cache_create(message_payload_cache_names[i], MESSAGE_PAYLOAD_MIN_SIZE << i, 0, SLAB_ACCOUNT, NULL);
+        if (message_payload_caches[i] == NULL)
+        {
+            printk(KERN_ERR "message_slot: Failed to create the %s cache\n", message_payload_cache_names[i]);
+            return -ENOMEM;
+        }
+    }
+    return SUCCESS;
+}
+
+/*Destroys the slab caches, after the pending RCU frees returned their objects*/
+static inline void destroy_message_slot_caches(void)
+{
+    int i;
+    rcu_barrier();
+    for (i = 0; i < MESSAGE_PAYLOAD_SIZE_CLASSES; i++)
+    {
+        kmem_cache_destroy(message_payload_caches[i]);
+        message_payload_caches[i] = NULL;
+    }
+    kmem_cache_destroy(single_message_channel_cache);
+    kmem_cache_destroy(message_slot_cache);
+    single_message_channel_cache = NULL;
+    message_slot_cache = NULL;
+}
+
+/*
+CHANNEL INDEX FUNCTIONS
+*/
+/*Returns a message channel to its slab cache once no lock-free reader can still see it*/
+static inline void free_single_message_channel_rcu(struct rcu_head *rcu)
+{
+    single_message_channel *current_single_message_channel;
+    current_single_message_channel = container_of(rcu, single_message_channel, rcu);
+    kmem_cache_free(single_message_channel_cache, current_single_message_channel);
+}
+
+static inline void put_single_message_channel(single_message_channel *current_single_message_channel);
+
+/*
+Drops the subscriber list of a channel and its references on the subscribers.
+No writer may publish to the channel anymore, the list is freed after an RCU grace period
+because lock-free wakers may still walk it.
+*/
+static inline void drop_message_subscribers(single_message_channel *current_single_message_channel)
+{
+    message_subscribers *subscribers;
+    unsigned int i;
+
+    subscribers = rcu_dereference_protected(current_single_message_channel->subscribers, 1);
+    if (subscribers == NULL)
+    {
+        return;
+    }
+    RCU_INIT_POINTER(current_single_message_channel->subscribers, NULL);
+    charge_message_slot_memory(current_single_message_channel->slot, -(long)struct_size(subscribers, channels, subscribers->count));
+    for (i = 0; i < subscribers->count; i++)
+    {
+        put_single_message_channel(subscribers->channels[i]);
+    }
+    kvfree_rcu(subscribers, rcu);
+}
+
+/*
+Frees a message channel once its last reference is dropped and no lock-free reader can still see it.
+Must not be called with the slot's write_lock held.
+*/
+static inline void free_single_message_channel(struct kref *refcount)
+{
+    single_message_channel *current_single_message_channel;
+    message_payload *payload;
+    message_payload **queue;
+    unsigned int queue_depth;
+    unsigned int queue_head;
+    unsigned int queue_count;
+    long freed_bytes;
+
+    current_single_message_channel = container_of(refcount, single_message_channel, refcount);
+    /*detach pollers that are still registered on the wait queues, they are freed after an RCU grace period*/
+    wake_up_pollfree(&current_single_message_channel->readers_wait);
+    wake_up_pollfree(&current_single_message_channel->writers_wait);
+    /*no reader or writer is left, drop the messages and the subscribers of the channel*/
+    drop_message_subscribers(current_single_message_channel);
+    freed_bytes = sizeof(struct single_message_channel);
+    payload = rcu_dereference_protected(current_single_message_channel->payload, 1);
+    if (payload != NULL)
+    {
+        freed_bytes += release_message_payload(payload);
+        put_message_payload(payload);
+    }
+    /*the snapshot still reads the queue ring of a channel it found under RCU, detach the ring under write_lock first*/
+    spin_lock(&current_single_message_channel->slot->write_lock);
+    queue = current_single_message_channel->queue;
+    queue_depth = current_single_message_channel->queue_depth;
+    queue_head = current_single_message_channel->queue_head;
+    queue_count = current_single_message_channel->queue_count;
+    current_single_message_channel->queue = NULL;
+    WRITE_ONCE(current_single_message_channel->queue_count, 0);
+    WRITE_ONCE(current_single_message_channel->queue_depth, 0);
+    spin_unlock(&current_single_message_channel->slot->write_lock);
+    if (queue != NULL)
+    {
+        free_message_queue(current_single_message_channel->slot, queue, queue_depth, queue_head, queue_count);
+    }
+    charge_message_slot_memory(current_single_message_channel->slot, -freed_bytes);
+    call_rcu(&current_single_message_channel->rcu, free_single_message_channel_rcu);
+}
+
+/*Drops a reference on a message channel, freeing it when it was the last one*/
+static inline void put_single_message_channel(single_message_channel *current_single_message_channel)
+{
+    kref_put(&current_single_message_channel->refcount, free_single_message_channel);
+}
+
+/*
+Finds the message channel with the given ID in a message slot and takes a reference on it.
+The lookup is lock-free, RCU keeps the channel alive until the reference is taken.
+Returns the channel, or NULL if no message channel with this ID exists yet.
+*/
+static inline single_message_channel* find_single_message_channel(message_slot *current_message_slot, unsigned int channel_id)
+{
+    single_message_channel *current_single_message_channel;
+
+    rcu_read_lock();
+    current_single_message_channel = (single_message_channel*)xa_load(&current_message_slot->channels, channel_id);
+    if (current_single_message_channel != NULL && !kref_get_unless_zero(&current_single_message_channel->refcount))
+    {
+        /*The channel is being freed*/
+        current_single_message_channel = NULL;
+    }
+    if (current_single_message_channel != NULL && !READ_ONCE(current_single_message_channel->referenced))
+    {
+        /*written only when it changes, so lookups of a busy channel don't dirty its cache line*/
+        WRITE_ONCE(current_single_message_channel->referenced, true);
+    }
+    rcu_read_unlock();
+    return current_single_message_channel;
+}
+
+/*
+MEMORY BUDGET FUNCTIONS
+*/
+/*
+Takes the index's reference of a channel found under rcu_read_lock, if it is the last one left-
+no file descriptor has the channel selected and no read or write is using it.
+Once claimed no lookup can take a reference on the channel, and remove_single_message_channel must free it.
+Returns true if the channel was claimed.
+*/
+static inline bool claim_idle_single_message_channel(single_message_channel *current_single_message_channel)
+{
+    return refcount_dec_if_one(&current_single_message_channel->refcount.refcount);
+}
+
+/*
+Removes a channel claimed by claim_idle_single_message_channel from the index of its slot and frees it with its messages.
+A writer creating the same ID may already have replaced the claimed channel in the index, that new channel is kept.
+*/
+static inline void remove_single_message_channel(message_slot *current_message_slot, single_message_channel *current_single_message_channel)
+{
+    xa_cmpxchg(&current_message_slot->channels, current_single_message_channel->message_channel_ID, current_single_message_channel, NULL, 0);
+    atomic_dec(&current_message_slot->channel_count);
+    free_single_message_channel(&current_single_message_channel->refcount);
+}
+
+/*
+Evicts an idle channel of a message slot with the CLOCK algorithm: the hand moves through the channel IDs,
+a channel that was looked up since the last pass has its referenced bit cleared and is skipped,
+the first idle channel without it is removed with its messages.
+The hand makes at most two revolutions, the first may only clear referenced bits,
+so the scan fails only when every channel of the slot is in use.
+Returns true if a channel was evicted.
+*/
+static inline bool evict_single_message_channel(message_slot *current_message_slot)
+{
+    single_message_channel *current_single_message_channel;
+    unsigned long channel_id;
+    unsigned int scanned;
+    unsigned int scan_limit;
+    bool claimed;
+
+    claimed = false;
+    scan_limit = 2 * atomic_read(&current_message_slot->channel_count) + 1;
+    /*concurrent evictions may share a position of the hand, claiming a channel is atomic*/
+    channel_id = READ_ONCE(current_message_slot->eviction_cursor);
+    for (scanned = 0; scanned < scan_limit && !claimed; scanned++)
+    {
+        rcu_read_lock();
+        current_single_message_channel = (single_message_channel*)xa_find(&current_message_slot->channels, &channel_id, ULONG_MAX, XA_PRESENT);
+        if (current_single_message_channel == NULL)
+        {
+            /*the hand passed the last channel, wrap around to the first*/
+            channel_id = 0;
+            current_single_message_channel = (single_message_channel*)xa_find(&current_message_slot->channels, &channel_id, ULONG_MAX, XA_PRESENT);
+        }
+        if (current_single_message_channel == NULL)
+        {
+            /*The slot has no channels*/
+            rcu_read_unlock();
+            break;
+        }
+        channel_id++;
+        if (READ_ONCE(current_single_message_channel->referenced))
+        {
+            WRITE_ONCE(current_single_message_channel->referenced, false);
+        }
+        else
+        {
+            claimed = claim_idle_single_message_channel(current_single_message_channel);
+        }
+        rcu_read_unlock();
+    }
+    WRITE_ONCE(current_message_slot->eviction_cursor, channel_id);
+    if (!claimed)
+    {
+        return false;
+    }
+    /*the claim keeps the channel alive outside of RCU, nobody else can free it*/
+    remove_single_message_channel(current_message_slot, current_single_message_channel);
+    this_cpu_inc(current_message_slot->stats->evictions);
+    return true;
+}
+
+/*Returns true if a message slot, or all the slots together, are over their memory budget*/
+static inline bool message_slot_over_budget(message_slot *current_message_slot)
+{
+    unsigned long limit;
+
+    limit = READ_ONCE(slot_memory_limit);
+    if (limit != 0 && atomic_long_read(&current_message_slot->memory_bytes) >= (long)limit)
+    {
+        return true;
+    }
+    limit = READ_ONCE(message_slot_memory_limit);
+    return limit != 0 && atomic_long_read(&message_slot_memory_bytes) >= (long)limit;
+}
+
+/*
+Makes room for a new channel or message in a message slot: while the slot or all the slots are over
+their memory budget, idle channels of the slot are evicted. The budgets are soft- an allocation is
+refused only when the memory is still over a budget after eviction, so they are exceeded by at most
+one allocation per concurrent writer.
+Returns SUCCESS, or -ENOMEM if no idle channel of the slot is left to evict.
+*/
+static inline int reserve_message_slot_memory(message_slot *current_message_slot)
+{
+    while (message_slot_over_budget(current_message_slot))
+    {
+        if (!evict_single_message_channel(current_message_slot))
+        {
+            return -ENOMEM;
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+Removes the channel with the given ID from a message slot with its messages, unless it is in use.
+Returns SUCCESS, -EINVAL if the channel does not exist, or -EBUSY if a file descriptor has it selected
+or a read or write is using it.
+*/
+static inline int delete_single_message_channel(message_slot *current_message_slot, unsigned int channel_id)
+{
+    single_message_channel *current_single_message_channel;
+    bool claimed;
+
+    rcu_read_lock();
+    current_single_message_channel = (single_message_channel*)xa_load(&current_message_slot->channels, channel_id);
+    if (current_single_message_channel == NULL)
+    {
+        rcu_read_unlock();
+        return -EINVAL;
+    }
+    claimed = claim_idle_single_message_channel(current_single_message_channel);
+    rcu_read_unlock();
+    if (!claimed)
+    {
+        return -EBUSY;
+    }
+    remove_single_message_channel(current_message_slot, current_single_message_channel);
+    return SUCCESS;
+}
+
+/*
+CHANNEL CREATION FUNCTIONS
+*/
+/*
+Finds the message channel with the given ID in a message slot, creating an empty one on first use.
+A reference is taken for the caller, who must drop it with put_single_message_channel.
+A new channel must fit in the memory budgets, see reserve_message_slot_memory.
+Returns the channel on success, or ERR_PTR(-ENOMEM) on memory allocation failure or when over budget.
+*/
+static inline single_message_channel* find_or_create_single_message_channel(message_slot *current_message_slot, unsigned int channel_id)
+{
+    single_message_channel *new_single_message_channel;
+    single_message_channel *existing_single_message_channel;
+    single_message_channel *replaced_single_message_channel;
+
+    existing_single_message_channel = find_single_message_channel(current_message_slot, channel_id);
+    if (existing_single_message_channel != NULL)
+    {
+        /*The message channel was found!*/
+        return existing_single_message_channel;
+    }
+    /*The message channel was not found so we make a new one*/
+    if (reserve_message_slot_memory(current_message_slot) != SUCCESS)
+    {
+        return ERR_PTR(-ENOMEM);
+    }
+    /*allocated on the NUMA node of the task that selects the channel, which is the one using it*/
+    new_single_message_channel = (single_message_channel*)kmem_cache_alloc_node(single_message_channel_cache, GFP_KERNEL_ACCOUNT, numa_node_id());
+    if (new_single_message_channel == NULL)
+    {
+        /*If allocate memory fialed, print an error and exit*/
+        printk(KERN_ERR "message_slot: Failed to allocate memory for the single_message_channel\n");
+        return ERR_PTR(-ENOMEM);
+    }
+    /*initialize the single message channel*/
+    new_single_message_channel->message_channel_ID = channel_id; /*update the message channel ID*/
+    RCU_INIT_POINTER(new_single_message_channel->payload, NULL); /*No message was written yet*/
+    new_single_message_channel->message_sequence = 0;
+    init_waitqueue_head(&new_single_message_channel->readers_wait);
+    new_single_message_channel->queue = NULL; /*Channels start in last message mode*/
+    new_single_message_channel->queue_depth = 0;
+    new_single_message_channel->queue_head = 0;
+    new_single_message_channel->queue_count = 0;
+    init_waitqueue_head(&new_single_message_channel->writers_wait);
+    new_single_message_channel->slot = current_message_slot;
+    new_single_message_channel->referenced = true; /*a new channel gets a full pass of the clock hand*/
+    RCU_INIT_POINTER(new_single_message_channel->subscribers, NULL); /*No channel subscribed yet*/
+    memset(&new_single_message_channel->stats, 0, sizeof(new_single_message_channel->stats));
+    kref_init(&new_single_message_channel->refcount); /*The reference of the slot index*/
+    kref_get(&new_single_message_channel->refcount); /*The reference of the caller*/
+
+    /*
+    put the new channel in the index, unless another writer inserted the same ID first.
+    The ID may still hold a channel that eviction claimed but did not erase yet, the new channel replaces it.
+    Every retry means another writer changed the index meanwhile, the reservation and the allocation are not repeated.
+    The lookup above just missed the ID, so the first attempt inserts without walking the index again- a restore
+    creates a channel for every record.
+    */
+    existing_single_message_channel = NULL;
+    rcu_read_lock();
+    for (;;)
+    {
+        if (existing_single_message_channel == NULL)
+        {
+            rcu_read_unlock();
+            replaced_single_message_channel = xa_cmpxchg(&current_message_slot->channels, channel_id, NULL, new_single_message_channel, GFP_KERNEL_ACCOUNT);
+        }
+        else if (kref_get_unless_zero(&existing_single_message_channel->refcount))
+        {
+            /*Lost the race, use the channel that is already in the index*/
+            rcu_read_unlock();
+            kmem_cache_free(single_message_channel_cache, new_single_message_channel);
+            return existing_single_message_channel;
+        }
+        else
+        {
+            /*
+            The channel is dying, RCU keeps its memory from being reused until the exchange is done,
+            and the index already has a node for the ID, so nothing is allocated
+            */
+            replaced_single_message_channel = xa_cmpxchg(&current_message_slot->channels, channel_id, existing_single_message_channel,
+                                                         new_single_message_channel, GFP_ATOMIC);
+            rcu_read_unlock();
+        }
+        if (xa_is_err(replaced_single_message_channel))
+        {
+            /*The index could not allocate its internal nodes*/
+            kmem_cache_free(single_message_channel_cache, new_single_message_channel);
+            return ERR_PTR(xa_err(replaced_single_message_channel));
+        }
+        if (replaced_single_message_channel == existing_single_message_channel)
+        {
+            break;
+        }
+        rcu_read_lock();
+        existing_single_message_channel = (single_message_channel*)xa_load(&current_message_slot->channels, channel_id);
+    }
+    atomic_inc(&current_message_slot->channel_count);
+    charge_message_slot_memory(current_message_slot, sizeof(struct single_message_channel));
+    return new_single_message_channel;
+}
+
+/*
+MESSAGE SLOT FUNCTIONS
+*/
+/*
+Allocates an empty message slot with the given max message size.
+Returns the slot, or NULL on memory allocation failure.
+*/
+static inline message_slot* alloc_message_slot(unsigned int minor, unsigned int slot_max_message_size)
+{
+    message_slot *current_message_slot;
+
+    current_message_slot = (message_slot*)kmem_cache_alloc(message_slot_cache, GFP_KERNEL);
+    if (current_message_slot == NULL)
+    {
+        return NULL;
+    }
+    current_message_slot->stats = alloc_percpu(message_slot_stats);
+    if (current_message_slot->stats == NULL)
+    {
+        kmem_cache_free(message_slot_cache, current_message_slot);
+        return NULL;
+    }
+    xa_init(&current_message_slot->channels);
+    current_message_slot->minor = minor;
+    atomic_set(&current_message_slot->channel_count, 0);
+    atomic_long_set(&current_message_slot->memory_bytes, 0);
+    current_message_slot->eviction_cursor = 0;
+    spin_lock_init(&current_message_slot->write_lock);
+    current_message_slot->message_sequence = 0;
+    mutex_init(&current_message_slot->subscribers_lock);
+    current_message_slot->max_message_size = slot_max_message_size;
+    current_message_slot->ring = NULL;
+    mutex_init(&current_message_slot->ring_lock);
+    return current_message_slot;
+}
+
+/*
+Frees a message slot and drops the index's reference on each of its channels.
+No file descriptor may use the slot anymore and its shared ring must already be freed.
+*/
+static inline void free_message_slot(message_slot *current_message_slot)
+{
+    unsigned long channel_id;
+    single_message_channel *temp_single_message_channel;
+
+    xa_for_each(&current_message_slot->channels, channel_id, temp_single_message_channel)
+    {
+        /*subscriptions may form cycles, break them all before the channels are put*/
+        drop_message_subscribers(temp_single_message_channel);
+    }
+    xa_for_each(&current_message_slot->channels, channel_id, temp_single_message_channel)
+    {
+        /*drop the reference of the slot index*/
+        put_single_message_channel(temp_single_message_channel);
+    }
+    xa_destroy(&current_message_slot->channels); /*free the index nodes of the message slot*/
+    free_percpu(current_message_slot->stats);
+    kmem_cache_free(message_slot_cache, current_message_slot);
+}
+
+/*
+SUBSCRIPTION FUNCTIONS
+*/
+/*Returns the index of a channel in a subscriber list, or the count of the list if it is not in it*/
+static inline unsigned int find_message_subscriber(message_subscribers *subscribers, single_message_channel *subscriber)
+{
+    unsigned int i;
+    for (i = 0; i < subscribers->count; i++)
+    {
+        if (subscribers->channels[i] == subscriber)
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+Replaces the subscriber list of a topic channel under the slot's write_lock, so that writers see the old or the new one.
+The old list is freed after an RCU grace period, the references it held are the caller's to move or drop.
+*/
+static inline void replace_message_subscribers(single_message_channel *topic, message_subscribers *old_subscribers, message_subscribers *new_subscribers)
+{
+    long charge;
+
+    spin_lock(&topic->slot->write_lock);
+    rcu_assign_pointer(topic->subscribers, new_subscribers);
+    spin_unlock(&topic->slot->write_lock);
+    charge = new_subscribers == NULL ? 0 : struct_size(new_subscribers, channels, new_subscribers->count);
+    if (old_subscribers != NULL)
+    {
+        charge -= struct_size(old_subscribers, channels, old_subscribers->count);
+        kvfree_rcu(old_subscribers, rcu);
+    }
+    charge_message_slot_memory(topic->slot, charge);
+}
+
+/*
+Subscribes a channel to a topic channel of the same slot, so every later message of the topic is also published to it.
+Fan-out is one level deep, the subscribers of the subscriber don't get the topic's messages.
+Must be called with the slot's subscribers_lock held.
+Returns SUCCESS, -EEXIST if the channel is already subscribed, -ENOSPC if the topic has MSG_SLOT_MAX_SUBSCRIBERS, or -ENOMEM.
+*/
+static inline int subscribe_single_message_channel(single_message_channel *topic, single_message_channel *subscriber)
+{
+    message_subscribers *old_subscribers;
+    message_subscribers *new_subscribers;
+    unsigned int count;
+
+    old_subscribers = rcu_dereference_protected(topic->subscribers, lockdep_is_held(&topic->slot->subscribers_lock));
+    count = 0;
+    if (old_subscribers != NULL)
+    {
+        count = old_subscribers->count;
+        if (find_message_subscriber(old_subscribers, subscriber) != count)
+        {
+            return -EEXIST;
+        }
+    }
+    if (count == MSG_SLOT_MAX_SUBSCRIBERS)
+    {
+        return -ENOSPC;
+    }
+    new_subscribers = (message_subscribers*)kvmalloc(struct_size(new_subscribers, channels, count + 1), GFP_KERNEL_ACCOUNT);
+    if (new_subscribers == NULL)
+    {
+        return -ENOMEM;
+    }
+    if (count != 0)
+    {
+        memcpy(new_subscribers->channels, old_subscribers->channels, count * sizeof(single_message_channel*));
+    }
+    kref_get(&subscriber->refcount); /*The reference of the new list, the others move over from the old one*/
+    new_subscribers->channels[count] = subscriber;
+    new_subscribers->count = count + 1;
+    replace_message_subscribers(topic, old_subscribers, new_subscribers);
+    return SUCCESS;
+}
+
+/*
+Unsubscribes a channel from a topic channel, it gets no more messages of the topic.
+Must be called with the slot's subscribers_lock held.
+Returns SUCCESS, -EINVAL if the channel is not subscribed, or -ENOMEM.
+*/
+static inline int unsubscribe_single_message_channel(single_message_channel *topic, single_message_channel *subscriber)
+{
+    message_subscribers *old_subscribers;
+    message_subscribers *new_subscribers;
+    unsigned int position;
+
+    old_subscribers = rcu_dereference_protected(topic->subscribers, lockdep_is_held(&topic->slot->subscribers_lock));
+    if (old_subscribers == NULL)
+    {
+        return -EINVAL;
+    }
+    position = find_message_subscriber(old_subscribers, subscriber);
+    if (position == old_subscribers->count)
+    {
+        return -EINVAL;
+    }
+    new_subscribers = NULL;
+    if (old_subscribers->count > 1)
+    {
+        new_subscribers = (message_subscribers*)kvmalloc(struct_size(new_subscribers, channels, old_subscribers->count - 1), GFP_KERNEL_ACCOUNT);
+        if (new_subscribers == NULL)
+        {
+            return -ENOMEM;
+        }
+        memcpy(new_subscribers->channels, old_subscribers->channels, position * sizeof(single_message_channel*));
+        memcpy(new_subscribers->channels + position, old_subscribers->channels + position + 1,
+               (old_subscribers->count - position - 1) * sizeof(single_message_channel*));
+        new_subscribers->count = old_subscribers->count - 1;
+    }
+    replace_message_subscribers(topic, old_subscribers, new_subscribers);
+    put_single_message_channel(subscriber); /*The reference of the old list*/
+    return SUCCESS;
+}
+
+/*
+STATISTICS FUNCTIONS
+*/
+/*Counts the result of a read in the per CPU counters of a slot*/
+static inline void count_message_read(message_slot_stats __percpu *stats, long read_ret)
+{
+    if (read_ret > 0)
+    {
+        this_cpu_inc(stats->reads);
+        this_cpu_add(stats->read_bytes, read_ret);
+    }
+    else if (read_ret == -EWOULDBLOCK)
+    {
+        this_cpu_inc(stats->read_misses);
+    }
+    else if (read_ret == -ENOSPC)
+    {
+        this_cpu_inc(stats->no_space_errors);
+    }
+}
+
+/*Counts the result of a write in the per CPU counters of a slot*/
+static inline void count_message_write(message_slot_stats __percpu *stats, long write_ret)
+{
+    if (write_ret > 0)
+    {
+        this_cpu_inc(stats->writes);
+        this_cpu_add(stats->write_bytes, write_ret);
+    }
+    else if (write_ret == -EMSGSIZE)
+    {
+        this_cpu_inc(stats->message_size_errors);
+    }
+}
+
+/*Counts the result of a read of a channel in the statistics of the channel and of its slot*/
+static inline void account_message_read(single_message_channel *current_single_message_channel, long read_ret)
+{
+    if (read_ret > 0)
+    {
+        atomic64_inc(&current_single_message_channel->stats.reads);
+        atomic64_add(read_ret, &current_single_message_channel->stats.read_bytes);
+    }
+    else if (read_ret == -EWOULDBLOCK)
+    {
+        atomic64_inc(&current_single_message_channel->stats.read_misses);
+    }
+    else if (read_ret == -ENOSPC)
+    {
+        atomic64_inc(&current_single_message_channel->stats.no_space_errors);
+    }
+    count_message_read(current_single_message_channel->slot->stats, read_ret);
+}
+
+/*Counts the result of a write to a channel in the statistics of the channel and of its slot*/
+static inline void account_message_write(single_message_channel *current_single_message_channel, long write_ret)
+{
+    if (write_ret > 0)
+    {
+        atomic64_inc(&current_single_message_channel->stats.writes);
+        atomic64_add(write_ret, &current_single_message_channel->stats.write_bytes);
+    }
+    else if (write_ret == -EMSGSIZE)
+    {
+        atomic64_inc(&current_single_message_channel->stats.message_size_errors);
+    }
+    count_message_write(current_single_message_channel->slot->stats, write_ret);
+}
+
+/*
+MESSAGE FUNCTIONS
+*/
+/*
+Gives a payload the next sequence of its slot and its write time, before it is published.
+Must be called with the slot's write_lock held.
+*/
+static inline void stamp_message_payload(message_slot *current_message_slot, message_payload *payload)
+{
+    payload->message_sequence = ++current_message_slot->message_sequence;
+    payload->timestamp_ns = ktime_get_real_ns();
+}
+
+/*Replaces the last message of a channel by a stamped payload, taking over a reference on it*/
+static inline void replace_message_payload(single_message_channel *current_single_message_channel, message_payload *payload)
+{
+    message_payload *old_payload;
+    long charge;
+
+    old_payload = rcu_replace_pointer(current_single_message_channel->payload, payload,
+                                      lockdep_is_held(&current_single_message_channel->slot->write_lock));
+    WRITE_ONCE(current_single_message_channel->message_sequence, payload->message_sequence);
+    charge = hold_message_payload(payload);
+    if (old_payload != NULL)
+    {
+        charge -= release_message_payload(old_payload);
+    }
+    if (charge != 0)
+    {
+        /*messages of the same size class replace each other without touching the shared counters*/
+        charge_message_slot_memory(current_single_message_channel->slot, charge);
+    }
+    /*readers that still copy the old payload hold RCU or a reference on it*/
+    put_message_payload(old_payload);
+}
+
+/*Appends a stamped payload to the queue of a channel in queue mode, taking over a reference on it. The queue must not be full*/
+static inline void append_queued_message(single_message_channel *current_single_message_channel, message_payload *payload)
+{
+    unsigned int tail;
+    long charge;
+
+    tail = (current_single_message_channel->queue_head + current_single_message_channel->queue_count) % current_single_message_channel->queue_depth;
+    current_single_message_channel->queue[tail] = payload;
+    WRITE_ONCE(current_single_message_channel->queue_count, current_single_message_channel->queue_count + 1);
+    WRITE_ONCE(current_single_message_channel->message_sequence, payload->message_sequence);
+    charge = hold_message_payload(payload);
+    if (charge != 0)
+    {
+        charge_message_slot_memory(current_single_message_channel->slot, charge);
+    }
+}
+
+/*
+Publishes a stamped payload to the subscribers of a channel, each one takes its own reference on the shared payload,
+which is charged to the slot only once.
+A subscriber in queue mode whose queue is full misses the message, a topic write never waits for a subscriber.
+Must be called with the slot's write_lock held.
+*/
+static inline void publish_to_subscribers(single_message_channel *current_single_message_channel, message_payload *payload)
+{
+    message_subscribers *subscribers;
+    single_message_channel *subscriber;
+    unsigned int i;
+
+    subscribers = rcu_dereference_protected(current_single_message_channel->subscribers,
+                                            lockdep_is_held(&current_single_message_channel->slot->write_lock));
+    if (subscribers == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < subscribers->count; i++)
+    {
+        subscriber = subscribers->channels[i];
+        if (subscriber->queue_depth == 0)
+        {
+            refcount_inc(&payload->refcount);
+            replace_message_payload(subscriber, payload);
+        }
+        else if (subscriber->queue_count < subscriber->queue_depth)
+        {
+            refcount_inc(&payload->refcount);
+            append_queued_message(subscriber, payload);
+        }
+    }
+}
+
+/*
+Replaces the last message of a channel in last message mode, taking over the caller's payload reference.
+The subscribers of the channel get the same payload.
+Must be called with the slot's write_lock held, lock-free readers see either the old or the new payload.
+*/
+static inline void publish_message_payload(single_message_channel *current_single_message_channel, message_payload *payload)
+{
+    stamp_message_payload(current_single_message_channel->slot, payload);
+    publish_to_subscribers(current_single_message_channel, payload);
+    replace_message_payload(current_single_message_channel, payload);
+}
+
+/*
+Appends a message to the queue of a channel in queue mode, taking over the caller's payload reference.
+The subscribers of the channel get the same payload.
+The queue must not be full. Must be called with the slot's write_lock held.
+*/
+static inline void push_queued_message(single_message_channel *current_single_message_channel, message_payload *payload)
+{
+    stamp_message_payload(current_single_message_channel->slot, payload);
+    publish_to_subscribers(current_single_message_channel, payload);
+    append_queued_message(current_single_message_channel, payload);
+}
+
+/*
+Restores a message of a snapshot to a channel, taking over the caller's payload reference on success.
+The payload keeps its sequence and write time from the snapshot, and the slot's sequence moves past it,
+so the messages written after the restore are newer. Subscribers don't get the message, they have their own records.
+Must be called with the slot's write_lock held.
+Returns SUCCESS, -EEXIST if the channel already has this message or a newer one, or -EAGAIN if its queue is full.
+*/
+static inline int restore_message_payload(single_message_channel *current_single_message_channel, message_payload *payload)
+{
+    message_slot *current_message_slot;
+
+    current_message_slot = current_single_message_channel->slot;
+    if (payload->message_sequence <= current_single_message_channel->message_sequence)
+    {
+        return -EEXIST;
+    }
+    if (current_single_message_channel->queue_depth != 0)
+    {
+        if (current_single_message_channel->queue_count == current_single_message_channel->queue_depth)
+        {
+            /*The queue is full*/
+            return -EAGAIN;
+        }
+        append_queued_message(current_single_message_channel, payload);
+    }
+    else
+    {
+        replace_message_payload(current_single_message_channel, payload);
+    }
+    if (current_message_slot->message_sequence < payload->message_sequence)
+    {
+        current_message_slot->message_sequence = payload->message_sequence;
+    }
+    return SUCCESS;
+}
+
+/*
+Removes the oldest message from the queue of a channel in queue mode, the queue must not be empty.
+Must be called with the slot's write_lock held.
+Returns the payload of the message, its reference now belongs to the caller.
+*/
+static inline message_payload* pop_queued_message(single_message_channel *current_single_message_channel)
+{
+    message_payload *payload;
+    long charge;
+
+    payload = current_single_message_channel->queue[current_single_message_channel->queue_head];
+    current_single_message_channel->queue_head = (current_single_message_channel->queue_head + 1) % current_single_message_channel->queue_depth;
+    WRITE_ONCE(current_single_message_channel->queue_count, current_single_message_channel->queue_count - 1);
+    charge = release_message_payload(payload);
+    if (charge != 0)
+    {
+        charge_message_slot_memory(current_single_message_channel->slot, -charge);
+    }
+    return payload;
+}
+
+#endif /*MESSAGE_SLOT_CORE_H*/
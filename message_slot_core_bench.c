@@ -0,0 +1,479 @@
+#include "message_slot_core.h"
+
+#include <time.h> /*For clock_gettime*/
+
+/*
+Microbenchmarks of the message store, built in user space on top of message_slot_shim.h.
+Every benchmark is run with a doubling number of iterations until it runs for at least the minimal time,
+and its time per iteration is printed in the style of Google Benchmark.
+The channel index, the payload size classes and the publish path are the module's own code,
+the allocator and RCU are the shim's, so the numbers track the data structures rather than the kernel.
+*/
+
+/*The state of a benchmark, prepared once before its timed runs*/
+typedef struct bench_state {
+    message_slot *slot; /*The slot of the benchmark*/
+    unsigned int channel_count; /*The number of channels in the slot*/
+    unsigned int *channel_ids; /*The IDs of the channels, in a random order*/
+    unsigned int message_size; /*The size of the messages*/
+    char *message_buffer; /*The source and destination of the message copies*/
+    single_message_channel *channel; /*The channel of the single channel benchmarks*/
+} bench_state;
+
+/*A benchmark: a setup, a loop of iterations, and a teardown*/
+typedef struct bench_case {
+    const char *name; /*The name of the benchmark*/
+    unsigned int argument; /*The channel count or the message size*/
+    void (*setup)(bench_state *state, unsigned int argument);
+    void (*run)(bench_state *state, unsigned long iterations);
+    void (*teardown)(bench_state *state);
+} bench_case;
+
+static volatile unsigned long bench_sink; /*Keeps the results of the loops alive*/
+static double minimal_seconds = 0.2;
+
+/*Returns the time of the monotonic clock in nanoseconds*/
+static u64 now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*A xorshift64 generator, so the IDs are the same on every run*/
+static u64 next_random(u64 *random_state)
+{
+    *random_state ^= *random_state << 13;
+    *random_state ^= *random_state >> 7;
+    *random_state ^= *random_state << 17;
+    return *random_state;
+}
+
+/*Exits when the store runs out of memory, the numbers would be meaningless*/
+static void *checked(void *pointer)
+{
+    if (pointer == NULL || IS_ERR(pointer))
+    {
+        fprintf(stderr, "Failed to allocate memory for the benchmark\n");
+        exit(1);
+    }
+    return pointer;
+}
+
+/*
+SETUP FUNCTIONS
+*/
+/*Creates a slot with argument channels of random IDs*/
+static void setup_channels(bench_state *state, unsigned int channel_count)
+{
+    u64 random_state;
+    unsigned int i;
+
+    random_state = 0x2545F4914F6CDD1DULL;
+    state->slot = (message_slot*)checked(alloc_message_slot(0, MAX_MESSAGE_SIZE_LIMIT));
+    state->channel_count = channel_count;
+    state->channel_ids = (unsigned int*)checked(malloc(channel_count * sizeof(unsigned int)));
+    for (i = 0; i < channel_count; i++)
+    {
+        /*odd IDs exist, so even IDs are misses*/
+        state->channel_ids[i] = ((unsigned int)next_random(&random_state) & 0x7FFFFFFE) | 1;
+        put_single_message_channel((single_message_channel*)checked(find_or_create_single_message_channel(state->slot, state->channel_ids[i])));
+    }
+}
+
+/*Creates an empty slot, the channels are inserted by the benchmark*/
+static void setup_empty_slot(bench_state *state, unsigned int channel_count)
+{
+    u64 random_state;
+    unsigned int i;
+
+    random_state = 0x2545F4914F6CDD1DULL;
+    state->slot = (message_slot*)checked(alloc_message_slot(0, MAX_MESSAGE_SIZE_LIMIT));
+    state->channel_count = channel_count;
+    state->channel_ids = (unsigned int*)checked(malloc(channel_count * sizeof(unsigned int)));
+    for (i = 0; i < channel_count; i++)
+    {
+        state->channel_ids[i] = ((unsigned int)next_random(&random_state) & 0x7FFFFFFE) | 1;
+    }
+}
+
+/*Creates a slot with one channel and a message buffer of argument bytes*/
+static void setup_message(bench_state *state, unsigned int message_size)
+{
+    message_payload *payload;
+
+    state->slot = (message_slot*)checked(alloc_message_slot(0, MAX_MESSAGE_SIZE_LIMIT));
+    state->channel_ids = NULL;
+    state->channel = (single_message_channel*)checked(find_or_create_single_message_channel(state->slot, 1));
+    state->message_size = message_size;
+    state->message_buffer = (char*)checked(malloc(message_size));
+    memset(state->message_buffer, 'm', message_size);
+    payload = (message_payload*)checked(alloc_message_payload(message_size));
+    memcpy(payload->message, state->message_buffer, message_size);
+    spin_lock(&state->slot->write_lock);
+    publish_message_payload(state->channel, payload);
+    spin_unlock(&state->slot->write_lock);
+}
+
+/*Like setup_message, with the channel in queue mode*/
+static void setup_queue(bench_state *state, unsigned int queue_depth)
+{
+    setup_message(state, 64);
+    state->channel->queue = (message_payload**)checked(kvmalloc_array(queue_depth, sizeof(message_payload*), GFP_KERNEL));
+    state->channel->queue_depth = queue_depth;
+    charge_message_slot_memory(state->slot, queue_depth * sizeof(message_payload*));
+}
+
+static void teardown(bench_state *state)
+{
+    if (state->channel != NULL)
+    {
+        put_single_message_channel(state->channel);
+        state->channel = NULL;
+    }
+    free_message_slot(state->slot);
+    free(state->channel_ids);
+    free(state->message_buffer);
+    state->channel_ids = NULL;
+    state->message_buffer = NULL;
+}
+
+/*
+Creates a slot with a topic channel, argument channels subscribed to it, and a 1024 byte message buffer.
+The subscribers are the IDs from 2, so run_fanout_loop can write to each of them instead.
+*/
+static void setup_fanout(bench_state *state, unsigned int subscriber_count)
+{
+    single_message_channel *subscriber;
+    unsigned int i;
+
+    setup_message(state, 1024);
+    state->channel_count = subscriber_count;
+    mutex_lock(&state->slot->subscribers_lock);
+    for (i = 0; i < subscriber_count; i++)
+    {
+        subscriber = (single_message_channel*)checked(find_or_create_single_message_channel(state->slot, i + 2));
+        if (subscribe_single_message_channel(state->channel, subscriber) != SUCCESS)
+        {
+            checked(NULL);
+        }
+        put_single_message_channel(subscriber);
+    }
+    mutex_unlock(&state->slot->subscribers_lock);
+}
+
+/*Orders channel IDs for qsort*/
+static int compare_channel_ids(const void *first, const void *second)
+{
+    unsigned int first_id = *(const unsigned int*)first;
+    unsigned int second_id = *(const unsigned int*)second;
+    return (first_id > second_id) - (first_id < second_id);
+}
+
+/*Like setup_empty_slot, with a 64 byte message to restore to every channel, in the ID order of a snapshot*/
+static void setup_restore(bench_state *state, unsigned int channel_count)
+{
+    setup_empty_slot(state, channel_count);
+    qsort(state->channel_ids, channel_count, sizeof(unsigned int), compare_channel_ids);
+    state->message_size = 64;
+    state->message_buffer = (char*)checked(malloc(state->message_size));
+    memset(state->message_buffer, 'm', state->message_size);
+}
+
+/*Like setup_restore, with the consecutive IDs 1 to argument, which share the nodes of the channel index*/
+static void setup_restore_dense(bench_state *state, unsigned int channel_count)
+{
+    unsigned int i;
+
+    setup_restore(state, channel_count);
+    for (i = 0; i < channel_count; i++)
+    {
+        state->channel_ids[i] = i + 1;
+    }
+}
+
+/*
+Creates an empty slot with a budget of argument channels holding a 64 byte message each.
+The random IDs of the storm are drawn during the run, so it never runs out of new ones.
+*/
+static void setup_storm(bench_state *state, unsigned int channel_budget)
+{
+    state->slot = (message_slot*)checked(alloc_message_slot(0, MAX_MESSAGE_SIZE_LIMIT));
+    state->channel_count = channel_budget;
+    state->message_size = 64;
+    slot_memory_limit = channel_budget * (sizeof(struct single_message_channel) + MESSAGE_PAYLOAD_MIN_SIZE * 2);
+}
+
+/*Checks that the storm stayed within the budget, the slot may exceed it by one channel and its message*/
+static void teardown_storm(bench_state *state)
+{
+    long memory_bytes;
+
+    memory_bytes = atomic_long_read(&state->slot->memory_bytes);
+    if (memory_bytes > (long)(slot_memory_limit + sizeof(struct single_message_channel) + MESSAGE_PAYLOAD_MIN_SIZE * 2))
+    {
+        fprintf(stderr, "The slot holds %ld bytes, over its budget of %lu bytes\n", memory_bytes, slot_memory_limit);
+        exit(1);
+    }
+    slot_memory_limit = 0;
+    teardown(state);
+}
+
+/*
+BENCHMARK LOOPS
+*/
+/*Looks up existing channels in a random order*/
+static void run_lookup_hit(bench_state *state, unsigned long iterations)
+{
+    single_message_channel *current_single_message_channel;
+    unsigned long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        current_single_message_channel = find_single_message_channel(state->slot, state->channel_ids[i % state->channel_count]);
+        bench_sink += current_single_message_channel->message_channel_ID;
+        put_single_message_channel(current_single_message_channel);
+    }
+}
+
+/*Looks up IDs that have no channel, next to the existing ones*/
+static void run_lookup_miss(bench_state *state, unsigned long iterations)
+{
+    unsigned long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        bench_sink += (unsigned long)find_single_message_channel(state->slot, state->channel_ids[i % state->channel_count] - 1);
+    }
+}
+
+/*Inserts channels into the slot, the slot is emptied every channel_count insertions*/
+static void run_insert(bench_state *state, unsigned long iterations)
+{
+    unsigned long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        if (i % state->channel_count == 0 && i != 0)
+        {
+            free_message_slot(state->slot);
+            state->slot = (message_slot*)checked(alloc_message_slot(0, MAX_MESSAGE_SIZE_LIMIT));
+        }
+        put_single_message_channel((single_message_channel*)checked(find_or_create_single_message_channel(state->slot, state->channel_ids[i % state->channel_count])));
+    }
+}
+
+/*The write path: a payload of the size class of the message, the copy into it, and its publication*/
+static void run_publish(bench_state *state, unsigned long iterations)
+{
+    message_payload *payload;
+    unsigned long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        payload = (message_payload*)checked(alloc_message_payload(state->message_size));
+        memcpy(payload->message, state->message_buffer, state->message_size);
+        spin_lock(&state->slot->write_lock);
+        publish_message_payload(state->channel, payload);
+        spin_unlock(&state->slot->write_lock);
+    }
+}
+
+/*The read path: the current payload under RCU and the copy out of it*/
+static void run_read_copy(bench_state *state, unsigned long iterations)
+{
+    message_payload *payload;
+    unsigned long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        rcu_read_lock();
+        payload = rcu_dereference(state->channel->payload);
+        memcpy(state->message_buffer, payload->message, payload->message_length);
+        rcu_read_unlock();
+        bench_sink += state->message_buffer[0];
+    }
+}
+
+/*Counts a read in the statistics of a channel and of its slot, the accounting that every read and write adds*/
+static void run_stats_account(bench_state *state, unsigned long iterations)
+{
+    unsigned long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        account_message_read(state->channel, state->message_size);
+    }
+    bench_sink += atomic64_read(&state->channel->stats.reads);
+}
+
+/*A write storm to random channel IDs, every new channel evicts an idle one once the slot is at its budget*/
+static void run_storm(bench_state *state, unsigned long iterations)
+{
+    single_message_channel *current_single_message_channel;
+    message_payload *payload;
+    static u64 random_state = 0x2545F4914F6CDD1DULL;
+    unsigned long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        current_single_message_channel = (single_message_channel*)checked(find_or_create_single_message_channel(state->slot, ((unsigned int)next_random(&random_state) & 0x7FFFFFFE) | 1));
+        payload = (message_payload*)checked(alloc_message_payload(state->message_size));
+        spin_lock(&state->slot->write_lock);
+        publish_message_payload(current_single_message_channel, payload);
+        spin_unlock(&state->slot->write_lock);
+        put_single_message_channel(current_single_message_channel);
+    }
+}
+
+/*A message written once to a topic channel, its subscribers share the payload*/
+static void run_fanout(bench_state *state, unsigned long iterations)
+{
+    run_publish(state, iterations);
+}
+
+/*The same message written to every subscriber on its own, a payload and a copy each, as a sender loop would*/
+static void run_fanout_loop(bench_state *state, unsigned long iterations)
+{
+    single_message_channel *current_single_message_channel;
+    message_payload *payload;
+    unsigned long i;
+    unsigned int j;
+
+    for (i = 0; i < iterations; i++)
+    {
+        for (j = 0; j < state->channel_count; j++)
+        {
+            current_single_message_channel = find_single_message_channel(state->slot, j + 2);
+            payload = (message_payload*)checked(alloc_message_payload(state->message_size));
+            memcpy(payload->message, state->message_buffer, state->message_size);
+            spin_lock(&state->slot->write_lock);
+            publish_message_payload(current_single_message_channel, payload);
+            spin_unlock(&state->slot->write_lock);
+            put_single_message_channel(current_single_message_channel);
+        }
+    }
+}
+
+/*
+The restore of a snapshot: a channel created for every record and its message restored with its sequence.
+The slot is emptied every channel_count records, like a module that was reloaded.
+*/
+static void run_restore(bench_state *state, unsigned long iterations)
+{
+    single_message_channel *current_single_message_channel;
+    message_payload *payload;
+    static u64 message_sequence;
+    unsigned long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        if (i % state->channel_count == 0 && i != 0)
+        {
+            free_message_slot(state->slot);
+            state->slot = (message_slot*)checked(alloc_message_slot(0, MAX_MESSAGE_SIZE_LIMIT));
+        }
+        current_single_message_channel = (single_message_channel*)checked(find_or_create_single_message_channel(state->slot, state->channel_ids[i % state->channel_count]));
+        payload = (message_payload*)checked(alloc_message_payload(state->message_size));
+        memcpy(payload->message, state->message_buffer, state->message_size);
+        payload->message_sequence = ++message_sequence;
+        spin_lock(&state->slot->write_lock);
+        if (restore_message_payload(current_single_message_channel, payload) != SUCCESS)
+        {
+            put_message_payload(payload);
+        }
+        spin_unlock(&state->slot->write_lock);
+        put_single_message_channel(current_single_message_channel);
+    }
+}
+
+/*Queue mode: a message pushed and popped, without the copies*/
+static void run_queue_push_pop(bench_state *state, unsigned long iterations)
+{
+    message_payload *payload;
+    unsigned long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        payload = (message_payload*)checked(alloc_message_payload(state->message_size));
+        spin_lock(&state->slot->write_lock);
+        push_queued_message(state->channel, payload);
+        payload = pop_queued_message(state->channel);
+        spin_unlock(&state->slot->write_lock);
+        put_message_payload(payload);
+    }
+}
+
+static const bench_case bench_cases[] = {
+    {"channel_lookup_hit", 1, setup_channels, run_lookup_hit, teardown},
+    {"channel_lookup_hit", 64, setup_channels, run_lookup_hit, teardown},
+    {"channel_lookup_hit", 4096, setup_channels, run_lookup_hit, teardown},
+    {"channel_lookup_hit", 262144, setup_channels, run_lookup_hit, teardown},
+    {"channel_lookup_miss", 4096, setup_channels, run_lookup_miss, teardown},
+    {"channel_insert", 64, setup_empty_slot, run_insert, teardown},
+    {"channel_insert", 4096, setup_empty_slot, run_insert, teardown},
+    {"channel_insert", 262144, setup_empty_slot, run_insert, teardown},
+    {"channel_storm", 1024, setup_storm, run_storm, teardown_storm},
+    {"channel_storm", 65536, setup_storm, run_storm, teardown_storm},
+    {"publish", 16, setup_message, run_publish, teardown},
+    {"publish", 128, setup_message, run_publish, teardown},
+    {"publish", 4096, setup_message, run_publish, teardown},
+    {"publish", 65536, setup_message, run_publish, teardown},
+    {"read_copy", 16, setup_message, run_read_copy, teardown},
+    {"read_copy", 128, setup_message, run_read_copy, teardown},
+    {"read_copy", 4096, setup_message, run_read_copy, teardown},
+    {"read_copy", 65536, setup_message, run_read_copy, teardown},
+    {"stats_account", 128, setup_message, run_stats_account, teardown},
+    {"fanout", 16, setup_fanout, run_fanout, teardown},
+    {"fanout", 64, setup_fanout, run_fanout, teardown},
+    {"fanout_loop", 16, setup_fanout, run_fanout_loop, teardown},
+    {"fanout_loop", 64, setup_fanout, run_fanout_loop, teardown},
+    {"restore", 1048576, setup_restore, run_restore, teardown},
+    {"restore_dense", 1048576, setup_restore_dense, run_restore, teardown},
+    {"queue_push_pop", 64, setup_queue, run_queue_push_pop, teardown},
+};
+
+int main(int argc, char *argv[])
+{
+    bench_state state;
+    const bench_case *current_case;
+    char case_name[64];
+    unsigned long iterations;
+    unsigned int i;
+    u64 start;
+    u64 elapsed;
+
+    if (argc > 2 || (argc == 2 && (minimal_seconds = strtod(argv[1], NULL)) <= 0))
+    {
+        fprintf(stderr, "Usage: %s [minimal seconds per benchmark]\n", argv[0]);
+        exit(1);
+    }
+    if (create_message_slot_caches() != SUCCESS)
+    {
+        exit(1);
+    }
+    memset(&state, 0, sizeof(state));
+    printf("%-32s %14s %14s\n", "Benchmark", "Time (ns)", "Iterations");
+    for (i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++)
+    {
+        current_case = &bench_cases[i];
+        current_case->setup(&state, current_case->argument);
+        /*warm up, then double the iterations until the run is long enough to time*/
+        current_case->run(&state, 1);
+        for (iterations = 1;; iterations *= 2)
+        {
+            start = now_ns();
+            current_case->run(&state, iterations);
+            elapsed = now_ns() - start;
+            if (elapsed >= minimal_seconds * 1e9 || iterations >= (1UL << 40))
+            {
+                break;
+            }
+        }
+        current_case->teardown(&state);
+        snprintf(case_name, sizeof(case_name), "%s/%u", current_case->name, current_case->argument);
+        printf("%-32s %14.1f %14lu\n", case_name, (double)elapsed / iterations, iterations);
+    }
+    destroy_message_slot_caches();
+    exit(0);
+}
@@ -0,0 +1,459 @@
+#include "message_slot_core.h"
+
+#include <pthread.h> /*For the threads of the creation race*/
+
+/*
+Unit tests of the message store, built in user space on top of message_slot_shim.h like message_slot_core_bench.c.
+Every test builds its own slot, checks the channel index, the payloads, the queues, the memory budgets and the
+subscriptions through the functions of message_slot_core.h, and frees the slot again.
+The program prints a line for every failed check and exits with 1 if any check failed.
+*/
+
+static unsigned int failed_checks;
+
+/*Counts and prints a failed check, the test continues so one run reports every failure*/
+#define CHECK(condition)                                                               \
+    do                                                                                 \
+    {                                                                                  \
+        if (!(condition))                                                              \
+        {                                                                              \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #condition); \
+            failed_checks++;                                                           \
+        }                                                                              \
+    } while (0)
+
+/*Exits when the store runs out of memory, the tests cannot go on*/
+static void *checked(void *pointer)
+{
+    if (pointer == NULL || IS_ERR(pointer))
+    {
+        fprintf(stderr, "Failed to allocate memory for the test\n");
+        exit(1);
+    }
+    return pointer;
+}
+
+/*Returns a payload holding a message of the given text*/
+static message_payload *make_payload(const char *message)
+{
+    message_payload *payload;
+
+    payload = (message_payload*)checked(alloc_message_payload(strlen(message)));
+    memcpy(payload->message, message, strlen(message));
+    return payload;
+}
+
+/*Publishes a message to a channel in last message mode or queue mode, like a write*/
+static void write_message(single_message_channel *current_single_message_channel, const char *message)
+{
+    spin_lock(&current_single_message_channel->slot->write_lock);
+    if (current_single_message_channel->queue_depth != 0)
+    {
+        push_queued_message(current_single_message_channel, make_payload(message));
+    }
+    else
+    {
+        publish_message_payload(current_single_message_channel, make_payload(message));
+    }
+    spin_unlock(&current_single_message_channel->slot->write_lock);
+}
+
+/*Returns whether the last message of a channel is the given text*/
+static bool has_message(single_message_channel *current_single_message_channel, const char *message)
+{
+    message_payload *payload;
+
+    payload = rcu_dereference(current_single_message_channel->payload);
+    return payload != NULL && payload->message_length == strlen(message) && memcmp(payload->message, message, payload->message_length) == 0;
+}
+
+/*Returns the reference count of a channel*/
+static unsigned int channel_refs(single_message_channel *current_single_message_channel)
+{
+    return kref_read(&current_single_message_channel->refcount);
+}
+
+/*
+CHANNEL INDEX TESTS
+*/
+/*A lookup finds only the channels that were created, and takes a reference on them*/
+static void test_lookup(void)
+{
+    message_slot *current_message_slot;
+    single_message_channel *created;
+    single_message_channel *found;
+
+    current_message_slot = (message_slot*)checked(alloc_message_slot(0, MAX_ZISE_BUFFER));
+    CHECK(find_single_message_channel(current_message_slot, 7) == NULL);
+    created = (single_message_channel*)checked(find_or_create_single_message_channel(current_message_slot, 7));
+    CHECK(created->message_channel_ID == 7);
+    CHECK(channel_refs(created) == 2); /*the index and the caller*/
+    found = find_single_message_channel(current_message_slot, 7);
+    CHECK(found == created);
+    CHECK(channel_refs(created) == 3);
+    CHECK(find_single_message_channel(current_message_slot, 8) == NULL);
+    CHECK(find_or_create_single_message_channel(current_message_slot, 7) == created);
+    CHECK(atomic_read(&current_message_slot->channel_count) == 1);
+    put_single_message_channel(created);
+    put_single_message_channel(found);
+    put_single_message_channel(created);
+    CHECK(channel_refs(created) == 1);
+    free_message_slot(current_message_slot);
+}
+
+/*The arguments of a thread of the creation race*/
+typedef struct creation_race {
+    message_slot *slot; /*The slot both threads create the channels in*/
+    single_message_channel **channels; /*The channel that the thread got for every ID*/
+} creation_race;
+
+#define CREATION_RACE_CHANNELS 4096
+
+/*Creates the channels of the race, the IDs are the same in both threads*/
+static void *run_creation_race(void *argument)
+{
+    creation_race *race;
+    unsigned int i;
+
+    race = (creation_race*)argument;
+    for (i = 0; i < CREATION_RACE_CHANNELS; i++)
+    {
+        race->channels[i] = (single_message_channel*)checked(find_or_create_single_message_channel(race->slot, i + 1));
+    }
+    return NULL;
+}
+
+/*
+Two threads that create the same channels at once get the same channel for every ID, and the index has each once.
+No channel is freed during the race, which the shim's immediate call_rcu could not run concurrently with lookups.
+*/
+static void test_create_race(void)
+{
+    creation_race races[2];
+    pthread_t threads[2];
+    message_slot *current_message_slot;
+    unsigned int i;
+
+    current_message_slot = (message_slot*)checked(alloc_message_slot(0, MAX_ZISE_BUFFER));
+    for (i = 0; i < 2; i++)
+    {
+        races[i].slot = current_message_slot;
+        races[i].channels = (single_message_channel**)checked(calloc(CREATION_RACE_CHANNELS, sizeof(single_message_channel*)));
+        pthread_create(&threads[i], NULL, run_creation_race, &races[i]);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < CREATION_RACE_CHANNELS; i++)
+    {
+        CHECK(races[0].channels[i] == races[1].channels[i]);
+        CHECK(channel_refs(races[0].channels[i]) == 3);
+        put_single_message_channel(races[0].channels[i]);
+        put_single_message_channel(races[1].channels[i]);
+    }
+    CHECK(atomic_read(&current_message_slot->channel_count) == CREATION_RACE_CHANNELS);
+    CHECK(atomic_long_read(&current_message_slot->memory_bytes) == CREATION_RACE_CHANNELS * (long)sizeof(struct single_message_channel));
+    free(races[0].channels);
+    free(races[1].channels);
+    free_message_slot(current_message_slot);
+}
+
+/*A channel claimed for eviction but not erased yet is replaced by a new channel of its ID, which the eviction then keeps*/
+static void test_create_replaces_dying_channel(void)
+{
+    message_slot *current_message_slot;
+    single_message_channel *dying;
+    single_message_channel *created;
+
+    current_message_slot = (message_slot*)checked(alloc_message_slot(0, MAX_ZISE_BUFFER));
+    dying = (single_message_channel*)checked(find_or_create_single_message_channel(current_message_slot, 3));
+    put_single_message_channel(dying);
+    CHECK(claim_idle_single_message_channel(dying));
+    CHECK(find_single_message_channel(current_message_slot, 3) == NULL);
+    created = (single_message_channel*)checked(find_or_create_single_message_channel(current_message_slot, 3));
+    CHECK(created != dying);
+    CHECK(xa_load(&current_message_slot->channels, 3) == created);
+    remove_single_message_channel(current_message_slot, dying);
+    CHECK(xa_load(&current_message_slot->channels, 3) == created);
+    CHECK(atomic_read(&current_message_slot->channel_count) == 1);
+    CHECK(atomic_long_read(&current_message_slot->memory_bytes) == (long)sizeof(struct single_message_channel));
+    put_single_message_channel(created);
+    free_message_slot(current_message_slot);
+}
+
+/*
+MESSAGE TESTS
+*/
+/*A write replaces the last message of a channel, gives it the next sequence of the slot and charges only the new message*/
+static void test_payload_replace(void)
+{
+    message_slot *current_message_slot;
+    single_message_channel *current_single_message_channel;
+    message_payload *first;
+    long channel_memory;
+
+    current_message_slot = (message_slot*)checked(alloc_message_slot(0, MAX_ZISE_BUFFER));
+    current_single_message_channel = (single_message_channel*)checked(find_or_create_single_message_channel(current_message_slot, 1));
+    channel_memory = atomic_long_read(&current_message_slot->memory_bytes);
+    write_message(current_single_message_channel, "first");
+    first = rcu_dereference(current_single_message_channel->payload);
+    CHECK(has_message(current_single_message_channel, "first"));
+    CHECK(first->message_sequence == 1);
+    CHECK(current_single_message_channel->message_sequence == 1);
+    CHECK(atomic_long_read(&current_message_slot->memory_bytes) == channel_memory + message_payload_memory(first));
+    write_message(current_single_message_channel, "second");
+    CHECK(has_message(current_single_message_channel, "second"));
+    CHECK(current_single_message_channel->message_sequence == 2);
+    CHECK(current_message_slot->message_sequence == 2);
+    CHECK(atomic_long_read(&current_message_slot->memory_bytes) == channel_memory + MESSAGE_PAYLOAD_MIN_SIZE);
+    put_single_message_channel(current_single_message_channel);
+    free_message_slot(current_message_slot);
+    CHECK(atomic_long_read(&message_slot_memory_bytes) == 0);
+}
+
+/*Queued messages are popped oldest first, and every pop uncharges its message*/
+static void test_queue_order(void)
+{
+    message_slot *current_message_slot;
+    single_message_channel *current_single_message_channel;
+    message_payload *payload;
+    char message[16];
+    unsigned int i;
+
+    current_message_slot = (message_slot*)checked(alloc_message_slot(0, MAX_ZISE_BUFFER));
+    current_single_message_channel = (single_message_channel*)checked(find_or_create_single_message_channel(current_message_slot, 1));
+    current_single_message_channel->queue = (message_payload**)checked(kvmalloc_array(4, sizeof(message_payload*), GFP_KERNEL_ACCOUNT));
+    current_single_message_channel->queue_depth = 4;
+    charge_message_slot_memory(current_message_slot, 4 * sizeof(message_payload*));
+    for (i = 0; i < 3; i++)
+    {
+        snprintf(message, sizeof(message), "message %u", i);
+        write_message(current_single_message_channel, message);
+    }
+    /*the ring wraps around after the first pop*/
+    payload = pop_queued_message(current_single_message_channel);
+    CHECK(payload->message_sequence == 1 && memcmp(payload->message, "message 0", 9) == 0);
+    put_message_payload(payload);
+    write_message(current_single_message_channel, "message 3");
+    write_message(current_single_message_channel, "message 4");
+    CHECK(current_single_message_channel->queue_count == 4);
+    for (i = 1; i < 5; i++)
+    {
+        snprintf(message, sizeof(message), "message %u", i);
+        payload = pop_queued_message(current_single_message_channel);
+        CHECK(payload->message_sequence == i + 1 && memcmp(payload->message, message, 9) == 0);
+        put_message_payload(payload);
+    }
+    CHECK(current_single_message_channel->queue_count == 0);
+    CHECK(atomic_long_read(&current_message_slot->memory_bytes) == (long)(sizeof(struct single_message_channel) + 4 * sizeof(message_payload*)));
+    put_single_message_channel(current_single_message_channel);
+    free_message_slot(current_message_slot);
+    CHECK(atomic_long_read(&message_slot_memory_bytes) == 0);
+}
+
+/*A snapshot message is restored only once, and moves the sequence of the slot past it*/
+static void test_restore_idempotent(void)
+{
+    message_slot *current_message_slot;
+    single_message_channel *current_single_message_channel;
+    message_payload *payload;
+    int restore_ret;
+
+    current_message_slot = (message_slot*)checked(alloc_message_slot(0, MAX_ZISE_BUFFER));
+    current_single_message_channel = (single_message_channel*)checked(find_or_create_single_message_channel(current_message_slot, 1));
+    payload = make_payload("restored");
+    payload->message_sequence = 41;
+    spin_lock(&current_message_slot->write_lock);
+    restore_ret = restore_message_payload(current_single_message_channel, payload);
+    spin_unlock(&current_message_slot->write_lock);
+    CHECK(restore_ret == SUCCESS);
+    CHECK(has_message(current_single_message_channel, "restored"));
+    CHECK(current_message_slot->message_sequence == 41);
+
+    /*restoring the same snapshot again changes nothing*/
+    payload = make_payload("restored");
+    payload->message_sequence = 41;
+    spin_lock(&current_message_slot->write_lock);
+    restore_ret = restore_message_payload(current_single_message_channel, payload);
+    spin_unlock(&current_message_slot->write_lock);
+    CHECK(restore_ret == -EEXIST);
+    put_message_payload(payload);
+    CHECK(has_message(current_single_message_channel, "restored"));
+    CHECK(current_message_slot->message_sequence == 41);
+
+    write_message(current_single_message_channel, "after");
+    CHECK(current_single_message_channel->message_sequence == 42);
+    put_single_message_channel(current_single_message_channel);
+    free_message_slot(current_message_slot);
+}
+
+/*
+MEMORY BUDGET TESTS
+*/
+/*A channel in use is not deleted, an idle one is deleted with its messages*/
+static void test_delete_busy(void)
+{
+    message_slot *current_message_slot;
+    single_message_channel *current_single_message_channel;
+
+    current_message_slot = (message_slot*)checked(alloc_message_slot(0, MAX_ZISE_BUFFER));
+    CHECK(delete_single_message_channel(current_message_slot, 5) == -EINVAL);
+    current_single_message_channel = (single_message_channel*)checked(find_or_create_single_message_channel(current_message_slot, 5));
+    write_message(current_single_message_channel, "busy");
+    CHECK(delete_single_message_channel(current_message_slot, 5) == -EBUSY);
+    CHECK(find_single_message_channel(current_message_slot, 5) == current_single_message_channel);
+    put_single_message_channel(current_single_message_channel);
+    put_single_message_channel(current_single_message_channel);
+    CHECK(delete_single_message_channel(current_message_slot, 5) == SUCCESS);
+    CHECK(find_single_message_channel(current_message_slot, 5) == NULL);
+    CHECK(atomic_read(&current_message_slot->channel_count) == 0);
+    CHECK(atomic_long_read(&current_message_slot->memory_bytes) == 0);
+    free_message_slot(current_message_slot);
+}
+
+/*Eviction follows the CLOCK order: the first pass clears the referenced bits, a channel looked up since gets a second chance*/
+static void test_eviction_order(void)
+{
+    message_slot *current_message_slot;
+    single_message_channel *current_single_message_channel;
+    unsigned int i;
+
+    current_message_slot = (message_slot*)checked(alloc_message_slot(0, MAX_ZISE_BUFFER));
+    for (i = 1; i <= 4; i++)
+    {
+        put_single_message_channel((single_message_channel*)checked(find_or_create_single_message_channel(current_message_slot, i)));
+    }
+    /*every new channel is referenced, the hand clears all four bits and evicts the first one*/
+    CHECK(evict_single_message_channel(current_message_slot));
+    CHECK(xa_load(&current_message_slot->channels, 1) == NULL);
+    /*channel 2 is looked up, so the hand passes it and evicts channel 3*/
+    put_single_message_channel(find_single_message_channel(current_message_slot, 2));
+    CHECK(evict_single_message_channel(current_message_slot));
+    CHECK(xa_load(&current_message_slot->channels, 2) != NULL);
+    CHECK(xa_load(&current_message_slot->channels, 3) == NULL);
+    /*a channel in use is never evicted*/
+    current_single_message_channel = find_single_message_channel(current_message_slot, 4);
+    CHECK(evict_single_message_channel(current_message_slot));
+    CHECK(xa_load(&current_message_slot->channels, 2) == NULL);
+    CHECK(!evict_single_message_channel(current_message_slot));
+    CHECK(xa_load(&current_message_slot->channels, 4) == current_single_message_channel);
+    put_single_message_channel(current_single_message_channel);
+    CHECK(atomic_read(&current_message_slot->channel_count) == 1);
+    free_message_slot(current_message_slot);
+}
+
+/*A slot over its budget evicts idle channels before it takes a new one, and fails when only channels in use are left*/
+static void test_budget_reserve(void)
+{
+    message_slot *current_message_slot;
+    single_message_channel *busy;
+
+    current_message_slot = (message_slot*)checked(alloc_message_slot(0, MAX_ZISE_BUFFER));
+    slot_memory_limit = 2 * sizeof(struct single_message_channel);
+    put_single_message_channel((single_message_channel*)checked(find_or_create_single_message_channel(current_message_slot, 1)));
+    busy = (single_message_channel*)checked(find_or_create_single_message_channel(current_message_slot, 2));
+    /*the slot is full, channel 1 is idle and is evicted for channel 3*/
+    put_single_message_channel((single_message_channel*)checked(find_or_create_single_message_channel(current_message_slot, 3)));
+    CHECK(xa_load(&current_message_slot->channels, 1) == NULL);
+    CHECK(atomic_read(&current_message_slot->channel_count) == 2);
+    /*channel 3 is the only idle channel left, so it is evicted for channel 4*/
+    put_single_message_channel((single_message_channel*)checked(find_or_create_single_message_channel(current_message_slot, 4)));
+    CHECK(xa_load(&current_message_slot->channels, 2) == busy);
+    CHECK(xa_load(&current_message_slot->channels, 3) == NULL);
+    CHECK(atomic_read(&current_message_slot->channel_count) == 2);
+    /*with channel 4 gone only the busy channel is left, and it alone is over a smaller budget*/
+    CHECK(evict_single_message_channel(current_message_slot));
+    slot_memory_limit = sizeof(struct single_message_channel);
+    CHECK(reserve_message_slot_memory(current_message_slot) == -ENOMEM);
+    CHECK(IS_ERR(find_or_create_single_message_channel(current_message_slot, 5)));
+    CHECK(xa_load(&current_message_slot->channels, 2) == busy);
+    slot_memory_limit = 0;
+    put_single_message_channel(busy);
+    free_message_slot(current_message_slot);
+    CHECK(atomic_long_read(&message_slot_memory_bytes) == 0);
+}
+
+/*
+SUBSCRIPTION TESTS
+*/
+/*A subscription holds a reference on the subscriber, and the subscribers share one payload charged once*/
+static void test_subscriptions(void)
+{
+    message_slot *current_message_slot;
+    single_message_channel *topic;
+    single_message_channel *subscriber;
+    long memory_bytes;
+
+    current_message_slot = (message_slot*)checked(alloc_message_slot(0, MAX_ZISE_BUFFER));
+    topic = (single_message_channel*)checked(find_or_create_single_message_channel(current_message_slot, 1));
+    subscriber = (single_message_channel*)checked(find_or_create_single_message_channel(current_message_slot, 2));
+    mutex_lock(&current_message_slot->subscribers_lock);
+    CHECK(subscribe_single_message_channel(topic, subscriber) == SUCCESS);
+    CHECK(subscribe_single_message_channel(topic, subscriber) == -EEXIST);
+    mutex_unlock(&current_message_slot->subscribers_lock);
+    CHECK(channel_refs(subscriber) == 3); /*the index, the test and the subscriber list*/
+    CHECK(channel_refs(topic) == 2);
+
+    memory_bytes = atomic_long_read(&current_message_slot->memory_bytes);
+    write_message(topic, "fan-out");
+    CHECK(atomic_read(&rcu_dereference(topic->payload)->holders) == 2);
+    CHECK(has_message(subscriber, "fan-out"));
+    CHECK(rcu_dereference(topic->payload) == rcu_dereference(subscriber->payload));
+    CHECK(atomic_long_read(&current_message_slot->memory_bytes) == memory_bytes + MESSAGE_PAYLOAD_MIN_SIZE);
+
+    mutex_lock(&current_message_slot->subscribers_lock);
+    CHECK(unsubscribe_single_message_channel(topic, subscriber) == SUCCESS);
+    CHECK(unsubscribe_single_message_channel(topic, subscriber) == -EINVAL);
+    mutex_unlock(&current_message_slot->subscribers_lock);
+    CHECK(channel_refs(subscriber) == 2);
+    memory_bytes = atomic_long_read(&current_message_slot->memory_bytes);
+    write_message(topic, "alone");
+    CHECK(has_message(subscriber, "fan-out"));
+    CHECK(atomic_long_read(&current_message_slot->memory_bytes) == memory_bytes + MESSAGE_PAYLOAD_MIN_SIZE);
+    put_single_message_channel(subscriber);
+    put_single_message_channel(topic);
+    free_message_slot(current_message_slot);
+    CHECK(atomic_long_read(&message_slot_memory_bytes) == 0);
+}
+
+/*The tests, run in order*/
+static const struct {
+    const char *name;
+    void (*run)(void);
+} tests[] = {
+    {"lookup", test_lookup},
+    {"create_race", test_create_race},
+    {"create_replaces_dying_channel", test_create_replaces_dying_channel},
+    {"payload_replace", test_payload_replace},
+    {"queue_order", test_queue_order},
+    {"restore_idempotent", test_restore_idempotent},
+    {"delete_busy", test_delete_busy},
+    {"eviction_order", test_eviction_order},
+    {"budget_reserve", test_budget_reserve},
+    {"subscriptions", test_subscriptions},
+};
+
+int main(void)
+{
+    unsigned int failed_before;
+    unsigned int i;
+
+    if (create_message_slot_caches() != SUCCESS)
+    {
+        exit(1);
+    }
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        failed_before = failed_checks;
+        tests[i].run();
+        printf("%-32s %s\n", tests[i].name, failed_checks == failed_before ? "ok" : "FAILED");
+    }
+    destroy_message_slot_caches();
+    if (failed_checks != 0)
+    {
+        fprintf(stderr, "%u checks failed\n", failed_checks);
+        exit(1);
+    }
+    exit(0);
+}
@@ -0,0 +1,542 @@
+/*
+KUnit tests of the message_slot device, included at the end of message_slot.c when CONFIG_MESSAGE_SLOT_KUNIT_TEST is set
+so that they call the file operations directly. Every test opens files of its own minor through device_open,
+which needs no device file, and reads and writes them through kernel iov_iters.
+Run them under UML with the .kunitconfig of this directory, see README.md.
+*/
+#include <kunit/test.h> /*test.h for the KUnit test cases and expectations*/
+#include <linux/kthread.h> /*kthread.h for the threads of the stress test and of the blocked reader*/
+#include <linux/completion.h> /*completion.h for waiting for the blocked reader*/
+#include <linux/delay.h> /*delay.h for the duration of the stress test*/
+
+/*How long the stress test runs, in milliseconds*/
+#define MESSAGE_SLOT_KUNIT_STRESS_MS 1000
+/*The channels that the threads of the stress test share*/
+#define MESSAGE_SLOT_KUNIT_STRESS_CHANNELS 8
+/*The reads of a channel reader of the stress test before it selects the next channel*/
+#define MESSAGE_SLOT_KUNIT_STRESS_RESELECT 64
+
+/*The next minor to give a test, counting down from the last one so that tests do not share slots with each other*/
+static atomic_t message_slot_kunit_next_minor = ATOMIC_INIT(0);
+
+/*A file of a message slot minor opened by device_open, without a device file*/
+typedef struct message_slot_kunit_file {
+    struct inode inode; /*The inode that device_open reads the minor from*/
+    struct file file; /*The open file*/
+} message_slot_kunit_file;
+
+/*Returns a minor that no other test uses*/
+static unsigned int message_slot_kunit_minor(struct kunit *test)
+{
+    unsigned int minor;
+
+    minor = minor_count - 1 - atomic_fetch_inc(&message_slot_kunit_next_minor);
+    KUNIT_ASSERT_LT(test, minor, minor_count);
+    return minor;
+}
+
+/*Opens a file of a minor with the given f_flags*/
+static struct file *message_slot_kunit_open(struct kunit *test, unsigned int minor, unsigned int flags)
+{
+    message_slot_kunit_file *kunit_file;
+
+    kunit_file = kunit_kzalloc(test, sizeof(*kunit_file), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, kunit_file);
+    kunit_file->inode.i_rdev = MKDEV(MAJOR(message_slot_first_device), minor);
+    kunit_file->file.f_inode = &kunit_file->inode;
+    kunit_file->file.f_flags = flags;
+    KUNIT_ASSERT_EQ(test, device_open(&kunit_file->inode, &kunit_file->file), SUCCESS);
+    return &kunit_file->file;
+}
+
+/*Closes a file opened by message_slot_kunit_open, its memory belongs to the test*/
+static void message_slot_kunit_close(struct file *file)
+{
+    device_release(file_inode(file), file);
+}
+
+/*Reads a message of a file at a position into a kernel buffer, like pread*/
+static ssize_t message_slot_kunit_read(struct file *file, void *buffer, size_t length, loff_t position)
+{
+    struct kiocb kiocb;
+    struct kvec kvec;
+    struct iov_iter iter;
+
+    kvec.iov_base = buffer;
+    kvec.iov_len = length;
+    init_sync_kiocb(&kiocb, file);
+    kiocb.ki_pos = position;
+    iov_iter_kvec(&iter, ITER_DEST, &kvec, 1, length);
+    return device_read_iter(&kiocb, &iter);
+}
+
+/*Writes a message from a kernel buffer to a file at a position, like pwrite*/
+static ssize_t message_slot_kunit_write(struct file *file, const void *buffer, size_t length, loff_t position)
+{
+    struct kiocb kiocb;
+    struct kvec kvec;
+    struct iov_iter iter;
+
+    kvec.iov_base = (void*)buffer;
+    kvec.iov_len = length;
+    init_sync_kiocb(&kiocb, file);
+    kiocb.ki_pos = position;
+    iov_iter_kvec(&iter, ITER_SOURCE, &kvec, 1, length);
+    return device_write_iter(&kiocb, &iter);
+}
+
+/*
+OPEN AND IOCTL TESTS
+*/
+/*A minor past minor_count is not a device of the module*/
+static void message_slot_kunit_open_minor(struct kunit *test)
+{
+    message_slot_kunit_file *kunit_file;
+
+    if (minor_count == MINORMASK + 1)
+    {
+        kunit_skip(test, "every minor belongs to the module");
+    }
+    kunit_file = kunit_kzalloc(test, sizeof(*kunit_file), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, kunit_file);
+    kunit_file->inode.i_rdev = MKDEV(MAJOR(message_slot_first_device), minor_count);
+    kunit_file->file.f_inode = &kunit_file->inode;
+    KUNIT_EXPECT_EQ(test, device_open(&kunit_file->inode, &kunit_file->file), -ENODEV);
+}
+
+/*Channel 0, channels past 32 bits and unknown commands are refused, and the ioctls that need a channel fail without one*/
+static void message_slot_kunit_ioctl_errors(struct kunit *test)
+{
+    struct file *file;
+
+    file = message_slot_kunit_open(test, message_slot_kunit_minor(test), 0);
+    KUNIT_EXPECT_EQ(test, device_ioctl(file, MSG_SLOT_CHANNEL, 0), -EINVAL);
+    KUNIT_EXPECT_EQ(test, device_ioctl(file, MSG_SLOT_CHANNEL, (unsigned long)UINT_MAX + 1), -EINVAL);
+    KUNIT_EXPECT_EQ(test, device_ioctl(file, _IOW(MAJOR_NUMBER, 100, unsigned int), 1), -EINVAL);
+    KUNIT_EXPECT_EQ(test, device_ioctl(file, MSG_SLOT_QUEUE_DEPTH, 4), -EINVAL);
+    KUNIT_EXPECT_EQ(test, device_ioctl(file, MSG_SLOT_MAX_MESSAGE_SIZE, 0), -EINVAL);
+    KUNIT_EXPECT_EQ(test, device_ioctl(file, MSG_SLOT_MAX_MESSAGE_SIZE, MAX_MESSAGE_SIZE_LIMIT + 1), -EINVAL);
+    KUNIT_EXPECT_EQ(test, device_ioctl(file, MSG_SLOT_DELETE_CHANNEL, 1), -EINVAL);
+    KUNIT_EXPECT_EQ(test, device_ioctl(file, MSG_SLOT_CHANNEL, 1), SUCCESS);
+    KUNIT_EXPECT_EQ(test, device_ioctl(file, MSG_SLOT_QUEUE_DEPTH, MAX_QUEUE_DEPTH + 1), -EINVAL);
+    KUNIT_EXPECT_EQ(test, device_ioctl(file, MSG_SLOT_DELETE_CHANNEL, 2), -EINVAL);
+    message_slot_kunit_close(file);
+}
+
+/*A channel that a file descriptor has selected is busy, once the file is closed it can be deleted*/
+static void message_slot_kunit_delete_channel(struct kunit *test)
+{
+    struct file *owner;
+    struct file *file;
+    unsigned int minor;
+
+    minor = message_slot_kunit_minor(test);
+    owner = message_slot_kunit_open(test, minor, 0);
+    file = message_slot_kunit_open(test, minor, 0);
+    KUNIT_ASSERT_EQ(test, device_ioctl(owner, MSG_SLOT_CHANNEL, 5), SUCCESS);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_write(owner, "busy", 4, 0), 4);
+    KUNIT_EXPECT_EQ(test, device_ioctl(file, MSG_SLOT_DELETE_CHANNEL, 5), -EBUSY);
+    message_slot_kunit_close(owner);
+    KUNIT_EXPECT_EQ(test, device_ioctl(file, MSG_SLOT_DELETE_CHANNEL, 5), SUCCESS);
+    KUNIT_EXPECT_EQ(test, device_ioctl(file, MSG_SLOT_DELETE_CHANNEL, 5), -EINVAL);
+    message_slot_kunit_close(file);
+}
+
+/*
+READ AND WRITE TESTS
+*/
+/*Reads and writes of a file descriptor with a channel return the error codes of the message slot*/
+static void message_slot_kunit_read_write_errors(struct kunit *test)
+{
+    struct file *file;
+    char buffer[MAX_ZISE_BUFFER + 1];
+
+    memset(buffer, 'm', sizeof(buffer));
+    file = message_slot_kunit_open(test, message_slot_kunit_minor(test), O_NONBLOCK);
+    KUNIT_ASSERT_EQ(test, device_ioctl(file, MSG_SLOT_CHANNEL, 1), SUCCESS);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_read(file, buffer, sizeof(buffer), 0), -EWOULDBLOCK);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_write(file, buffer, 0, 0), -EMSGSIZE);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_write(file, buffer, MAX_ZISE_BUFFER + 1, 0), -EMSGSIZE);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_write(file, buffer, MAX_ZISE_BUFFER, 0), MAX_ZISE_BUFFER);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_read(file, buffer, MAX_ZISE_BUFFER - 1, 0), -ENOSPC);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_read(file, buffer, sizeof(buffer), 0), MAX_ZISE_BUFFER);
+    /*the max message size is a property of the slot*/
+    KUNIT_EXPECT_EQ(test, device_ioctl(file, MSG_SLOT_MAX_MESSAGE_SIZE, 2 * MAX_ZISE_BUFFER), SUCCESS);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_write(file, buffer, MAX_ZISE_BUFFER + 1, 0), MAX_ZISE_BUFFER + 1);
+    message_slot_kunit_close(file);
+}
+
+/*A channel keeps its last message, which every reader gets, and a blocking read only returns new messages*/
+static void message_slot_kunit_last_message(struct kunit *test)
+{
+    struct file *writer;
+    struct file *reader;
+    struct file *nonblocking_reader;
+    unsigned int minor;
+    char buffer[MAX_ZISE_BUFFER];
+
+    minor = message_slot_kunit_minor(test);
+    writer = message_slot_kunit_open(test, minor, 0);
+    reader = message_slot_kunit_open(test, minor, 0);
+    nonblocking_reader = message_slot_kunit_open(test, minor, O_NONBLOCK);
+    KUNIT_ASSERT_EQ(test, device_ioctl(writer, MSG_SLOT_CHANNEL, 3), SUCCESS);
+    KUNIT_ASSERT_EQ(test, device_ioctl(reader, MSG_SLOT_CHANNEL, 3), SUCCESS);
+    KUNIT_ASSERT_EQ(test, device_ioctl(nonblocking_reader, MSG_SLOT_CHANNEL, 3), SUCCESS);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_write(writer, "first", 5, 0), 5);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_write(writer, "second", 6, 0), 6);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_read(reader, buffer, sizeof(buffer), 0), 6);
+    KUNIT_EXPECT_MEMEQ(test, buffer, "second", 6);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_read(nonblocking_reader, buffer, sizeof(buffer), 0), 6);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_read(nonblocking_reader, buffer, sizeof(buffer), 0), 6);
+    KUNIT_EXPECT_MEMEQ(test, buffer, "second", 6);
+    /*channel 4 of the same slot is a different channel*/
+    KUNIT_ASSERT_EQ(test, device_ioctl(nonblocking_reader, MSG_SLOT_CHANNEL, 4), SUCCESS);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_read(nonblocking_reader, buffer, sizeof(buffer), 0), -EWOULDBLOCK);
+    message_slot_kunit_close(nonblocking_reader);
+    message_slot_kunit_close(reader);
+    message_slot_kunit_close(writer);
+}
+
+/*A channel in queue mode returns its messages oldest first, and refuses a non-blocking write when full*/
+static void message_slot_kunit_queue_mode(struct kunit *test)
+{
+    struct file *file;
+    char buffer[MAX_ZISE_BUFFER];
+
+    file = message_slot_kunit_open(test, message_slot_kunit_minor(test), O_NONBLOCK);
+    KUNIT_ASSERT_EQ(test, device_ioctl(file, MSG_SLOT_CHANNEL, 1), SUCCESS);
+    KUNIT_ASSERT_EQ(test, device_ioctl(file, MSG_SLOT_QUEUE_DEPTH, 2), SUCCESS);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_write(file, "one", 3, 0), 3);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_write(file, "two", 3, 0), 3);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_write(file, "three", 5, 0), -EAGAIN);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_read(file, buffer, sizeof(buffer), 0), 3);
+    KUNIT_EXPECT_MEMEQ(test, buffer, "one", 3);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_read(file, buffer, sizeof(buffer), 0), 3);
+    KUNIT_EXPECT_MEMEQ(test, buffer, "two", 3);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_read(file, buffer, sizeof(buffer), 0), -EWOULDBLOCK);
+    message_slot_kunit_close(file);
+}
+
+/*A blocking read of the mode wakeup test, on a thread of its own*/
+typedef struct message_slot_kunit_blocked_read {
+    struct file *file; /*The reader's file, with its channel selected*/
+    char buffer[MAX_ZISE_BUFFER]; /*The message read*/
+    ssize_t read_ret; /*The result of the read*/
+    struct completion done; /*Completed when the read returned*/
+} message_slot_kunit_blocked_read;
+
+/*Reads a message of the reader's channel, sleeping until there is one*/
+static int message_slot_kunit_blocked_read_thread(void *argument)
+{
+    message_slot_kunit_blocked_read *blocked_read = argument;
+
+    blocked_read->read_ret = message_slot_kunit_read(blocked_read->file, blocked_read->buffer, sizeof(blocked_read->buffer), 0);
+    complete(&blocked_read->done);
+    return 0;
+}
+
+/*A blocking read that sleeps in last message mode wakes up when the channel moves to queue mode, and reads its queue*/
+static void message_slot_kunit_mode_wakeup(struct kunit *test)
+{
+    message_slot_kunit_blocked_read *blocked_read;
+    struct task_struct *task;
+    struct file *writer;
+    unsigned int minor;
+
+    blocked_read = kunit_kzalloc(test, sizeof(*blocked_read), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, blocked_read);
+    minor = message_slot_kunit_minor(test);
+    blocked_read->file = message_slot_kunit_open(test, minor, 0);
+    writer = message_slot_kunit_open(test, minor, O_NONBLOCK);
+    KUNIT_ASSERT_EQ(test, device_ioctl(blocked_read->file, MSG_SLOT_CHANNEL, 1), SUCCESS);
+    KUNIT_ASSERT_EQ(test, device_ioctl(writer, MSG_SLOT_CHANNEL, 1), SUCCESS);
+    init_completion(&blocked_read->done);
+    task = kthread_run(message_slot_kunit_blocked_read_thread, blocked_read, "msgslot_b");
+    KUNIT_ASSERT_FALSE(test, IS_ERR(task));
+    /*let the reader fall asleep in last message mode*/
+    msleep(50);
+    KUNIT_EXPECT_EQ(test, device_ioctl(writer, MSG_SLOT_QUEUE_DEPTH, 2), SUCCESS);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_write(writer, "one", 3, 0), 3);
+    if (!wait_for_completion_timeout(&blocked_read->done, HZ))
+    {
+        KUNIT_FAIL(test, "The blocked reader missed the message of the queue");
+        /*a last message wakes the reader, so it returns before its file is closed*/
+        device_ioctl(writer, MSG_SLOT_QUEUE_DEPTH, 0);
+        message_slot_kunit_write(writer, "two", 3, 0);
+        wait_for_completion(&blocked_read->done);
+    }
+    KUNIT_EXPECT_EQ(test, blocked_read->read_ret, 3);
+    KUNIT_EXPECT_MEMEQ(test, blocked_read->buffer, "one", 3);
+    message_slot_kunit_close(writer);
+    message_slot_kunit_close(blocked_read->file);
+}
+
+/*A read of a queued message into a user buffer that is not valid fails with EFAULT and leaves the message queued*/
+static void message_slot_kunit_queue_fault(struct kunit *test)
+{
+    struct file *file;
+    struct kiocb kiocb;
+    struct iov_iter iter;
+    char buffer[MAX_ZISE_BUFFER];
+
+    file = message_slot_kunit_open(test, message_slot_kunit_minor(test), O_NONBLOCK);
+    KUNIT_ASSERT_EQ(test, device_ioctl(file, MSG_SLOT_CHANNEL, 1), SUCCESS);
+    KUNIT_ASSERT_EQ(test, device_ioctl(file, MSG_SLOT_QUEUE_DEPTH, 2), SUCCESS);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_write(file, "one", 3, 0), 3);
+    init_sync_kiocb(&kiocb, file);
+    KUNIT_ASSERT_EQ(test, import_ubuf(ITER_DEST, NULL, sizeof(buffer), &iter), 0);
+    KUNIT_EXPECT_EQ(test, device_read_iter(&kiocb, &iter), -EFAULT);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_read(file, buffer, sizeof(buffer), 0), 3);
+    KUNIT_EXPECT_MEMEQ(test, buffer, "one", 3);
+    message_slot_kunit_close(file);
+}
+
+/*A file descriptor with no channel addresses the channel of the file position*/
+static void message_slot_kunit_offset_channel(struct kunit *test)
+{
+    struct file *file;
+    struct file *reader;
+    unsigned int minor;
+    char buffer[MAX_ZISE_BUFFER];
+
+    minor = message_slot_kunit_minor(test);
+    file = message_slot_kunit_open(test, minor, 0);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_read(file, buffer, sizeof(buffer), 9), -EWOULDBLOCK);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_write(file, "offset", 6, 0), -EINVAL);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_write(file, "offset", 6, 9), 6);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_read(file, buffer, sizeof(buffer), 0), -EINVAL);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_read(file, buffer, sizeof(buffer), 9), 6);
+    KUNIT_EXPECT_MEMEQ(test, buffer, "offset", 6);
+    reader = message_slot_kunit_open(test, minor, O_NONBLOCK);
+    KUNIT_ASSERT_EQ(test, device_ioctl(reader, MSG_SLOT_CHANNEL, 9), SUCCESS);
+    KUNIT_EXPECT_EQ(test, message_slot_kunit_read(reader, buffer, sizeof(buffer), 0), 6);
+    message_slot_kunit_close(reader);
+    message_slot_kunit_close(file);
+}
+
+/*
+STRESS TEST
+*/
+/*The message of a writer of the stress test, a reader checks that it came from the channel it read*/
+typedef struct message_slot_kunit_stress_message {
+    u32 channel_id; /*The channel the message was written to*/
+    u32 writer; /*The writer thread*/
+    u64 count; /*The writes of the writer before this one*/
+} message_slot_kunit_stress_message;
+
+/*A reader or writer thread of the stress test*/
+typedef struct message_slot_kunit_stress_thread {
+    struct task_struct *task; /*The kthread*/
+    struct file *file; /*The thread's file, a channel reader selects its channel on it, the others pick one per operation through the position*/
+    unsigned int index; /*The writer or reader number*/
+    u64 operations; /*The reads or writes that succeeded*/
+    u64 errors; /*The operations that failed with an unexpected error, or read a message of another channel*/
+} message_slot_kunit_stress_thread;
+
+/*Writes messages to the shared channels until stopped*/
+static int message_slot_kunit_stress_write(void *argument)
+{
+    message_slot_kunit_stress_thread *thread;
+    message_slot_kunit_stress_message message;
+
+    thread = (message_slot_kunit_stress_thread*)argument;
+    message.writer = thread->index;
+    message.count = 0;
+    while (!kthread_should_stop())
+    {
+        message.channel_id = (thread->index + message.count) % MESSAGE_SLOT_KUNIT_STRESS_CHANNELS + 1;
+        if (message_slot_kunit_write(thread->file, &message, sizeof(message), message.channel_id) == sizeof(message))
+        {
+            thread->operations++;
+        }
+        else
+        {
+            thread->errors++;
+        }
+        message.count++;
+        cond_resched();
+    }
+    return 0;
+}
+
+/*Reads the shared channels until stopped, and checks that every message belongs to the channel it was read from*/
+static int message_slot_kunit_stress_read(void *argument)
+{
+    message_slot_kunit_stress_thread *thread;
+    message_slot_kunit_stress_message message;
+    unsigned int channel_id;
+    u64 count;
+    ssize_t read_ret;
+
+    thread = (message_slot_kunit_stress_thread*)argument;
+    for (count = 0; !kthread_should_stop(); count++)
+    {
+        channel_id = (thread->index + count) % MESSAGE_SLOT_KUNIT_STRESS_CHANNELS + 1;
+        read_ret = message_slot_kunit_read(thread->file, &message, sizeof(message), channel_id);
+        if (read_ret == sizeof(message) && message.channel_id == channel_id)
+        {
+            thread->operations++;
+        }
+        else if (read_ret != -EWOULDBLOCK)
+        {
+            thread->errors++;
+        }
+        cond_resched();
+    }
+    return 0;
+}
+
+/*
+Selects a shared channel with MSG_SLOT_CHANNEL and waits for its new messages in blocking reads until stopped,
+moving to the next channel every MESSAGE_SLOT_KUNIT_STRESS_RESELECT reads while the writers keep publishing.
+Every read checks that the message belongs to the selected channel, and every poll that the file has a channel.
+*/
+static int message_slot_kunit_stress_channel_read(void *argument)
+{
+    message_slot_kunit_stress_thread *thread;
+    message_slot_kunit_stress_message message;
+    unsigned int channel_id;
+    u64 count;
+    ssize_t read_ret;
+
+    thread = (message_slot_kunit_stress_thread*)argument;
+    channel_id = 0;
+    for (count = 0; !kthread_should_stop(); count++)
+    {
+        if (count % MESSAGE_SLOT_KUNIT_STRESS_RESELECT == 0)
+        {
+            channel_id = (thread->index + count / MESSAGE_SLOT_KUNIT_STRESS_RESELECT) % MESSAGE_SLOT_KUNIT_STRESS_CHANNELS + 1;
+            if (device_ioctl(thread->file, MSG_SLOT_CHANNEL, channel_id) != SUCCESS)
+            {
+                thread->errors++;
+                break;
+            }
+        }
+        if (device_poll(thread->file, NULL) & EPOLLERR)
+        {
+            thread->errors++;
+        }
+        /*sleeps until a writer publishes to the channel, the writers run until every channel reader has stopped*/
+        read_ret = message_slot_kunit_read(thread->file, &message, sizeof(message), 0);
+        if (read_ret == sizeof(message) && message.channel_id == channel_id)
+        {
+            thread->operations++;
+        }
+        else
+        {
+            thread->errors++;
+        }
+    }
+    return 0;
+}
+
+/*
+Runs a writer, a reader of channels by position and a blocking reader of a selected channel per CPU on shared channels
+of one slot for MESSAGE_SLOT_KUNIT_STRESS_MS, then reports the writes and reads per second.
+Run on a kernel with lockdep or KCSAN it is also their workload.
+*/
+static void message_slot_kunit_stress(struct kunit *test)
+{
+    message_slot_kunit_stress_thread *threads;
+    unsigned int thread_count;
+    unsigned int started_count;
+    unsigned int writer_count;
+    unsigned int minor;
+    unsigned int i;
+    int (*thread_function)(void *argument);
+    const char *thread_role;
+    u64 writes;
+    u64 reads;
+    u64 errors;
+    u64 start;
+    u64 elapsed;
+
+    minor = message_slot_kunit_minor(test);
+    writer_count = num_online_cpus();
+    thread_count = 3 * writer_count;
+    threads = kunit_kcalloc(test, thread_count, sizeof(*threads), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, threads);
+    for (i = 0; i < thread_count; i++)
+    {
+        /*the channel readers block, the others never do*/
+        threads[i].file = message_slot_kunit_open(test, minor, i < 2 * writer_count ? O_NONBLOCK : 0);
+        threads[i].index = i % writer_count;
+    }
+    start = ktime_get_ns();
+    /*the writers start first, so a channel reader never runs without them*/
+    for (started_count = 0; started_count < thread_count; started_count++)
+    {
+        if (started_count < writer_count)
+        {
+            thread_function = message_slot_kunit_stress_write;
+            thread_role = "w";
+        }
+        else if (started_count < 2 * writer_count)
+        {
+            thread_function = message_slot_kunit_stress_read;
+            thread_role = "r";
+        }
+        else
+        {
+            thread_function = message_slot_kunit_stress_channel_read;
+            thread_role = "c";
+        }
+        threads[started_count].task = kthread_run(thread_function, &threads[started_count], "msgslot_%s/%u", thread_role, threads[started_count].index);
+        if (IS_ERR(threads[started_count].task))
+        {
+            break;
+        }
+    }
+    if (started_count == thread_count)
+    {
+        msleep(MESSAGE_SLOT_KUNIT_STRESS_MS);
+    }
+    writes = 0;
+    reads = 0;
+    errors = 0;
+    /*stopped last first, so the writers still wake the channel readers that sleep in a read*/
+    for (i = thread_count; i-- > 0;)
+    {
+        if (i < started_count)
+        {
+            kthread_stop(threads[i].task);
+        }
+        if (i < writer_count)
+        {
+            writes += threads[i].operations;
+        }
+        else
+        {
+            reads += threads[i].operations;
+        }
+        errors += threads[i].errors;
+        message_slot_kunit_close(threads[i].file);
+    }
+    elapsed = ktime_get_ns() - start;
+    KUNIT_ASSERT_EQ_MSG(test, started_count, thread_count, "Failed to start the stress threads");
+    kunit_info(test, "%u writers, %u readers, %u channels: %llu writes/sec, %llu reads/sec\n", writer_count, 2 * writer_count,
+               MESSAGE_SLOT_KUNIT_STRESS_CHANNELS, div64_u64(writes * NSEC_PER_SEC, elapsed), div64_u64(reads * NSEC_PER_SEC, elapsed));
+    KUNIT_EXPECT_EQ(test, errors, 0);
+    KUNIT_EXPECT_GT(test, writes, 0);
+}
+
+static struct kunit_case message_slot_kunit_cases[] = {
+    KUNIT_CASE(message_slot_kunit_open_minor),
+    KUNIT_CASE(message_slot_kunit_ioctl_errors),
+    KUNIT_CASE(message_slot_kunit_delete_channel),
+    KUNIT_CASE(message_slot_kunit_read_write_errors),
+    KUNIT_CASE(message_slot_kunit_last_message),
+    KUNIT_CASE(message_slot_kunit_queue_mode),
+    KUNIT_CASE(message_slot_kunit_queue_fault),
+    KUNIT_CASE(message_slot_kunit_mode_wakeup),
+    KUNIT_CASE(message_slot_kunit_offset_channel),
+    KUNIT_CASE_SLOW(message_slot_kunit_stress),
+    {}
+};
+
+static struct kunit_suite message_slot_kunit_suite = {
+    .name = "message_slot",
+    .test_cases = message_slot_kunit_cases,
+};
+
+kunit_test_suite(message_slot_kunit_suite);
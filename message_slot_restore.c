@@ -0,0 +1,87 @@
+#include "message_slot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h> /*For clock_gettime, to report the time of the restore*/
+#include <fcntl.h> /*For file control options (e.g., O_RDONLY, O_WRONLY)*/
+#include <unistd.h> /*For POSIX operating system API (e.g., read, write, close)*/
+#include <sys/ioctl.h> /*For I/O control device operations*/
+#include <sys/mman.h> /*For mapping the snapshot file*/
+#include <sys/stat.h> /*For the size of the snapshot file*/
+
+/*
+A user space program to load a snapshot back into the message slots, for example after the module was reloaded:
+    sudo cp /sys/kernel/debug/message_slot/snapshot /var/tmp/message_slot.snapshot
+    sudo rmmod message_slot && sudo insmod message_slot.ko
+    sudo ./message_slot_restore /dev/message_slot0 /var/tmp/message_slot.snapshot
+The snapshot holds every minor, so any device file of the module will do.
+*/
+int main(int argc, char const *argv[])
+{
+    int file;
+    int snapshot_file;
+    struct stat snapshot_stat;
+    struct msg_slot_restore restore;
+    void *snapshot;
+    struct timespec start;
+    struct timespec end;
+    long restore_ret;
+
+    /*Recive 2 command line arguments*/
+    if (argc != 3)
+    {
+        /*Recived number of line arguments that diffrent from 2- an error*/
+        fprintf(stderr, "Program gets 2 command line arguments: <device file> <snapshot file>\n");
+        exit(1);
+    }
+
+    /*Map the whole snapshot, the kernel reads the records straight from it*/
+    snapshot_file = open(argv[2], O_RDONLY);
+    if (snapshot_file < 0 || fstat(snapshot_file, &snapshot_stat) != 0)
+    {
+        /*Couldn't open the snapshot*/
+        perror("Error");
+        exit(1);
+    }
+    if (snapshot_stat.st_size < (off_t)sizeof(struct msg_slot_snapshot_header))
+    {
+        fprintf(stderr, "The snapshot file is too short\n");
+        exit(1);
+    }
+    snapshot = mmap(NULL, snapshot_stat.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, snapshot_file, 0);
+    if (snapshot == MAP_FAILED)
+    {
+        perror("Error");
+        exit(1);
+    }
+    close(snapshot_file);
+
+    /*Open the specified slot device file*/
+    file = open(argv[1], O_WRONLY);
+    if (file < 0)
+    {
+        /*Couldn't open the file*/
+        perror("Error");
+        exit(1);
+    }
+
+    restore.buffer = (uint64_t)(uintptr_t)snapshot;
+    restore.length = (uint64_t)snapshot_stat.st_size;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    restore_ret = ioctl(file, MSG_SLOT_RESTORE, &restore);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (restore_ret < 0)
+    {
+        /*The snapshot is not valid, or a message could not be restored*/
+        perror("Error");
+        exit(1);
+    }
+    fprintf(stderr, "Restored %ld messages, %lld bytes in %.3f s\n", restore_ret, (long long)snapshot_stat.st_size,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    munmap(snapshot, snapshot_stat.st_size);
+    close(file);
+    exit(0);
+}
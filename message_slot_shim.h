@@ -0,0 +1,442 @@
+/*
+A user space stand-in for the subset of the kernel API that message_slot_core.h uses,
+so that the message store builds and runs as a plain library without loading the module.
+Slab caches and kvmalloc map to malloc, per CPU data has a single copy, RCU read-side sections
+are empty and call_rcu runs its callback at once, so the store is driven from a single thread here.
+The channel index is a 64-way radix tree like the kernel's xarray, so lookups walk the same shape of tree.
+*/
+#ifndef MESSAGE_SLOT_SHIM_H
+#define MESSAGE_SLOT_SHIM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+TYPES AND ANNOTATIONS
+*/
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef unsigned int gfp_t;
+typedef unsigned int slab_flags_t;
+
+#define __rcu
+#define __percpu
+#define __user
+#define __releases(x)
+#define ____cacheline_aligned_in_smp __attribute__((aligned(64)))
+
+#define GFP_KERNEL 0U
+#define GFP_KERNEL_ACCOUNT 0U
+#define GFP_ATOMIC 0U
+#define SLAB_HWCACHE_ALIGN 1U
+#define SLAB_ACCOUNT 0U
+
+#define KERN_ERR ""
+#define KERN_INFO ""
+#define printk(...) fprintf(stderr, __VA_ARGS__)
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define container_of(pointer, type, member) ((type*)((char*)(pointer) - offsetof(type, member)))
+#define struct_size(pointer, member, count) (sizeof(*(pointer)) + sizeof((pointer)->member[0]) * (size_t)(count))
+
+#define READ_ONCE(x) (*(volatile __typeof__(x)*)&(x))
+#define WRITE_ONCE(x, value) (*(volatile __typeof__(x)*)&(x) = (value))
+#define smp_load_acquire(pointer) __atomic_load_n((pointer), __ATOMIC_ACQUIRE)
+#define smp_store_release(pointer, value) __atomic_store_n((pointer), (value), __ATOMIC_RELEASE)
+
+static inline u64 ktime_get_real_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (u64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ERROR POINTERS
+*/
+#define MAX_ERRNO 4095
+static inline void *ERR_PTR(long error) { return (void*)error; }
+static inline long PTR_ERR(const void *pointer) { return (long)pointer; }
+static inline bool IS_ERR(const void *pointer) { return (unsigned long)pointer >= (unsigned long)-MAX_ERRNO; }
+static inline bool IS_ERR_OR_NULL(const void *pointer) { return pointer == NULL || IS_ERR(pointer); }
+#define ERR_CAST(pointer) ((void*)(pointer))
+
+/*
+ATOMICS AND REFERENCE COUNTS
+*/
+typedef struct { int counter; } atomic_t;
+static inline int atomic_read(const atomic_t *value) { return __atomic_load_n(&value->counter, __ATOMIC_RELAXED); }
+static inline void atomic_set(atomic_t *value, int counter) { __atomic_store_n(&value->counter, counter, __ATOMIC_RELAXED); }
+static inline void atomic_inc(atomic_t *value) { __atomic_add_fetch(&value->counter, 1, __ATOMIC_RELAXED); }
+static inline void atomic_dec(atomic_t *value) { __atomic_sub_fetch(&value->counter, 1, __ATOMIC_RELAXED); }
+static inline int atomic_inc_return(atomic_t *value) { return __atomic_add_fetch(&value->counter, 1, __ATOMIC_ACQ_REL); }
+static inline bool atomic_dec_and_test(atomic_t *value) { return __atomic_sub_fetch(&value->counter, 1, __ATOMIC_ACQ_REL) == 0; }
+typedef struct { long long counter; } atomic64_t;
+static inline long long atomic64_read(const atomic64_t *value) { return __atomic_load_n(&value->counter, __ATOMIC_RELAXED); }
+static inline void atomic64_inc(atomic64_t *value) { __atomic_add_fetch(&value->counter, 1, __ATOMIC_RELAXED); }
+static inline void atomic64_add(long long addend, atomic64_t *value) { __atomic_add_fetch(&value->counter, addend, __ATOMIC_RELAXED); }
+typedef struct { long counter; } atomic_long_t;
+static inline long atomic_long_read(const atomic_long_t *value) { return __atomic_load_n(&value->counter, __ATOMIC_RELAXED); }
+static inline void atomic_long_set(atomic_long_t *value, long counter) { __atomic_store_n(&value->counter, counter, __ATOMIC_RELAXED); }
+static inline void atomic_long_add(long addend, atomic_long_t *value) { __atomic_add_fetch(&value->counter, addend, __ATOMIC_RELAXED); }
+
+typedef struct { unsigned int refs; } refcount_t;
+static inline unsigned int refcount_read(const refcount_t *refcount) { return __atomic_load_n(&refcount->refs, __ATOMIC_RELAXED); }
+static inline void refcount_set(refcount_t *refcount, unsigned int refs) { __atomic_store_n(&refcount->refs, refs, __ATOMIC_RELAXED); }
+static inline void refcount_inc(refcount_t *refcount) { __atomic_add_fetch(&refcount->refs, 1, __ATOMIC_RELAXED); }
+static inline bool refcount_dec_and_test(refcount_t *refcount) { return __atomic_sub_fetch(&refcount->refs, 1, __ATOMIC_ACQ_REL) == 0; }
+static inline bool refcount_dec_if_one(refcount_t *refcount)
+{
+    unsigned int refs;
+    refs = 1;
+    return __atomic_compare_exchange_n(&refcount->refs, &refs, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+static inline bool refcount_inc_not_zero(refcount_t *refcount)
+{
+    unsigned int refs;
+    refs = __atomic_load_n(&refcount->refs, __ATOMIC_RELAXED);
+    while (refs != 0)
+    {
+        if (__atomic_compare_exchange_n(&refcount->refs, &refs, refs + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+struct kref { refcount_t refcount; };
+static inline void kref_init(struct kref *kref) { refcount_set(&kref->refcount, 1); }
+static inline unsigned int kref_read(const struct kref *kref) { return refcount_read(&kref->refcount); }
+static inline void kref_get(struct kref *kref) { refcount_inc(&kref->refcount); }
+static inline bool kref_get_unless_zero(struct kref *kref) { return refcount_inc_not_zero(&kref->refcount); }
+static inline int kref_put(struct kref *kref, void (*release)(struct kref *kref))
+{
+    if (refcount_dec_and_test(&kref->refcount))
+    {
+        release(kref);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+LOCKS AND WAIT QUEUES
+*/
+typedef struct { int locked; } spinlock_t;
+static inline void spin_lock_init(spinlock_t *lock) { lock->locked = 0; }
+static inline void spin_lock(spinlock_t *lock)
+{
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+    {
+        /*spin*/
+    }
+}
+static inline void spin_unlock(spinlock_t *lock) { __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE); }
+#define lockdep_is_held(lock) 1
+
+struct mutex { pthread_mutex_t lock; };
+static inline void mutex_init(struct mutex *mutex) { pthread_mutex_init(&mutex->lock, NULL); }
+static inline void mutex_lock(struct mutex *mutex) { pthread_mutex_lock(&mutex->lock); }
+static inline void mutex_unlock(struct mutex *mutex) { pthread_mutex_unlock(&mutex->lock); }
+
+/*Nothing sleeps in the user space build, so a wait queue has no waiters*/
+typedef struct { int unused; } wait_queue_head_t;
+static inline void init_waitqueue_head(wait_queue_head_t *wait_queue) { wait_queue->unused = 0; }
+static inline void wake_up_pollfree(wait_queue_head_t *wait_queue) { (void)wait_queue; }
+
+/*
+RCU
+*/
+struct rcu_head { void (*func)(struct rcu_head *rcu); };
+static inline void rcu_read_lock(void) { }
+static inline void rcu_read_unlock(void) { }
+static inline void call_rcu(struct rcu_head *rcu, void (*func)(struct rcu_head *rcu)) { func(rcu); }
+static inline void rcu_barrier(void) { }
+#define rcu_dereference(pointer) __atomic_load_n(&(pointer), __ATOMIC_CONSUME)
+#define rcu_dereference_protected(pointer, condition) (pointer)
+#define rcu_access_pointer(pointer) READ_ONCE(pointer)
+#define RCU_INIT_POINTER(pointer, value) WRITE_ONCE(pointer, value)
+#define rcu_assign_pointer(pointer, value) __atomic_store_n(&(pointer), (value), __ATOMIC_RELEASE)
+#define rcu_replace_pointer(pointer, value, condition) __atomic_exchange_n(&(pointer), (value), __ATOMIC_ACQ_REL)
+
+/*
+MEMORY
+*/
+struct kmem_cache {
+    const char *name;
+    size_t size;
+    size_t align;
+};
+static inline struct kmem_cache *kmem_cache_create(const char *name, unsigned int size, unsigned int align, slab_flags_t flags, void (*ctor)(void*))
+{
+    struct kmem_cache *cache;
+    (void)ctor;
+    cache = (struct kmem_cache*)malloc(sizeof(*cache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    cache->name = name;
+    cache->align = (flags & SLAB_HWCACHE_ALIGN) ? 64 : (align != 0 ? align : sizeof(void*));
+    cache->size = (size + cache->align - 1) / cache->align * cache->align;
+    return cache;
+}
+static inline void kmem_cache_destroy(struct kmem_cache *cache) { free(cache); }
+static inline void *kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags) { (void)flags; return aligned_alloc(cache->align, cache->size); }
+static inline void *kmem_cache_alloc_node(struct kmem_cache *cache, gfp_t flags, int node) { (void)node; return kmem_cache_alloc(cache, flags); }
+static inline void kmem_cache_free(struct kmem_cache *cache, void *object) { (void)cache; free(object); }
+static inline void *kvmalloc_node(size_t size, gfp_t flags, int node) { (void)flags; (void)node; return malloc(size); }
+static inline void *kvmalloc_array(size_t count, size_t size, gfp_t flags) { (void)flags; return count != 0 && size > SIZE_MAX / count ? NULL : malloc(count * size); }
+static inline void *kvcalloc(size_t count, size_t size, gfp_t flags) { (void)flags; return calloc(count, size); }
+static inline void *kvmalloc(size_t size, gfp_t flags) { (void)flags; return malloc(size); }
+static inline void kvfree(const void *pointer) { free((void*)pointer); }
+#define kvfree_rcu(pointer, field) kvfree(pointer)
+static inline int numa_node_id(void) { return 0; }
+
+#define alloc_percpu(type) ((type*)calloc(1, sizeof(type)))
+#define free_percpu(pointer) free(pointer)
+#define this_cpu_inc(variable) ((variable)++)
+#define this_cpu_add(variable, addend) ((variable) += (addend))
+
+/*
+CHANNEL INDEX- a radix tree of 64-way nodes, grown in height as larger indexes are stored
+*/
+#define XA_CHUNK_SHIFT 6
+#define XA_CHUNK_SIZE (1UL << XA_CHUNK_SHIFT)
+#define XA_CHUNK_MASK (XA_CHUNK_SIZE - 1)
+
+struct xa_node {
+    void *slots[XA_CHUNK_SIZE];
+};
+
+struct xarray {
+    void *head; /*The root node, or the entry of index 0 while the height is 0*/
+    unsigned int height; /*The number of node levels*/
+    pthread_mutex_t lock; /*Serializes the writers of the index*/
+};
+
+/*Errors are returned as internal entries, the negative error shifted left by 2 and tagged with 2, like in the kernel*/
+static inline void *xa_mk_err(int error) { return (void*)(((intptr_t)error * 4) | 2); }
+static inline bool xa_is_err(const void *entry) { return ((uintptr_t)entry & 3) == 2 && (uintptr_t)entry >= (uintptr_t)xa_mk_err(-MAX_ERRNO); }
+static inline int xa_err(const void *entry) { return xa_is_err(entry) ? (int)((intptr_t)entry >> 2) : 0; }
+
+static inline void xa_init(struct xarray *xa)
+{
+    xa->head = NULL;
+    xa->height = 0;
+    pthread_mutex_init(&xa->lock, NULL);
+}
+
+/*Returns the largest index that a tree of the given height holds*/
+static inline unsigned long xa_max_index(unsigned int height)
+{
+    return height * XA_CHUNK_SHIFT >= sizeof(unsigned long) * 8 ? ~0UL : (1UL << (height * XA_CHUNK_SHIFT)) - 1;
+}
+
+static inline void *xa_load(struct xarray *xa, unsigned long index)
+{
+    void *entry;
+    unsigned int height;
+
+    height = __atomic_load_n(&xa->height, __ATOMIC_ACQUIRE);
+    entry = __atomic_load_n(&xa->head, __ATOMIC_ACQUIRE);
+    if (index > xa_max_index(height))
+    {
+        return NULL;
+    }
+    while (height != 0 && entry != NULL)
+    {
+        height--;
+        entry = __atomic_load_n(&((struct xa_node*)entry)->slots[(index >> (height * XA_CHUNK_SHIFT)) & XA_CHUNK_MASK], __ATOMIC_ACQUIRE);
+    }
+    return entry;
+}
+
+/*Returns the slot of an index, growing the tree and allocating its nodes as needed, or NULL on allocation failure*/
+static inline void **xa_shim_slot(struct xarray *xa, unsigned long index)
+{
+    struct xa_node *node;
+    void **slot;
+    unsigned int level;
+
+    while (index > xa_max_index(xa->height))
+    {
+        /*add a level on top, the old tree becomes the first child of the new root*/
+        node = (struct xa_node*)calloc(1, sizeof(*node));
+        if (node == NULL)
+        {
+            return NULL;
+        }
+        node->slots[0] = xa->head;
+        __atomic_store_n(&xa->head, (void*)node, __ATOMIC_RELEASE);
+        __atomic_store_n(&xa->height, xa->height + 1, __ATOMIC_RELEASE);
+    }
+    slot = &xa->head;
+    for (level = xa->height; level != 0; level--)
+    {
+        if (*slot == NULL)
+        {
+            node = (struct xa_node*)calloc(1, sizeof(*node));
+            if (node == NULL)
+            {
+                return NULL;
+            }
+            __atomic_store_n(slot, (void*)node, __ATOMIC_RELEASE);
+        }
+        slot = &((struct xa_node*)*slot)->slots[(index >> ((level - 1) * XA_CHUNK_SHIFT)) & XA_CHUNK_MASK];
+    }
+    return slot;
+}
+
+/*Frees the nodes on the path to an index that were left empty by an erase, as the kernel's xarray does*/
+static inline void xa_shim_prune(void **slot, unsigned int level, unsigned long index)
+{
+    struct xa_node *node;
+    unsigned int i;
+
+    if (level == 0 || *slot == NULL)
+    {
+        return;
+    }
+    node = (struct xa_node*)*slot;
+    xa_shim_prune(&node->slots[(index >> ((level - 1) * XA_CHUNK_SHIFT)) & XA_CHUNK_MASK], level - 1, index);
+    for (i = 0; i < XA_CHUNK_SIZE; i++)
+    {
+        if (node->slots[i] != NULL)
+        {
+            return;
+        }
+    }
+    __atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+    free(node);
+}
+
+static inline void *xa_cmpxchg(struct xarray *xa, unsigned long index, void *old_entry, void *new_entry, gfp_t flags)
+{
+    void **slot;
+    void *current_entry;
+
+    (void)flags;
+    pthread_mutex_lock(&xa->lock);
+    slot = xa_shim_slot(xa, index);
+    if (slot == NULL)
+    {
+        pthread_mutex_unlock(&xa->lock);
+        return xa_mk_err(-ENOMEM);
+    }
+    current_entry = *slot;
+    if (current_entry == old_entry)
+    {
+        __atomic_store_n(slot, new_entry, __ATOMIC_RELEASE);
+        if (new_entry == NULL)
+        {
+            xa_shim_prune(&xa->head, xa->height, index);
+        }
+    }
+    pthread_mutex_unlock(&xa->lock);
+    return current_entry;
+}
+
+static inline void *xa_erase(struct xarray *xa, unsigned long index)
+{
+    void *old_entry;
+
+    old_entry = xa_load(xa, index);
+    if (old_entry != NULL)
+    {
+        xa_cmpxchg(xa, index, old_entry, NULL, 0);
+    }
+    return old_entry;
+}
+
+/*Returns the first entry at an index of at least *index under a subtree, and sets *index to it*/
+static inline void *xa_shim_find(void *entry, unsigned int height, unsigned long base, unsigned long *index)
+{
+    unsigned long child_span;
+    unsigned long offset;
+    unsigned long child_base;
+    void *found;
+
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+    if (height == 0)
+    {
+        *index = base;
+        return entry;
+    }
+    child_span = 1UL << ((height - 1) * XA_CHUNK_SHIFT);
+    offset = *index > base ? (*index - base) / child_span : 0;
+    for (; offset < XA_CHUNK_SIZE; offset++)
+    {
+        child_base = base + offset * child_span;
+        if (*index < child_base)
+        {
+            *index = child_base;
+        }
+        found = xa_shim_find(((struct xa_node*)entry)->slots[offset], height - 1, child_base, index);
+        if (found != NULL)
+        {
+            return found;
+        }
+    }
+    return NULL;
+}
+
+/*Only XA_PRESENT is supported as the filter*/
+#define XA_PRESENT 0U
+
+static inline void *xa_find(struct xarray *xa, unsigned long *index, unsigned long max, unsigned int filter)
+{
+    void *entry;
+
+    (void)filter;
+    if (*index > max || *index > xa_max_index(xa->height))
+    {
+        return NULL;
+    }
+    entry = xa_shim_find(xa->head, xa->height, 0, index);
+    return entry != NULL && *index <= max ? entry : NULL;
+}
+
+#define xa_for_each(xa, index, entry) \
+    for ((index) = 0, (entry) = xa_find((xa), &(index), ~0UL, XA_PRESENT); (entry) != NULL; \
+         (entry) = ((index) == ~0UL ? NULL : ((index)++, xa_find((xa), &(index), ~0UL, XA_PRESENT))))
+
+/*Frees the nodes of a subtree*/
+static inline void xa_shim_free(void *entry, unsigned int height)
+{
+    unsigned int i;
+
+    if (entry == NULL || height == 0)
+    {
+        return;
+    }
+    for (i = 0; i < XA_CHUNK_SIZE; i++)
+    {
+        xa_shim_free(((struct xa_node*)entry)->slots[i], height - 1);
+    }
+    free(entry);
+}
+
+static inline void xa_destroy(struct xarray *xa)
+{
+    xa_shim_free(xa->head, xa->height);
+    xa->head = NULL;
+    xa->height = 0;
+}
+
+#endif /*MESSAGE_SLOT_SHIM_H*/
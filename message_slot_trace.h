@@ -0,0 +1,104 @@
+/*
+Tracepoints of the message_slot module, under events/message_slot in tracefs.
+They can be enabled at run time by perf, bpftrace or ftrace and cost a not taken branch otherwise.
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM message_slot
+
+#if !defined(MESSAGE_SLOT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define MESSAGE_SLOT_TRACE_H
+
+#include <linux/tracepoint.h> /*tracepoint.h for the TRACE_EVENT macros*/
+
+/*A read or a write of a message*/
+DECLARE_EVENT_CLASS(message_slot_message,
+    TP_PROTO(unsigned int minor, unsigned int channel_id, size_t length, ssize_t result),
+    TP_ARGS(minor, channel_id, length, result),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor) /*The minor of the device file*/
+        __field(unsigned int, channel_id) /*The channel that was read or written*/
+        __field(size_t, length) /*The size of the user's buffer*/
+        __field(ssize_t, result) /*The length of the message, or an error code*/
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->channel_id = channel_id;
+        __entry->length = length;
+        __entry->result = result;
+    ),
+    TP_printk("minor=%u channel=%u length=%zu result=%zd", __entry->minor, __entry->channel_id, __entry->length, __entry->result)
+);
+
+/*A read of a message, at the end of device_read_iter*/
+DEFINE_EVENT(message_slot_message, message_slot_read,
+    TP_PROTO(unsigned int minor, unsigned int channel_id, size_t length, ssize_t result),
+    TP_ARGS(minor, channel_id, length, result)
+);
+
+/*A write of a message, at the end of device_write_iter*/
+DEFINE_EVENT(message_slot_message, message_slot_write,
+    TP_PROTO(unsigned int minor, unsigned int channel_id, size_t length, ssize_t result),
+    TP_ARGS(minor, channel_id, length, result)
+);
+
+/*An open of a device file, at the end of device_open*/
+TRACE_EVENT(message_slot_open,
+    TP_PROTO(unsigned int minor, int result),
+    TP_ARGS(minor, result),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor) /*The minor of the device file*/
+        __field(int, result) /*0, or an error code*/
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->result = result;
+    ),
+    TP_printk("minor=%u result=%d", __entry->minor, __entry->result)
+);
+
+/*An ioctl of a device file, at the end of device_ioctl*/
+TRACE_EVENT(message_slot_ioctl,
+    TP_PROTO(unsigned int minor, unsigned int command, unsigned long param, long result),
+    TP_ARGS(minor, command, param, result),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor) /*The minor of the device file*/
+        __field(unsigned int, command) /*The ioctl command*/
+        __field(unsigned long, param) /*The ioctl argument*/
+        __field(long, result) /*The result of the ioctl*/
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->command = command;
+        __entry->param = param;
+        __entry->result = result;
+    ),
+    TP_printk("minor=%u command=0x%x param=0x%lx result=%ld", __entry->minor, __entry->command, __entry->param, __entry->result)
+);
+
+/*A lookup of a channel in the index of a message slot*/
+TRACE_EVENT(message_slot_channel_lookup,
+    TP_PROTO(unsigned int minor, unsigned int channel_id, unsigned long channel_count, bool found),
+    TP_ARGS(minor, channel_id, channel_count, found),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor) /*The minor of the message slot*/
+        __field(unsigned int, channel_id) /*The channel that was looked up*/
+        __field(unsigned long, channel_count) /*The number of channels in the slot's index*/
+        __field(bool, found) /*Whether the channel exists*/
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->channel_id = channel_id;
+        __entry->channel_count = channel_count;
+        __entry->found = found;
+    ),
+    TP_printk("minor=%u channel=%u channels=%lu found=%d", __entry->minor, __entry->channel_id, __entry->channel_count, __entry->found)
+);
+
+#endif /*MESSAGE_SLOT_TRACE_H*/
+
+/*This part must be outside the include guard*/
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE message_slot_trace
+#include <trace/define_trace.h>
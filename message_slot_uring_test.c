@@ -0,0 +1,328 @@
+#include "message_slot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h> /*For clock_gettime and nanosleep*/
+#include <fcntl.h> /*For file control options (e.g., O_RDONLY, O_WRONLY)*/
+#include <unistd.h> /*For POSIX operating system API (e.g., pwrite, close)*/
+#include <sys/ioctl.h> /*For I/O control device operations*/
+#include <sys/mman.h> /*For mapping the rings of io_uring*/
+#include <sys/syscall.h> /*For the io_uring system calls*/
+#include <linux/io_uring.h> /*For the io_uring structures, without depending on liburing*/
+
+/*
+A user space test of the message slot device under io_uring.
+It first checks that a blocking read submitted through io_uring waits for a new message instead of returning
+the one the file descriptor already read, then keeps thousands of writes in flight on the channels that
+the file offset selects and compares their ops/sec with the same writes done by pwrite:
+    ./message_slot_uring_test /dev/message_slot0 [in flight writes] [channels] [seconds]
+*/
+
+#define DEFAULT_IN_FLIGHT 4096
+#define DEFAULT_CHANNEL_COUNT 1024
+#define DEFAULT_DURATION_SECONDS 5
+#define TEST_MESSAGE_SIZE 64
+
+/*An io_uring instance, its submission and completion rings mapped from the kernel*/
+typedef struct uring {
+    int ring_file; /*The file descriptor of the io_uring instance*/
+    unsigned int entry_count; /*The number of submission queue entries*/
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring;
+
+/*Returns the time of the monotonic clock in nanoseconds*/
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*Exits with the error of a failed call*/
+static void fail(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+/*Sets up an io_uring instance with entry_count submission queue entries and maps its rings*/
+static void setup_uring(uring *ring, unsigned int entry_count)
+{
+    struct io_uring_params params;
+    size_t sq_size;
+    size_t cq_size;
+    char *sq_map;
+    char *cq_map;
+
+    memset(&params, 0, sizeof(params));
+    ring->ring_file = (int)syscall(__NR_io_uring_setup, entry_count, &params);
+    if (ring->ring_file < 0)
+    {
+        fail("io_uring_setup");
+    }
+    ring->entry_count = params.sq_entries;
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        /*Both rings share one mapping*/
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    sq_map = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_file, IORING_OFF_SQ_RING);
+    if (sq_map == MAP_FAILED)
+    {
+        fail("mmap");
+    }
+    cq_map = sq_map;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq_map = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_file, IORING_OFF_CQ_RING);
+        if (cq_map == MAP_FAILED)
+        {
+            fail("mmap");
+        }
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ring_file, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        fail("mmap");
+    }
+    ring->sq_head = (unsigned int*)(sq_map + params.sq_off.head);
+    ring->sq_tail = (unsigned int*)(sq_map + params.sq_off.tail);
+    ring->sq_mask = (unsigned int*)(sq_map + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)(sq_map + params.sq_off.array);
+    ring->cq_head = (unsigned int*)(cq_map + params.cq_off.head);
+    ring->cq_tail = (unsigned int*)(cq_map + params.cq_off.tail);
+    ring->cq_mask = (unsigned int*)(cq_map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq_map + params.cq_off.cqes);
+}
+
+/*Queues a read or write of a file at an offset, it is submitted by the next enter_uring*/
+static void queue_uring_io(uring *ring, unsigned char opcode, int file, void *buffer, unsigned int length, uint64_t offset, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail;
+
+    tail = *ring->sq_tail;
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = file;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*Submits the queued entries and waits for at least min_complete completions*/
+static void enter_uring(uring *ring, unsigned int submit_count, unsigned int min_complete)
+{
+    if (syscall(__NR_io_uring_enter, ring->ring_file, submit_count, min_complete, min_complete != 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0)
+    {
+        fail("io_uring_enter");
+    }
+}
+
+/*Takes the next completion, returns 0 if there is none*/
+static int reap_uring_completion(uring *ring, struct io_uring_cqe *cqe)
+{
+    unsigned int head;
+
+    head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+Checks that a blocking read through io_uring returns the new message and waits when there is none,
+like read(2) on a blocking file descriptor, instead of returning the last message again.
+*/
+static void test_blocking_read(const char *device_path)
+{
+    uring ring;
+    struct io_uring_cqe cqe;
+    struct timespec pause = {0, 100 * 1000 * 1000};
+    char buffer[TEST_MESSAGE_SIZE];
+    unsigned int channel_id;
+    int file;
+
+    file = open(device_path, O_RDWR);
+    if (file < 0)
+    {
+        fail("open");
+    }
+    channel_id = 1;
+    if (ioctl(file, MSG_SLOT_CHANNEL, channel_id) != 0)
+    {
+        fail("ioctl");
+    }
+    setup_uring(&ring, 8);
+    if (write(file, "first", 5) != 5)
+    {
+        fail("write");
+    }
+    queue_uring_io(&ring, IORING_OP_READ, file, buffer, sizeof(buffer), 0, 1);
+    enter_uring(&ring, 1, 1);
+    if (!reap_uring_completion(&ring, &cqe) || cqe.res != 5 || memcmp(buffer, "first", 5) != 0)
+    {
+        fprintf(stderr, "FAIL: the first io_uring read returned %d\n", cqe.res);
+        exit(1);
+    }
+    /*the message was read, the next read must wait for a new one*/
+    queue_uring_io(&ring, IORING_OP_READ, file, buffer, sizeof(buffer), 0, 2);
+    enter_uring(&ring, 1, 0);
+    nanosleep(&pause, NULL);
+    if (reap_uring_completion(&ring, &cqe))
+    {
+        fprintf(stderr, "FAIL: an io_uring read returned %d without a new message\n", cqe.res);
+        exit(1);
+    }
+    if (write(file, "second", 6) != 6)
+    {
+        fail("write");
+    }
+    enter_uring(&ring, 0, 1);
+    if (!reap_uring_completion(&ring, &cqe) || cqe.res != 6 || memcmp(buffer, "second", 6) != 0)
+    {
+        fprintf(stderr, "FAIL: the waiting io_uring read returned %d\n", cqe.res);
+        exit(1);
+    }
+    printf("blocking read: ok\n");
+    close(ring.ring_file);
+    close(file);
+}
+
+/*
+Keeps in_flight writes submitted through io_uring on the channels that the offset selects,
+a completed write is submitted again to the next channel.
+Returns the completed writes per second.
+*/
+static double run_uring_writes(int file, unsigned int in_flight, unsigned int channel_count, unsigned int duration_seconds)
+{
+    uring ring;
+    struct io_uring_cqe cqe;
+    static char message[TEST_MESSAGE_SIZE];
+    uint64_t start;
+    uint64_t end;
+    uint64_t completed;
+    uint64_t next_channel;
+    unsigned int reaped;
+    unsigned int i;
+
+    setup_uring(&ring, in_flight);
+    if (in_flight > ring.entry_count)
+    {
+        in_flight = ring.entry_count;
+    }
+    memset(message, 'u', sizeof(message));
+    next_channel = 0;
+    for (i = 0; i < in_flight; i++)
+    {
+        queue_uring_io(&ring, IORING_OP_WRITE, file, message, sizeof(message), next_channel++ % channel_count + 1, 0);
+    }
+    completed = 0;
+    start = now_ns();
+    end = start + duration_seconds * 1000000000ULL;
+    enter_uring(&ring, in_flight, 1);
+    while (now_ns() < end)
+    {
+        reaped = 0;
+        while (reap_uring_completion(&ring, &cqe))
+        {
+            if (cqe.res != (int)sizeof(message))
+            {
+                fprintf(stderr, "An io_uring write failed: %s\n", strerror(-cqe.res));
+                exit(1);
+            }
+            queue_uring_io(&ring, IORING_OP_WRITE, file, message, sizeof(message), next_channel++ % channel_count + 1, 0);
+            reaped++;
+        }
+        completed += reaped;
+        enter_uring(&ring, reaped, 1);
+    }
+    end = now_ns();
+    close(ring.ring_file);
+    return completed / ((end - start) / 1e9);
+}
+
+/*Writes to the channels that the offset selects with one pwrite per message, returns the writes per second*/
+static double run_sync_writes(int file, unsigned int channel_count, unsigned int duration_seconds)
+{
+    static char message[TEST_MESSAGE_SIZE];
+    uint64_t start;
+    uint64_t end;
+    uint64_t completed;
+
+    memset(message, 's', sizeof(message));
+    completed = 0;
+    start = now_ns();
+    end = start + duration_seconds * 1000000000ULL;
+    while ((completed & 1023) != 0 || now_ns() < end)
+    {
+        if (pwrite(file, message, sizeof(message), completed % channel_count + 1) != (ssize_t)sizeof(message))
+        {
+            fail("pwrite");
+        }
+        completed++;
+    }
+    end = now_ns();
+    return completed / ((end - start) / 1e9);
+}
+
+int main(int argc, char const *argv[])
+{
+    unsigned int in_flight;
+    unsigned int channel_count;
+    unsigned int duration_seconds;
+    double uring_rate;
+    double sync_rate;
+    int file;
+
+    if (argc < 2 || argc > 5)
+    {
+        fprintf(stderr, "Program gets 1 to 4 command line arguments: <device file> [in flight writes] [channels] [seconds]\n");
+        exit(1);
+    }
+    in_flight = argc > 2 ? (unsigned int)strtoul(argv[2], NULL, 10) : DEFAULT_IN_FLIGHT;
+    channel_count = argc > 3 ? (unsigned int)strtoul(argv[3], NULL, 10) : DEFAULT_CHANNEL_COUNT;
+    duration_seconds = argc > 4 ? (unsigned int)strtoul(argv[4], NULL, 10) : DEFAULT_DURATION_SECONDS;
+    if (in_flight == 0 || channel_count == 0 || duration_seconds == 0)
+    {
+        fprintf(stderr, "The in flight writes, channels and seconds must be positive\n");
+        exit(1);
+    }
+
+    test_blocking_read(argv[1]);
+
+    /*a file descriptor with no channel, the offset of every write selects its channel*/
+    file = open(argv[1], O_WRONLY);
+    if (file < 0)
+    {
+        fail("open");
+    }
+    uring_rate = run_uring_writes(file, in_flight, channel_count, duration_seconds);
+    sync_rate = run_sync_writes(file, channel_count, duration_seconds);
+    printf("{\"in_flight\": %u, \"channels\": %u, \"message_size\": %d, \"uring_ops_per_sec\": %.0f, \"pwrite_ops_per_sec\": %.0f}\n",
+           in_flight, channel_count, TEST_MESSAGE_SIZE, uring_rate, sync_rate);
+    close(file);
+    exit(0);
+}